@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -83,9 +84,20 @@ display_current_status(C1394CameraNode& camera)
   FRAMERATE rate;
   camera.QueryFormat(&fmt,&mode,&rate);
 
-  cout << ::GetImageWidth(fmt,mode) <<"x"<< ::GetImageHeight(fmt,mode) 
-       <<" "<< ::GetVideoFormatString(fmt,mode) 
-       <<"@"<< 1.875f*(1<<rate) <<"fps";
+  Format7Info f7;
+  if (Format_7 == fmt && camera.QueryFormat7Info(mode, &f7)) {
+      cout << f7.width <<"x"<< f7.height
+	   <<"+"<< f7.left <<"+"<< f7.top
+	   <<" Format_7/Mode_"<< mode
+	   <<" coding "<< f7.color_coding
+	   <<" "<< f7.bytes_per_packet <<"bytes/packet";
+      if (f7.packets_per_frame > 0)
+	  cout <<"@"<< 8000.f/f7.packets_per_frame <<"fps";
+  } else {
+      cout << ::GetImageWidth(fmt,mode) <<"x"<< ::GetImageHeight(fmt,mode) 
+	   <<" "<< ::GetVideoFormatString(fmt,mode) 
+	   <<"@"<< 1.875f*(1<<rate) <<"fps";
+  }
   SPD speed;
   camera.QueryIsoSpeed(&speed);
   cout << " "<<::GetSpeedString(speed) <<endl;
@@ -315,8 +327,9 @@ savetofile(C1394CameraNode& camera,char *fname)
     return 0;
 }
 
-#ifdef IPL_IMG_SUPPORTED
-
+/*
+ * returns BAYER_* of the code, which is named as OpenCV does.
+ */
 static int 
 get_bayer_code(const char *string)
 {
@@ -328,20 +341,17 @@ get_bayer_code(const char *string)
     static const char *tbl[]={
 	"BG","GB","RG","GR",NULL,
     };
-    int code = 46;
-    const char **cur = tbl;
-    while (NULL!=*cur){
-	if (0==strcasecmp(string, *cur)){
-	    return code;
+    static const int pattern[]={
+	BAYER_RGGB, BAYER_GRBG, BAYER_BGGR, BAYER_GBRG,
+    };
+    for (int i=0; NULL!=tbl[i]; i++){
+	if (0==strcasecmp(string, tbl[i])){
+	    return pattern[i];
 	}
-	code++;
-	cur++;
     }
     return -1;
 }
 
-#endif /* #ifdef IPL_IMG_SUPPORTED */
-
 int 
 display_live_image_on_X(C1394CameraNode &cam, const char *fmt, 
 			double scale, int draw_fps)
@@ -360,6 +370,7 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
 
   const int w = cam.GetImageWidth();
   const int h = cam.GetImageHeight();
+  const int bayer = get_bayer_code(fmt);
 
 #ifndef IPL_IMG_SUPPORTED
   /* make a Window */
@@ -376,7 +387,10 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
   while (1){
     RGBA tmp[w*h];
     cam.UpdateFrameBuffer();
-    cam.CopyRGBAImage(tmp);
+    if (bayer < 0)
+	cam.CopyRGBAImage(tmp);
+    else
+	cam.CopyRGBAImageBayer(tmp, bayer);
     xview.UpDate(tmp);
   }
 #else  /* #ifndef IPL_IMG_SUPPORTED */
@@ -391,32 +405,28 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
   char *argv[]={tmp};
   cvInitSystem(argc, argv);
   cvNamedWindow("disp", !0);
-  int ch=3;
+  const int ch=3;
   IplImage *img = NULL;
-  IplImage *buf = NULL;
   IplImage *resize = NULL;
 
-  int buf_option=0;
-
-  if (fmt){
-      int code = get_bayer_code(fmt);
-      if (code>0){
-	  buf = cvCreateImage(cvSize(w,h), IPL_DEPTH_8U, 3);     
-	  buf_option = code;
-      }
+  // downscale while converting, if the scale is 1/2, 1/4, ...
+  // (only 1/2 for bayer.)
+  int factor = 0;
+  if (scale < 1. && scale > 0.) {
+      factor = cvRound(1./scale);
+      if (factor < 2 || fabs(1./factor - scale) > 1e-6)
+	  factor = 0;
+      if (bayer >= 0 && factor != 2)
+	  factor = 0;
   }
-
-  if (!buf){
-      ch = 3;
-  } else {      
-      // bayer conversion.
-      ch = 1;
+  if (factor) {
+      resize = cvCreateImage(cvSize(w/factor, h/factor), IPL_DEPTH_8U, ch);
+  } else {
+      img = cvCreateImage(cvSize(w,h), IPL_DEPTH_8U, ch);
   }
-  img = cvCreateImage(cvSize(w,h), IPL_DEPTH_8U, ch);
-  if (scale != 1.) {
-      int channel = (buf)?buf->nChannels:ch;
+  if (scale != 1. && !factor) {
       resize = cvCreateImage(cvSize(cvRound(w*scale), cvRound(h*scale)),
-			     IPL_DEPTH_8U, channel);
+			     IPL_DEPTH_8U, ch);
   }
 
   unsigned int lastcycle = 0;
@@ -431,19 +441,18 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
 	  ABORT("UpdateFrameBuffer() failed.");
       }
 
-      switch (ch){
-      case 3:
-	  cam.CopyIplImage(img);
-	  break;
-      case 1:
-	  cam.CopyIplImageGray(img);
-	  break;
-      }
-      if (buf){
-	  cvCvtColor(img, buf, buf_option);
-      }
-      if (resize) {
-	  cvResize(buf?buf:img, resize);
+      if (factor && bayer >= 0) {
+	  cam.CopyIplImageBayer(resize, bayer, C1394CameraNode::DEMOSAIC_HALF);
+      } else if (factor) {
+	  cam.CopyIplImageScaled(resize, factor);
+      } else {
+	  if (bayer < 0)
+	      cam.CopyIplImage(img);
+	  else
+	      cam.CopyIplImageBayer(img, bayer);
+	  if (resize) {
+	      cvResize(img, resize);
+	  }
       }
 
       int diff = (info.timestamp - lastcycle)&0xffff;
@@ -452,7 +461,7 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
 	  << setw(5) << setprecision(3) << 1000./(diff*0.125) << " fps");
       lastcycle = info.timestamp;
 
-      IplImage *tmp = resize?resize:(buf?buf:img);
+      IplImage *tmp = resize?resize:img;
       if (draw_fps) {
 	  timeval current;
 	  gettimeofday(&current, NULL);
@@ -471,7 +480,6 @@ display_live_image_on_X(C1394CameraNode &cam, const char *fmt,
       
   }
   cvReleaseImage(&img);
-  cvReleaseImage(&buf);
   cvReleaseImage(&resize);
 #endif   /* #ifndef IPL_IMG_SUPPORTED */
   return 0;
@@ -526,6 +534,14 @@ int main(int argc, char *argv[]){
     const char *opt_filename=NULL;   /* filename to save frame(s). */
     const char *target_cameras=NULL; /* target camera(s) */
     const char *opt_power = NULL;    /**< power "on" or "off"  */
+    const char *opt_roi = NULL;          /**< format_7 ROI */
+    int  opt_color_coding = -1;          /**< format_7 color coding */
+    int  opt_packet_size = -1;           /**< format_7 bytes per packet */
+    int  do_tune_packet_size = -1;
+    const char *opt_profile = NULL;      /**< profile to apply */
+    const char *opt_save_profile = NULL; /**< file to save profile */
+    int  opt_recall_memory = -1;         /**< memory channel to recall */
+    int  opt_save_memory = -1;           /**< memory channel to save */
 
     const char *cp[END_OF_FEATURE]; /* camera's parameter. 
 				       "NULL"  means the value isn't set. */
@@ -606,6 +622,22 @@ int main(int argc, char *argv[]){
 	  "rate",  "RATE"},
 	{ "speed",    's',  POPT_ARG_INT, &spd, 's',
 	  "bus speed (0=100M,1=200M,2=400M)", "SPD" } ,
+	{ "roi", 0,  POPT_ARG_STRING, &opt_roi, 0,
+	  "format_7 region of interest", "LEFT,TOP,WIDTH,HEIGHT" } ,
+	{ "color_coding", 0,  POPT_ARG_INT, &opt_color_coding, 0,
+	  "format_7 color coding (0=MONO8,...,9=RAW8,10=RAW16)", "CODING" } ,
+	{ "packet_size", 0,  POPT_ARG_INT, &opt_packet_size, 0,
+	  "format_7 bytes per packet", "BYTES" } ,
+	{ "tune_packet_size", 0,  POPT_ARG_NONE, &do_tune_packet_size, 0,
+	  "choose format_7 packet size sharing the bus fairly", NULL } ,
+	{ "profile", 0,  POPT_ARG_STRING, &opt_profile, 0,
+	  "apply settings in the profile", "FILE" } ,
+	{ "save_profile", 0,  POPT_ARG_STRING, &opt_save_profile, 0,
+	  "save current settings to the profile", "FILE" } ,
+	{ "recall_memory", 0,  POPT_ARG_INT, &opt_recall_memory, 0,
+	  "recall settings from the memory channel (0=factory)", "CH" } ,
+	{ "save_memory", 0,  POPT_ARG_INT, &opt_save_memory, 0,
+	  "save current settings to the memory channel", "CH" } ,
 	{ NULL, 0, 0, NULL, 0 }
     };
 
@@ -920,6 +952,30 @@ int main(int argc, char *argv[]){
 	}
     }
 
+    // recall memory channel before the other settings.
+    if (-1 != opt_recall_memory){
+	int n = RecallMemoryChannelAll(TargetList, opt_recall_memory);
+	if (n != (int)TargetList.size()){
+	    ERR("failed to recall memory channel " << opt_recall_memory
+		<< " on " << TargetList.size() - n << " camera(s).");
+	}
+    }
+
+    // apply profile before the individual settings.
+    if (opt_profile){
+	C1394CameraProfile profile;
+	if (profile.Load(opt_profile)){
+	    ERR("failed to load profile " << opt_profile);
+	    return -1;
+	}
+	for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
+	    if (cam->ApplyProfile(profile) < 0){
+		ERR("failed to apply profile to camera "
+		    << MAKE_CAMERA_ID(cam->GetID(), magic_number));
+	    }
+	}
+    }
+
     // set camera register for each feature.
     for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
 	set_camera_feature( &(*cam), cp);
@@ -956,6 +1012,37 @@ int main(int argc, char *argv[]){
 	    }
         }
     }
+    // set format_7 parameters
+    if (opt_roi || opt_color_coding!=-1 || opt_packet_size!=-1){
+	int left=0, top=0, width=0, height=0;
+	if (opt_roi && 4!=sscanf(opt_roi, "%d,%d,%d,%d",
+				 &left, &top, &width, &height)){
+	    ERR("bad ROI " << opt_roi);
+	    return -1;
+	}
+	for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
+	    FORMAT f; VMODE m; FRAMERATE r;
+	    cam->QueryFormat(&f,&m,&r);
+	    if (Format_7 != f){
+		ERR("camera "<< MAKE_CAMERA_ID(cam->GetID(), magic_number)
+		    << " is not in format_7.");
+		continue;
+	    }
+	    if (opt_color_coding!=-1)
+		cam->SetFormat7ColorCoding(m, (COLOR_CODING)opt_color_coding);
+	    if (opt_roi)
+		cam->SetFormat7ROI(m, left, top, width, height);
+	    if (opt_packet_size!=-1)
+		cam->SetFormat7BytePerPacket(m, opt_packet_size);
+	}
+    }
+
+    if (do_tune_packet_size!=-1){
+	if (!TuneFormat7PacketSizeAll(TargetList)){
+	    ERR("failed to tune packet size.");
+	}
+    }
+
     // set iso speed
     if (spd!=-1) {
 	for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
@@ -971,6 +1058,31 @@ int main(int argc, char *argv[]){
 	    }
 	}
     }
+
+    // save memory channel
+    if (-1 != opt_save_memory){
+	for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
+	    if (!cam->SaveMemoryChannel(opt_save_memory)){
+		ERR("failed to save memory channel of camera "
+		    << MAKE_CAMERA_ID(cam->GetID(), magic_number));
+	    }
+	}
+    }
+
+    // save profile
+    if (opt_save_profile){
+	if (is_all){
+	    MSG("profile of the first camera is saved.");
+	}
+	C1394CameraProfile profile;
+	cam=TargetList.begin();
+	bool ok = cam->QueryProfile(&profile);
+	if (-1 != opt_save_memory)
+	    profile.m_memory_channel = opt_save_memory;
+	if (!ok || profile.Save(opt_save_profile)){
+	    ERR("failed to save profile " << opt_save_profile);
+	}
+    }
       
     // stop camere(s)
     if (do_stop!=-1){
@@ -1010,9 +1122,9 @@ int main(int argc, char *argv[]){
 
     // start camere(s)
     if (do_start!=-1 || do_oneshot!=-1 ){
-	for ( cam=TargetList.begin(); cam!=TargetList.end(); cam++){
-	    LOG("start");
-	    cam->StartIsoTx();
+	LOG("start");
+	if (!StartIsoTxAll(TargetList)){
+	    ERR("failed to start some camera(s).");
 	}
     }
 
@@ -26,6 +26,8 @@
 #include <libraw1394/raw1394.h>
 #include <libraw1394/csr.h>
 #include <stdlib.h>
+#include <map>
+#include <algorithm>
 
 #include "1394cam_drv.h"
 
@@ -42,23 +44,14 @@
 #include "common.h"
 #include "1394cam_registers.h"
 #include "1394cam.h"
+#include "1394cam_internal.h"
 #include "yuv.h"
 
 
 using namespace std;
 
-#define CHK_PARAM(exp) {if (!(exp)) LOG( "illegal param passed. " << __STRING(exp)); }
-#define EXCEPT_FOR_FORMAT_6_ONLY  {if (is_format6) return false;}
-
-#define Addr(name) (m_command_regs_base+OFFSET_##name)
-#define EQU(val,mask,pattern)  (0==(((val)&(mask))^(pattern)))
-
-#define ADDR_CONFIGURATION_ROM        (CSR_REGISTER_BASE + CSR_CONFIG_ROM)
-
-#define WAIT usleep(500)
-
 // string-table for feature codes
-static const char *feature_table[]={
+const char *feature_table[]={
     "brightness" ,   // +0
     "auto_exposure" ,   
     "sharpness" ,
@@ -95,7 +88,7 @@ static const char *feature_table[]={
     NULL
 };
 
-static const char *featurestate_table[]=
+const char *featurestate_table[]=
 {
   "off",
   "auto",
@@ -386,16 +379,16 @@ get_extended_unique_identifier(C1394CameraNode *pNode,
  * @param handle 
  * @param node_id 
  * @param pNode 
- * @param arg 
+ * @param arg      pointer to the C1394PortRef of the port.
  * 
  * @return   true if the node is 1394-based camera.
  */
-static int 
+int 
 callback_1394Camera(raw1394handle_t handle, nodeid_t node_id,
 		    C1394CameraNode* pNode, raw1394_portinfo* portinfo, 
 		    void* arg)
 {
-    long port_no = (long)arg;
+    C1394PortRef *port = (C1394PortRef*)arg;
 
     // search  "root_directory"
     nodeaddr_t addr_root;
@@ -466,9 +459,11 @@ callback_1394Camera(raw1394handle_t handle, nodeid_t node_id,
     }
     
     // store the infomation of this camera-device.
-    pNode->m_handle  = raw1394_new_handle_on_port(port_no);
+    // the handle of the port is shared and created on demand.
+    pNode->m_port    = *port;
+    pNode->m_handle  = NULL;
     pNode->m_node_id = node_id;
-    pNode->m_port_no = port_no;
+    pNode->m_port_no = port->GetPortNo();
     strncpy(pNode->m_devicename, portinfo->name, sizeof(pNode->m_devicename));
     return true;
 }
@@ -553,23 +548,154 @@ GetCameraList(raw1394handle_t handle, CCameraList* pList)
 
     int i;
     for (i = 0; i< numcards; i++) {
-	raw1394handle_t new_handle = raw1394_new_handle();
-
-	if (raw1394_set_port(new_handle, i) < 0) {
+	// the handle is kept for the cameras found on this port, and
+	// released when the last of them is destroyed.
+	C1394PortRef port;
+	port.Attach(i);
+	raw1394handle_t port_handle = port.GetHandle();
+	if (!port_handle) {
 	    ERR("couldn't set port. "<< strerror(errno));
 	    return false;
 	}
-	size_t pre = pList->size();
-	Enum1394Node(new_handle, &portinfo[i],
+	scoped_lock lock(get_handle_lock(port_handle));
+	Enum1394Node(port_handle, &portinfo[i],
 		     pList, callback_1394Camera, 
-		     (void*)i);
-	raw1394_destroy_handle(new_handle);
+		     (void*)&port);
     }
     return true;
 }
 
 // ------------------------------------------------------------
 
+/*
+ * a raw1394 handle shared by the cameras on a port.
+ */
+struct port_handle {
+    int             port_no;
+    raw1394handle_t handle;     // NULL until it is needed
+    int             refcount;
+};
+
+static pthread_mutex_t port_handle_guard = PTHREAD_MUTEX_INITIALIZER;
+static std::map<int, port_handle*> port_handles;
+
+/**
+ * @class C1394PortRef 1394cam.h
+ *
+ * The cameras found on the same port share one raw1394 handle. The
+ * handle is created when a camera first accesses its registers, and
+ * destroyed when the last C1394PortRef of the port is released, so
+ * copies of CCameraList may be made and destroyed freely.
+ */
+
+C1394PortRef::C1394PortRef()
+    : m_port(NULL)
+{
+}
+
+C1394PortRef::C1394PortRef(const C1394PortRef& ref)
+    : m_port(NULL)
+{
+    *this = ref;
+}
+
+C1394PortRef::~C1394PortRef()
+{
+    Detach();
+}
+
+C1394PortRef&
+C1394PortRef::operator=(const C1394PortRef& ref)
+{
+    if (m_port == ref.m_port)
+	return *this;
+    Detach();
+    if (ref.m_port){
+	pthread_mutex_lock(&port_handle_guard);
+	ref.m_port->refcount++;
+	m_port = ref.m_port;
+	pthread_mutex_unlock(&port_handle_guard);
+    }
+    return *this;
+}
+
+/**
+ * Refers to the handle of the port.
+ *
+ * @param port_no
+ */
+void
+C1394PortRef::Attach(int port_no)
+{
+    Detach();
+    pthread_mutex_lock(&port_handle_guard);
+    port_handle *&p = port_handles[port_no];
+    if (!p){
+	p = new port_handle;
+	p->port_no = port_no;
+	p->handle = NULL;
+	p->refcount = 0;
+    }
+    p->refcount++;
+    m_port = p;
+    pthread_mutex_unlock(&port_handle_guard);
+}
+
+/**
+ * Releases the reference. The handle is destroyed with the last one.
+ */
+void
+C1394PortRef::Detach()
+{
+    if (!m_port)
+	return;
+    pthread_mutex_lock(&port_handle_guard);
+    if (0 == --m_port->refcount){
+	if (m_port->handle){
+	    LOG("destroy the handle of port " << m_port->port_no);
+	    raw1394_destroy_handle(m_port->handle);
+	}
+	port_handles.erase(m_port->port_no);
+	delete m_port;
+    }
+    m_port = NULL;
+    pthread_mutex_unlock(&port_handle_guard);
+}
+
+/**
+ * @return the port number, or -1 if not attached.
+ */
+int
+C1394PortRef::GetPortNo() const
+{
+    return m_port ? m_port->port_no : -1;
+}
+
+/**
+ * Returns the handle of the port, creating it on the first call.
+ *
+ * @return the handle, or NULL if an error occurred.
+ */
+raw1394handle_t
+C1394PortRef::GetHandle()
+{
+    if (!m_port)
+	return NULL;
+    pthread_mutex_lock(&port_handle_guard);
+    if (!m_port->handle){
+	LOG("create the handle of port " << m_port->port_no);
+	m_port->handle = raw1394_new_handle_on_port(m_port->port_no);
+	if (!m_port->handle)
+	    ERR("couldn't open port " << m_port->port_no << ". "
+		<< strerror(errno));
+    }
+    raw1394handle_t handle = m_port->handle;
+    pthread_mutex_unlock(&port_handle_guard);
+    return handle;
+}
+
+// ------------------------------------------------------------
+
 /**
  * @class C1394Node 1394cam.h
  * @brief container for 1394-node
@@ -580,9 +706,105 @@ GetCameraList(raw1394handle_t handle, CCameraList* pList)
  * @class C1394CameraNode 1394cam.h
  * @brief container for 1394-based digital camera.
  *
- * 
+ * Threading model:
+ *
+ * - The register access (ReadReg(), WriteReg(), the Set*()/Query*()
+ *   functions, ...) is serialized by a recursive lock per raw1394
+ *   handle, so the camera may be controlled from several threads.
+ *   A read-modify-write of a register done by a single function is
+ *   atomic. Use Lock() and Unlock() to make a sequence of calls
+ *   atomic.
+ *
+ * - UpdateFrameBuffer(), WaitFrameBuffer() and the Copy*() functions
+ *   don't touch the raw1394 handle nor take the lock, so one capture
+ *   thread can run them while other threads control the camera.
+ *   Only one thread may capture from a camera at a time.
+ *
+ * - The Copy*() functions may hand the bands of a frame to the
+ *   worker threads of SetConversionThreads(), and return when all
+ *   bands are done.
+ *
+ * - AllocateFrameBuffer() and SwitchFormat() replace the frame
+ *   buffer; the capture thread must be stopped while they run.
+ *
+ * - The LUTs for the color conversion are built once, and
+ *   CreateYUVtoRGBAMap() may be called from any thread.
  */
 
+/*
+ * recursive locks for the raw1394 handles. A raw1394 handle is not
+ * thread safe, and the cameras sharing a handle share the lock. The
+ * locks are never released, since a handle may be reused.
+ */
+static pthread_mutex_t handle_lock_guard = PTHREAD_MUTEX_INITIALIZER;
+static std::map<raw1394handle_t, pthread_mutex_t*> handle_locks;
+
+pthread_mutex_t*
+get_handle_lock(raw1394handle_t handle)
+{
+    pthread_mutex_lock(&handle_lock_guard);
+    pthread_mutex_t *&lock = handle_locks[handle];
+    if (!lock){
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	lock = new pthread_mutex_t;
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+    }
+    pthread_mutex_t *r = lock;
+    pthread_mutex_unlock(&handle_lock_guard);
+    return r;
+}
+
+pthread_mutex_t*
+C1394CameraNode::GetLock()
+{
+    raw1394handle_t handle = GetHandle();
+    if (!m_lock || m_lock_handle != handle){
+	m_lock = get_handle_lock(handle);
+	m_lock_handle = handle;
+    }
+    return m_lock;
+}
+
+/**
+ * Returns the raw1394 handle for the register access.
+ *
+ * The handle of the port is created on the first call, and shared by
+ * the cameras on the same port.
+ *
+ * @return the handle, or NULL if an error occurred.
+ */
+raw1394handle_t
+C1394CameraNode::GetHandle()
+{
+    if (!m_handle)
+	m_handle = m_port.GetHandle();
+    return m_handle;
+}
+
+/**
+ * Locks the register access to the camera.
+ *
+ * The lock is recursive, and is shared with the cameras using the
+ * same raw1394 handle. Don't change m_handle while locked.
+ */
+void
+C1394CameraNode::Lock()
+{
+    pthread_mutex_lock(GetLock());
+}
+
+/**
+ * Unlocks the register access locked by Lock().
+ */
+void
+C1394CameraNode::Unlock()
+{
+    pthread_mutex_unlock(GetLock());
+}
+
 /**
  * @struct BufferInfo  1394cam.h
  * @brief  frame buffer parameters
@@ -598,10 +820,11 @@ GetCameraList(raw1394handle_t handle, CCameraList* pList)
  */
 bool C1394CameraNode::ReadReg(nodeaddr_t addr,quadlet_t* value)
 {
+    scoped_lock lock(GetLock());
     int retry=4;
     //*value=0x12345678;    
     while (retry-- > 0){
-	int retval = raw1394_read(m_handle, m_node_id, addr, 4, value);
+	int retval = raw1394_read(GetHandle(), m_node_id, addr, 4, value);
 	if (retval >= 0){
 	    *value = (quadlet_t)ntohl((unsigned long int)*value);    
 	    return true;
@@ -620,10 +843,11 @@ bool C1394CameraNode::ReadReg(nodeaddr_t addr,quadlet_t* value)
  */
 bool C1394CameraNode::WriteReg(nodeaddr_t addr,quadlet_t* value)
 {
+    scoped_lock lock(GetLock());
     int retry=4;
     quadlet_t tmp=htonl(*value);
     while (retry-- > 0){
-	int retval = raw1394_write(m_handle, m_node_id, addr, 4, &tmp);
+	int retval = raw1394_write(GetHandle(), m_node_id, addr, 4, &tmp);
 	if (retval >= 0){
 	    return true;
 	}
@@ -632,6 +856,126 @@ bool C1394CameraNode::WriteReg(nodeaddr_t addr,quadlet_t* value)
     return false;
 }
 
+/**
+ * Read the successive configuration registers with a block transaction.
+ *
+ * Falls back to quadlet reads if the camera rejects block reads.
+ *
+ * @param addr    address of the first register.
+ * @param value   array to store the registers.
+ * @param count   number of registers to read.
+ *
+ * @return True on succeed, or false otherwise.
+ */
+bool C1394CameraNode::ReadRegBlock(nodeaddr_t addr, quadlet_t* value, int count)
+{
+    scoped_lock lock(GetLock());
+    int retry=4;
+    while (retry-- > 0){
+	int retval = raw1394_read(GetHandle(), m_node_id, addr, 4*count, value);
+	if (retval >= 0){
+	    for (int i=0; i<count; i++)
+		value[i] = (quadlet_t)ntohl((unsigned long int)value[i]);
+	    return true;
+	}
+	WAIT;
+    }
+    DBG("block read failed, retry with quadlet reads.");
+    for (int i=0; i<count; i++){
+	if (!ReadReg(addr + 4*i, &value[i]))
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * per-request state for WriteRegBatch()
+ */
+struct batch_request {
+    raw1394_reqhandle reqhandle;
+    quadlet_t data;
+    bool done;
+    raw1394_errcode_t err;
+};
+
+static int
+callback_batch_request(raw1394handle_t handle, void *data,
+		       raw1394_errcode_t err)
+{
+    batch_request *req = (batch_request*)data;
+    req->done = true;
+    req->err = err;
+    return 0;
+}
+
+/**
+ * Write the configuration registers as a batch.
+ *
+ * All requests are issued asynchronously before waiting for their
+ * responses, so the writes cost roughly one round trip in total
+ * instead of one per register. Requests that fail are retried by
+ * WriteReg().
+ *
+ * @param addr    array of register addresses.
+ * @param value   array of values to write.
+ * @param count   number of registers to write.
+ *
+ * @return True on succeed, or false otherwise.
+ */
+bool C1394CameraNode::WriteRegBatch(const nodeaddr_t* addr,
+				    const quadlet_t* value, int count)
+{
+    if (count <= 0)
+	return true;
+
+    scoped_lock lock(GetLock());
+    batch_request *req = new batch_request[count];
+    int pending = 0;
+    for (int i=0; i<count; i++){
+	req[i].reqhandle.callback = callback_batch_request;
+	req[i].reqhandle.data = &req[i];
+	req[i].data = htonl(value[i]);
+	req[i].done = false;
+	req[i].err = 0;
+	if (0 > raw1394_start_write(GetHandle(), m_node_id, addr[i], 4,
+				    &req[i].data,
+				    (unsigned long)&req[i].reqhandle)){
+	    // not issued; leave it to the synchronous path below.
+	    req[i].done = true;
+	    req[i].err = -1;
+	    continue;
+	}
+	pending++;
+    }
+
+    while (pending > 0){
+	if (0 > raw1394_loop_iterate(GetHandle())){
+	    ERR("raw1394_loop_iterate() failed. " << strerror(errno));
+	    break;
+	}
+	pending = 0;
+	for (int i=0; i<count; i++)
+	    if (!req[i].done)
+		pending++;
+    }
+
+    if (pending > 0){
+	// responses may still arrive, so req[] must not be released here.
+	return false;
+    }
+
+    bool r = true;
+    for (int i=0; i<count; i++){
+	if (0 == req[i].err || 0 == raw1394_errcode_to_errno(req[i].err))
+	    continue;
+	quadlet_t tmp = value[i];
+	if (!WriteReg(addr[i], &tmp))
+	    r = false;
+    }
+    delete[] req;
+    return r;
+}
+
 
 C1394CameraNode::C1394CameraNode()
 {
@@ -642,6 +986,13 @@ C1394CameraNode::C1394CameraNode()
   m_lpVenderName=NULL;
 
   driver = NULL;
+  memset(m_format7_csr, 0, sizeof(m_format7_csr));
+  m_lock_handle = NULL;
+  m_lock = NULL;
+  m_handle = NULL;
+  m_y16_depth = 16;
+  m_conv = NULL;
+  m_frame_seq = 0;
 }
 
 C1394CameraNode::~C1394CameraNode()
@@ -656,6 +1007,14 @@ C1394CameraNode::~C1394CameraNode()
     }
 }
 
+template <>
+void
+C1394NodeBuffer<PacketMap>::Reset(PacketMap* ptr)
+{
+    ReleasePacketMap(m_ptr);
+    m_ptr = ptr;
+}
+
 
 
 /** 
@@ -835,6 +1194,7 @@ C1394CameraNode::HasCapability(C1394CAMERA_FEATURE feat,
 bool C1394CameraNode::SetFeatureState(C1394CAMERA_FEATURE feat, 
 				      C1394CAMERA_FSTATE  fstate)
 {
+    scoped_lock lock(GetLock());
     bool r=false;
     quadlet_t tmp=0;
     quadlet_t inq=0;
@@ -969,6 +1329,7 @@ C1394CameraNode::GetFeatureStateName(C1394CAMERA_FSTATE fstate)
 bool
 C1394CameraNode::SetParameter(C1394CAMERA_FEATURE feat,unsigned int value)
 {
+  scoped_lock lock(GetLock());
   quadlet_t tmp;
     
   ReadReg(Addr(BRIGHTNESS_INQ)+4*feat,&tmp);
@@ -1101,6 +1462,7 @@ C1394CameraNode::GetParameterRange(C1394CAMERA_FEATURE feat,
 bool
 C1394CameraNode::SetAbsParameter(C1394CAMERA_FEATURE feat, float value)
 {
+  scoped_lock lock(GetLock());
   quadlet_t tmp=0;
   ReadReg(Addr(BRIGHTNESS_INQ)+4*feat,&tmp);
   if (!GetParam(BRIGHTNESS_INQ,Presence_Inq,tmp)){
@@ -1296,6 +1658,7 @@ C1394CameraNode::DisableFeature(C1394CAMERA_FEATURE feat)
 bool
 C1394CameraNode::EnableFeature(C1394CAMERA_FEATURE feat)
 {
+    scoped_lock lock(GetLock());
     quadlet_t tmp=0;
     quadlet_t inq=0;
 
@@ -1320,6 +1683,7 @@ C1394CameraNode::EnableFeature(C1394CAMERA_FEATURE feat)
  * Sets the feature to the onepush state.
  *
  * @note This functions is synonym for SetFeatureState(feat, OnePush)
+ * Use C1394OnePush to wait for the completion.
  * 
  * @param feat 
  * 
@@ -1445,13 +1809,16 @@ C1394CameraNode::OnePush_All()
  * 
  * @return True on success.
  *
- * @note  This library supports FORMAT_0, FORMAT_1, FORMAT_2 only.
+ * @note  This library supports FORMAT_0, FORMAT_1, FORMAT_2 and FORMAT_7.
+ * The frame rate is ignored for FORMAT_7, whose frame rate is determined
+ * by the packet size. \sa SetFormat7BytePerPacket()
  */
 bool
 C1394CameraNode::SetFormat(FORMAT    fmt,
 			   VMODE      mode,
 			   FRAMERATE frame_rate)
 {
+    scoped_lock lock(GetLock());
     FORMAT f; VMODE m; FRAMERATE r;
     quadlet_t tmp;
 
@@ -1475,10 +1842,12 @@ C1394CameraNode::SetFormat(FORMAT    fmt,
 	LOG("your camera has no format_"<<f<< " mode_"<<m<<" feature");
 	return false;
     }
-    ReadReg(Addr(V_RATE_INQ_0_0) + f*0x20 + m*4, &tmp);
-    if (0==((tmp >> (31-r))&0x1 )) {
-	LOG("your camera has no format_"<<f<< " mode_"<<m<<" framerate_"<<r<<" feature");
-	return false;
+    if (Format_7 != f){
+	ReadReg(Addr(V_RATE_INQ_0_0) + f*0x20 + m*4, &tmp);
+	if (0==((tmp >> (31-r))&0x1 )) {
+	    LOG("your camera has no format_"<<f<< " mode_"<<m<<" framerate_"<<r<<" feature");
+	    return false;
+	}
     }
 
     // set params
@@ -1490,7 +1859,7 @@ C1394CameraNode::SetFormat(FORMAT    fmt,
 	tmp=SetParam(Cur_V_Mode,,mode); 
 	WriteReg(Addr(Cur_V_Mode),&tmp);	
     }
-    if (frame_rate!=FrameRate_X){
+    if (frame_rate!=FrameRate_X && Format_7!=f){
 	tmp=SetParam(Cur_V_Frm_Rate,,frame_rate);
 	WriteReg(Addr(Cur_V_Frm_Rate),&tmp);
 	
@@ -1500,7 +1869,14 @@ C1394CameraNode::SetFormat(FORMAT    fmt,
     SPD cur_speed, req_speed;
     QueryIsoSpeed(&cur_speed);
     QueryFormat(&f,&m,&r);
-    req_speed=GetRequiredSpeed(f,m,r);
+    if (Format_7 == f){
+	Format7Info info;
+	if (!QueryFormat7Info(m, &info))
+	    return false;
+	req_speed=GetRequiredSpeed(info.bytes_per_packet);
+    } else {
+	req_speed=GetRequiredSpeed(f,m,r);
+    }
     if (req_speed > cur_speed)
 	SetIsoSpeed(req_speed);	    
 
@@ -1548,6 +1924,7 @@ C1394CameraNode::QueryFormat(FORMAT*    fmt,
 bool
 C1394CameraNode::SetIsoChannel(int channel)
 {
+    scoped_lock lock(GetLock());
     EXCEPT_FOR_FORMAT_6_ONLY;
     quadlet_t tmp;
     ReadReg(Addr(ISO_Channel_L), &tmp);
@@ -1648,6 +2025,7 @@ C1394CameraNode::QueryIsoSpeed(SPD* spd)
 bool
 C1394CameraNode::SetIsoSpeed(SPD iso_speed)
 {
+  scoped_lock lock(GetLock());
   EXCEPT_FOR_FORMAT_6_ONLY;
   quadlet_t tmp;
   ReadReg(Addr(ISO_Speed_L), &tmp); 
@@ -1760,6 +2138,7 @@ C1394CameraNode:: SetTriggerOff()
 bool
 C1394CameraNode::SetTriggerMode(int mode)
 {
+  scoped_lock lock(GetLock());
   LOG("SetTriggerMode "<<mode);
   quadlet_t tmp;
   ReadReg(Addr(TRIGGER_MODE), &tmp); 
@@ -1798,6 +2177,248 @@ C1394CameraNode:: StopIsoTx()
 }
 
 
+/**
+ * Writes the same value to a command register of every camera.
+ *
+ * The write requests are issued to all cameras before waiting for
+ * any response, so the cameras receive them within a few bus cycles.
+ *
+ * @param list    cameras.
+ * @param offset  offset of the register from m_command_regs_base.
+ * @param value   value to write.
+ * @param result  array of list.size() to store the result of each
+ *                camera, or NULL.
+ *
+ * @return the number of cameras which accepted the write.
+ */
+int
+write_reg_all(CCameraList& list, nodeaddr_t offset, quadlet_t value,
+	      bool* result)
+{
+    const int n = list.size();
+    if (n <= 0)
+	return 0;
+
+    // locks every handle in the order of the address to avoid deadlocks.
+    std::map<pthread_mutex_t*, bool> locks;
+    CCameraList::iterator cam;
+    for (cam=list.begin(); cam!=list.end(); cam++)
+	locks[get_handle_lock(cam->GetHandle())] = true;
+    std::map<pthread_mutex_t*, bool>::iterator l;
+    for (l=locks.begin(); l!=locks.end(); l++)
+	pthread_mutex_lock(l->first);
+
+    batch_request *req = new batch_request[n];
+    int i;
+    for (cam=list.begin(), i=0; cam!=list.end(); cam++, i++){
+	req[i].reqhandle.callback = callback_batch_request;
+	req[i].reqhandle.data = &req[i];
+	req[i].data = htonl(value);
+	req[i].done = false;
+	req[i].err = 0;
+	if (0 > raw1394_start_write(cam->GetHandle(), cam->m_node_id,
+				    cam->m_command_regs_base + offset, 4,
+				    &req[i].data,
+				    (unsigned long)&req[i].reqhandle)){
+	    req[i].done = true;
+	    req[i].err = -1;
+	}
+    }
+
+    bool lost = false;
+    for (cam=list.begin(), i=0; cam!=list.end(); cam++, i++){
+	while (!req[i].done){
+	    if (0 > raw1394_loop_iterate(cam->GetHandle())){
+		ERR("raw1394_loop_iterate() failed. " << strerror(errno));
+		lost = true;
+		break;
+	    }
+	}
+    }
+
+    int num_ok = 0;
+    for (cam=list.begin(), i=0; cam!=list.end(); cam++, i++){
+	bool ok = req[i].done && (0 == req[i].err ||
+				  0 == raw1394_errcode_to_errno(req[i].err));
+	if (req[i].done && !ok){
+	    // retry synchronously; the skew of this camera grows.
+	    quadlet_t tmp = value;
+	    ok = cam->WriteReg(cam->m_command_regs_base + offset, &tmp);
+	}
+	if (ok)
+	    num_ok++;
+	if (result)
+	    result[i] = ok;
+    }
+    for (l=locks.begin(); l!=locks.end(); l++)
+	pthread_mutex_unlock(l->first);
+    if (!lost){
+	// responses may still arrive, so req[] must not be released then.
+	delete[] req;
+    }
+    return num_ok;
+}
+
+/**
+ * Computes StartInfo::skew of the cameras which have received the
+ * first frame.
+ *
+ * @param info  array of StartInfo.
+ * @param n     number of the elements.
+ */
+void
+compute_start_skew(StartInfo* info, int n)
+{
+    int base = -1;
+    for (int i=0; i<n; i++){
+	if (!info[i].received)
+	    continue;
+	int c = cycle_time_to_count(info[i].timestamp);
+	if (base < 0){
+	    base = c;
+	    continue;
+	}
+	// the cycle timer wraps every 8 seconds.
+	int d = (c - base + CYCLE_TIME_WRAP) % CYCLE_TIME_WRAP;
+	if (d > CYCLE_TIME_WRAP/2)
+	    base = c;
+    }
+    for (int i=0; i<n; i++){
+	info[i].skew = 0;
+	if (info[i].received)
+	    info[i].skew = (cycle_time_to_count(info[i].timestamp)
+			    - base + CYCLE_TIME_WRAP) % CYCLE_TIME_WRAP;
+    }
+}
+
+/**
+ * Waits for the first frame of each started camera and fills info.
+ *
+ * A camera which has no frame buffer, or whose frame does not arrive
+ * within the timeout, is marked as not received, and the others are
+ * still waited for.
+ *
+ * @param list     cameras.
+ * @param started  array of list.size() results of the request.
+ * @param info     array of list.size() StartInfo.
+ * @param timeout  timeout for each camera in msec.
+ */
+void
+receive_first_frames(CCameraList& list, const bool* started,
+		     StartInfo* info, int timeout)
+{
+    CCameraList::iterator cam;
+    int i;
+    for (cam=list.begin(), i=0; cam!=list.end(); cam++, i++){
+	info[i].id = cam->GetID();
+	info[i].started = started[i];
+	info[i].received = false;
+	info[i].timestamp = 0;
+	info[i].skew = 0;
+	if (!started[i])
+	    continue;
+	// WaitFrameBuffer() fails if the frame buffer is not allocated.
+	int ready = cam->WaitFrameBuffer(timeout);
+	if (ready <= 0){
+	    if (ready == 0)
+		WRN("camera " << info[i].id << " timed out.");
+	    continue;
+	}
+	BufferInfo binfo;
+	memset(&binfo, 0, sizeof(binfo));
+	if (cam->UpdateFrameBuffer(C1394CameraNode::AS_FIFO, &binfo)){
+	    info[i].received = true;
+	    info[i].timestamp = binfo.timestamp;
+	}
+    }
+    compute_start_skew(info, i);
+    for (int j=0; j<i; j++){
+	if (info[j].received){
+	    LOG("camera " << info[j].id << " first frame at cycle "
+		<< info[j].timestamp << " skew " << info[j].skew);
+	}
+    }
+}
+
+/**
+ * Starts isochronus transmission of all cameras at once.
+ *
+ * The ISO_EN register of each camera is written by pipelined
+ * asynchronous requests, so all cameras start within a few bus
+ * cycles instead of one round trip per camera. 
+ *
+ * If use_broadcast is true and all cameras share the port and the
+ * command register base, ISO_EN is written by a single broadcast
+ * transaction, which every camera receives on the same bus cycle.
+ * Note that any other camera on the bus also starts, so use it only
+ * when the list holds all cameras on the bus. If the broadcast write
+ * fails, the pipelined requests are used instead.
+ *
+ * If info is not NULL and the frame buffer of a camera has been
+ * allocated, this function waits for the first frame of the camera
+ * and stores its cycle time. The frame is kept as the current frame
+ * buffer of the camera. A camera whose frame does not arrive within
+ * FIRST_FRAME_TIMEOUT msec is reported as not received.
+ *
+ * @param list          cameras to start.
+ * @param info          array of list.size() StartInfo, or NULL.
+ * @param use_broadcast true to use a broadcast write.
+ *
+ * @return True if all cameras have started.
+ */
+bool
+StartIsoTxAll(CCameraList& list, StartInfo* info, bool use_broadcast)
+{
+    const int n = list.size();
+    if (n <= 0)
+	return true;
+
+    bool *started = new bool[n];
+    int num_started = 0;
+
+    CCameraList::iterator cam = list.begin();
+    if (use_broadcast){
+	for ( ; cam!=list.end(); cam++){
+	    if (cam->m_port_no != list.front().m_port_no ||
+		cam->m_command_regs_base != list.front().m_command_regs_base)
+		break;
+	}
+	if (cam != list.end()){
+	    LOG("broadcast is not available; cameras are on different ports"
+		" or have different register bases.");
+	    use_broadcast = false;
+	}
+    }
+
+    if (use_broadcast){
+	C1394CameraNode &first = list.front();
+	quadlet_t tmp = htonl(SetParam(ISO_EN,,1));
+	first.Lock();
+	int retval = raw1394_write(first.GetHandle(), 0xffc0 | 0x3f,
+				   first.m_command_regs_base + OFFSET_ISO_EN,
+				   4, &tmp);
+	first.Unlock();
+	if (retval < 0){
+	    LOG("broadcast write failed. " << strerror(errno));
+	} else {
+	    for (int i=0; i<n; i++)
+		started[i] = true;
+	    num_started = n;
+	}
+    }
+    if (num_started != n){
+	num_started = write_reg_all(list, OFFSET_ISO_EN,
+				    SetParam(ISO_EN,,1), started);
+    }
+
+    if (info){
+	receive_first_frames(list, started, info, FIRST_FRAME_TIMEOUT);
+    }
+
+    delete[] started;
+    return num_started == n;
+}
+
 /*
  * pixel information.  bit weight
  *
@@ -2138,6 +2759,12 @@ static struct VideoPacketInfo video_packet_info[][8][8]= // format / mode / fps
 };
 #undef RESERVED
 
+// true if the format is listed in video_image_info and video_packet_info
+#define IS_TABLE_FORMAT(fmt,mode,rate)			\
+    (Format_0<=(fmt) && (fmt)<=Format_2 &&		\
+     Mode_0<=(mode) && (mode)<=Mode_7 &&		\
+     FrameRate_0<=(rate) && (rate)<8)
+
 /** 
  * Gets a string of the given video format.
  * 
@@ -2205,6 +2832,8 @@ const char* GetSpeedString(SPD spd)
  */
 int GetPacketSize(FORMAT fmt,VMODE mode,FRAMERATE frame_rate)
 {
+    if (!IS_TABLE_FORMAT(fmt,mode,frame_rate))
+	return -1;
     return video_packet_info[fmt][mode][frame_rate].packet_sz;
 }
 
@@ -2219,6 +2848,8 @@ int GetPacketSize(FORMAT fmt,VMODE mode,FRAMERATE frame_rate)
  */
 int GetNumPackets(FORMAT fmt,VMODE mode,FRAMERATE frame_rate)
 {
+    if (!IS_TABLE_FORMAT(fmt,mode,frame_rate))
+	return -1;
     return video_packet_info[fmt][mode][frame_rate].num_packets;
 }
 
@@ -2232,6 +2863,8 @@ int GetNumPackets(FORMAT fmt,VMODE mode,FRAMERATE frame_rate)
  */
 int GetImageWidth(FORMAT fmt,VMODE mode)
 {
+    if (!IS_TABLE_FORMAT(fmt,mode,FrameRate_0))
+	return -1;
     return video_image_info[fmt][mode].w;
 }
 
@@ -2245,6 +2878,8 @@ int GetImageWidth(FORMAT fmt,VMODE mode)
  */
 int GetImageHeight(FORMAT fmt,VMODE mode)
 {
+    if (!IS_TABLE_FORMAT(fmt,mode,FrameRate_0))
+	return -1;
     return video_image_info[fmt][mode].h;
 }
 
@@ -2259,6 +2894,8 @@ int GetImageHeight(FORMAT fmt,VMODE mode)
  */
 SPD GetRequiredSpeed(FORMAT fmt,VMODE mode,FRAMERATE frame_rate)
 {
+    if (!IS_TABLE_FORMAT(fmt,mode,frame_rate))
+	return SPD_100M;
     return video_packet_info[fmt][mode][frame_rate].required_speed;
 }
 
@@ -2362,6 +2999,20 @@ int ReleaseIsoChannelAll(raw1394handle_t handle)
     return true;
 }
 
+/*
+ * the FMT_* of yuv.h for a pixel format, or 0 if not supported.
+ */
+static int
+format_flag(PIXEL_FORMAT fmt)
+{
+    static const int fmt_table[] = {
+	FMT_YUV444, FMT_YUV422, FMT_YUV411, FMT_RGB888, FMT_Y8, FMT_Y16,
+    };
+    if (VFMT_NOT_SUPPORTED <= fmt)
+	return 0;
+    return fmt_table[fmt];
+}
+
 /** 
  * Allocate frame buffer memory for the given video format
  * 
@@ -2404,35 +3055,60 @@ int C1394CameraNode::AllocateFrameBuffer(int channel,
 	if (rate==FrameRate_X) rate=r;
     }
 
-    m_packet_sz  = ::GetPacketSize(fmt,mode,rate);
-    if (m_packet_sz < 0){
-	LOG("this fmt/mode/rate is not supported.");
-	return -1;
-    }
-//    m_packet_sz += 8;
-    m_num_packet = ::GetNumPackets(fmt,mode,rate);
-    if ( m_num_packet < 0 ){
-	ERR("packet size is too big");
-	return -2;
+    Format7Info f7info;
+    if (Format_7 == fmt){
+	// the packets are negotiated with the camera.
+	if (!QueryFormat7Info(mode, &f7info))
+	    return -1;
+	m_packet_sz  = f7info.bytes_per_packet;
+	m_num_packet = f7info.packets_per_frame;
+	if (m_packet_sz <= 0 || m_num_packet <= 0){
+	    ERR("format_7 packet size is not set.");
+	    return -1;
+	}
+	SPD cur_speed;
+	QueryIsoSpeed(&cur_speed);
+	if (GetRequiredSpeed(m_packet_sz) > cur_speed)
+	    SetIsoSpeed(GetRequiredSpeed(m_packet_sz));
+    } else {
+	m_packet_sz  = ::GetPacketSize(fmt,mode,rate);
+	if (m_packet_sz < 0){
+	    LOG("this fmt/mode/rate is not supported.");
+	    return -1;
+	}
+//	m_packet_sz += 8;
+	m_num_packet = ::GetNumPackets(fmt,mode,rate);
+	if ( m_num_packet < 0 ){
+	    ERR("packet size is too big");
+	    return -2;
+	}
     }
 
     LOG("packet size: " << m_packet_sz);
     LOG(" packet num: " << m_num_packet);
     LOG("   port num: " << m_port_no);
-    if (this->driver) {
-	LOG("re initalized?");
-	close_1394_driver(&this->driver);
-    }
     int header_size = 0;
-    m_num_frame = 16;
-    this->driver = open_1394_driver(m_port_no, m_devicename,
-				    channel,
-				    m_packet_sz, m_num_packet, m_num_frame,
-				    &header_size);
-
-    if (NULL == this->driver) {
-	ERR("open_1394_driver() failed");
-	return -3;
+    if (this->driver && this->driver->requeue &&
+	0 == this->driver->requeue(this->driver, channel,
+				   m_packet_sz, m_num_packet, &header_size)) {
+	LOG("reusing the frame buffer.");
+    } else {
+	if (this->driver) {
+	    LOG("re initalized?");
+	    this->driver->close(this->driver);
+	    close_1394_driver(&this->driver);
+	}
+	header_size = 0;
+	m_num_frame = 16;
+	this->driver = open_1394_driver(m_port_no, m_devicename,
+					channel,
+					m_packet_sz, m_num_packet, m_num_frame,
+					&header_size);
+
+	if (NULL == this->driver) {
+	    ERR("open_1394_driver() failed");
+	    return -3;
+	}
     }
     LOG("header_size: " << header_size);
     if (header_size>0) {
@@ -2442,14 +3118,67 @@ int C1394CameraNode::AllocateFrameBuffer(int channel,
 	m_remove_header &= ~REMOVE_HEADER;
     }
 
-    m_Image_W=::GetImageWidth(fmt,mode);
-    m_Image_H=::GetImageHeight(fmt,mode);
+    // the LUTs are needed by the Copy*() functions.
+    CreateYUVtoRGBAMap();
+
+    if (Format_7 == fmt){
+	m_Image_W = f7info.width;
+	m_Image_H = f7info.height;
+	m_pixel_format = ::GetPixelFormat(f7info.color_coding);
+    } else {
+	m_Image_W=::GetImageWidth(fmt,mode);
+	m_Image_H=::GetImageHeight(fmt,mode);
+	m_pixel_format  = video_image_info[fmt][mode].pixel_format;
+    }
 
-    m_pixel_format  = video_image_info[fmt][mode].pixel_format;
+    // the conversions specialized for this format and header layout.
+    m_conv = get_conversion_table(format_flag(m_pixel_format)
+				  | m_remove_header);
+    m_frame_seq++;
+    m_packet_map.Reset(CreatePacketMap(m_Image_W, m_Image_H, m_packet_sz,
+				       format_flag(m_pixel_format)
+				       | m_remove_header));
     return 0;
 }
 
 
+/**
+ * Switches the format, mode and frame rate of a running camera.
+ *
+ * The isochronus transmission is stopped while the camera is
+ * reconfigured, and restarted if it was running. The frame buffer is
+ * reused when the driver can requeue it with the new packet layout
+ * (the juju driver can if the channel is kept and the new frame is
+ * not larger), otherwise it is reallocated as AllocateFrameBuffer()
+ * does. When the buffer is reused with a new packet layout, the frames
+ * still queued to the driver at the switch, at most one less than the
+ * frames of the buffer, are received in the old layout and dropped.
+ *
+ * @param fmt   new format.
+ * @param mode  new mode.
+ * @param rate  new frame rate.
+ *
+ * @return Zero on success, or a negative value as AllocateFrameBuffer().
+ */
+int C1394CameraNode::SwitchFormat(FORMAT fmt, VMODE mode, FRAMERATE rate)
+{
+    quadlet_t tmp = 0;
+    ReadReg(Addr(ISO_EN), &tmp);
+    const bool running = (0 != GetParam(ISO_EN,, tmp));
+    if (running)
+	StopIsoTx();
+
+    int retval = AllocateFrameBuffer(-1, fmt, mode, rate);
+    if (retval < 0)
+	return retval;
+
+    if (running && !StartIsoTx()){
+	ERR("StartIsoTx() failed.");
+	return -1;
+    }
+    return 0;
+}
+
 /** 
  * Returns number of caputered frames.
  * 
@@ -2500,16 +3229,36 @@ void* C1394CameraNode::UpdateFrameBuffer(BUFFER_OPTION opt,BufferInfo* info)
     if (!driver) {
 	return NULL;
     }
-    m_lpFrameBuffer = (char*)driver->updateFrameBuffer(driver, opt, info);
+    SetCurrentFrame((char*)driver->updateFrameBuffer(driver, opt, info));
     return  m_lpFrameBuffer;
 }
 
 /** 
- * Gets the size fo a frame.
- * 
- * @return size of frame buffer.
+ * Waits until a new frame is captured.
  *
- * @note Sometimes m_BufferSize is greater than m_packet_sz * m_num_packet.
+ * @param timeout  timeout in msec, or -1 to wait forever.
+ * 
+ * @return 1 if a new frame is ready, 0 on timeout, or -1 if an error
+ * occurred. If the driver can't wait with a timeout, returns 1 at
+ * once and the following UpdateFrameBuffer() blocks.
+ */
+int C1394CameraNode::WaitFrameBuffer(int timeout)
+{
+    if (!driver) {
+	return -1;
+    }
+    if (!driver->waitFrame) {
+	return 1;
+    }
+    return driver->waitFrame(driver, timeout);
+}
+
+/** 
+ * Gets the size fo a frame.
+ * 
+ * @return size of frame buffer.
+ *
+ * @note Sometimes m_BufferSize is greater than m_packet_sz * m_num_packet.
  */
 int C1394CameraNode::GetFrameBufferSize()
 {
@@ -2536,10 +3285,102 @@ int C1394CameraNode::GetImageHeight()
     return m_Image_H;
 }
 
+/*
+ * a conversion of a frame, which may be split into bands of packets.
+ */
+struct ConvertJob {
+    CONVERSION  func;
+    void*       dest;
+    const char* src;
+    int         packet_sz;
+    int         flag;
+    int         num_pixel;        // pixels to store
+    const UCHAR* lut;             // window of Y16, or NULL
+};
+
+/*
+ * the number of pixels carried by a packet.
+ */
+static int
+pixels_per_packet(PIXEL_FORMAT fmt, int packet_sz, int flag)
+{
+    if (flag&REMOVE_HEADER)
+	packet_sz -= 8;
+    switch (fmt){
+    case VFMT_YUV444: return packet_sz/3;
+    case VFMT_YUV422: return packet_sz/4*2;
+    case VFMT_YUV411: return packet_sz/6*4;
+    case VFMT_RGB888: return packet_sz/3;
+    case VFMT_Y8:     return packet_sz;
+    case VFMT_Y16:    return packet_sz/2;
+    default:          return 0;
+    }
+}
+
+/*
+ * converts the pixels which begin in 'count' packets from 'first'.
+ */
+static void
+convert_band(void* arg, int first, int count)
+{
+    const ConvertJob *job = (const ConvertJob*)arg;
+    job->func(job->dest, job->src, job->packet_sz, first, count,
+	      job->num_pixel, job->flag, job->lut);
+}
+
+static int
+gcd(int a, int b)
+{
+    while (b){
+	int t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+/*
+ * converts the frame, or src if not NULL, in parallel if
+ * SetConversionThreads() is set. At most m_Image_W * m_Image_H pixels
+ * are stored, even if the last packet of Format_7 is padded.
+ */
+int
+C1394CameraNode::ConvertFrame(int layout, void* dest, const char* src)
+{
+    if (!src)
+	src = m_lpFrameBuffer;
+    if (!m_conv || !m_conv->to[layout] || !src){
+	LOG("this pixel format is not supported yet.");
+	return -1;
+    }
+    int pixels = pixels_per_packet(m_pixel_format, m_packet_sz,
+				   m_remove_header);
+    ConvertJob job;
+    job.func = m_conv->to[layout];
+    job.dest = dest;
+    job.src = src;
+    job.packet_sz = m_packet_sz;
+    job.flag = m_remove_header | Y16_DEPTH(m_y16_depth);
+    job.num_pixel = min(conversion_pixels(format_flag(m_pixel_format) |
+					  m_remove_header, m_packet_sz,
+					  m_num_packet),
+			m_Image_W * m_Image_H);
+    job.lut = m_y16_lut.empty() ? NULL : &m_y16_lut[0];
+
+    // the bands are aligned to rows, if a row ends on a packet boundary.
+    int unit = 1;
+    if (pixels > 0 && m_Image_W > 0)
+	unit = m_Image_W / gcd(m_Image_W, pixels);
+
+    run_conversion(convert_band, &job, m_num_packet, unit);
+    return 0;
+}
+
 /** 
  * Copies a caputured frame to IplImage buffer.
  *
- * This function converts the color-space if needed.
+ * This function converts the color-space if needed. The widthStep
+ * and the ROI of dest are respected, see CopyImage().
  *
  * @param dest  pointer to store the frame.
  * 
@@ -2547,6 +3388,7 @@ int C1394CameraNode::GetImageHeight()
  *
  * @note This function uses LUT created by CreateYUVtoRGBAMap().
  * @note This function will be enabled if you have Intel's IPL or OpenCV.
+ * @note The conversion is split among threads, see SetConversionThreads().
  * 
  */
 int C1394CameraNode::CopyIplImage(IplImage *dest)
@@ -2555,43 +3397,10 @@ int C1394CameraNode::CopyIplImage(IplImage *dest)
     LOG("This system don't have ipl or OpenCV library.");
     return -1;
 #else
-    switch  ( m_pixel_format ){
-    case VFMT_YUV422:
-	::copy_YUV422toIplImage(dest,m_lpFrameBuffer,
-				m_packet_sz,m_num_packet,
-				m_remove_header);
-    break;
-    case VFMT_YUV411:
-	::copy_YUV411toIplImage(dest,m_lpFrameBuffer,
-				m_packet_sz,m_num_packet,
-				m_remove_header);
-    break;
-    case VFMT_YUV444:
-	::copy_YUV444toIplImage(dest,m_lpFrameBuffer,
-				m_packet_sz,m_num_packet,
-				m_remove_header);
-    break;
-    case VFMT_RGB888:
-	::copy_RGB888toIplImage(dest,m_lpFrameBuffer,
-				m_packet_sz,m_num_packet,
-				m_remove_header);
-    break;
-    case VFMT_Y8:
-	::copy_Y8toIplImage(dest,m_lpFrameBuffer,
-				m_packet_sz,m_num_packet,
-				m_remove_header);
-    break;
-    case VFMT_Y16:
-	::copy_Y16toIplImage(dest,m_lpFrameBuffer,
-			     m_packet_sz,m_num_packet,
-			     m_remove_header);
-    break;
-    default:
-	LOG("this pixel format is not supported yet.");
-	break;
-    }
-  
-    return 0;
+    ImageDesc desc;
+    if (!GetIplImageDesc(&desc, dest))
+	return -1;
+    return CopyImage(&desc, CONV_BGR);
 #endif //#ifndef IPL_IMG_SUPPORTED
 }
 
@@ -2607,6 +3416,7 @@ int C1394CameraNode::CopyIplImage(IplImage *dest)
  *
  * @note This function uses LUT created by CreateYUVtoRGBAMap().
  * @note This function will be enabled if you have Intel's IPL or OpenCV.
+ * @note The conversion is split among threads, see SetConversionThreads().
  * 
  */
 int C1394CameraNode::CopyIplImageGray(IplImage *dest)
@@ -2615,43 +3425,10 @@ int C1394CameraNode::CopyIplImageGray(IplImage *dest)
     LOG("This system doesn't  have ipl or OpenCV library.");
     return -1;
 #else
-    switch  ( m_pixel_format ){
-    case VFMT_YUV422:
-	copy_YUV422toIplImageGray(dest,m_lpFrameBuffer,
-				  m_packet_sz,m_num_packet,
-				  m_remove_header);
-	break;
-    case VFMT_YUV411:
-	copy_YUV411toIplImageGray(dest,m_lpFrameBuffer,
-				  m_packet_sz,m_num_packet,
-				  m_remove_header);
-	break;
-    case VFMT_YUV444:
-	copy_YUV444toIplImageGray(dest,m_lpFrameBuffer,
-				  m_packet_sz,m_num_packet,
-				  m_remove_header);
-	break;
-    case VFMT_RGB888:
-	copy_RGB888toIplImageGray(dest,m_lpFrameBuffer,
-				  m_packet_sz,m_num_packet,
-				  m_remove_header);
-	break;
-    case VFMT_Y8:
-	copy_Y8toIplImageGray(dest,m_lpFrameBuffer,
-			      m_packet_sz,m_num_packet,
-			      m_remove_header);
-	break;
-    case VFMT_Y16:
-	copy_Y16toIplImageGray(dest,m_lpFrameBuffer,
-			       m_packet_sz,m_num_packet,
-			       m_remove_header);
-	break;
-    default:
-	LOG("this pixel format is not supported yet.");
-	break;
-    }
-  
-    return 0;
+    ImageDesc desc;
+    if (!GetIplImageDesc(&desc, dest))
+	return -1;
+    return CopyImage(&desc, CONV_GRAY);
 #endif //#ifndef IPL_IMG_SUPPORTED
 }
 
@@ -2663,50 +3440,667 @@ int C1394CameraNode::CopyIplImageGray(IplImage *dest)
  *
  * @param dest  pointer to store the frame.
  * 
- * @return Zero on success.
+ * @return Zero on success, or -1 if an error occurred.
  *
  * @note This function uses LUT created by CreateYUVtoRGBAMap().
+ * @note The conversion is split among threads, see SetConversionThreads().
  */
 int
 C1394CameraNode::CopyRGBAImage(void* dest)
 {
+    if (m_cache){
+	ImageDesc desc;
+	desc.data = (UCHAR*)dest;
+	desc.step = m_Image_W * sizeof(RGBA);
+	desc.width = m_Image_W;
+	desc.height = m_Image_H;
+	return CopyCachedImage(&desc, CONV_RGBA);
+    }
+    return ConvertFrame(CONV_RGBA, dest);
+}
 
-    switch  ( m_pixel_format ){
-    case VFMT_YUV422:
-	copy_YUV422toRGBA((RGBA*)dest,m_lpFrameBuffer,
-			  m_packet_sz,m_num_packet,
-			  m_remove_header);
-	break;
+/*
+ * a conversion of a frame to an image, split into bands of rows.
+ */
+struct ImageJob {
+    const ImageDesc* dest;
+    int         layout;
+    const char* src;
+    int         width;
+    int         height;
+    int         packet_sz;
+    int         flag;
+    const UCHAR* lut;
+};
+
+static void
+image_band(void* arg, int first, int count)
+{
+    const ImageJob *job = (const ImageJob*)arg;
+    copy_toImage(job->dest, job->layout, job->src, job->width, job->height,
+		 job->packet_sz, job->flag, job->lut, first, count);
+}
+
+/** 
+ * Copies a captured frame to an image of any stride.
+ *
+ * The rows of the image may be padded, e.g. aligned by
+ * SetupImageDesc(), or it may be a part of a larger image. The frame
+ * is clipped to the size of the image. If the image is dense and as
+ * large as the frame, this is the same as CopyRGBAImage() and the
+ * others.
+ *
+ * @param dest    the image.
+ * @param layout  CONV_RGBA, CONV_BGR, CONV_GRAY, or CONV_Y16 for Y16.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @note This function uses LUT created by CreateYUVtoRGBAMap().
+ * @note The conversion is split among threads, see SetConversionThreads().
+ */
+int
+C1394CameraNode::CopyImage(const ImageDesc* dest, int layout)
+{
+    int bpp = conversion_bytes_per_pixel(layout);
+    if (!m_conv || 0 == bpp || !m_conv->to[layout] || !m_lpFrameBuffer){
+	LOG("this pixel format is not supported yet.");
+	return -1;
+    }
+    if (m_cache)
+	return CopyCachedImage(dest, layout);
+    if (dest->width == m_Image_W && dest->height >= m_Image_H &&
+	dest->step == m_Image_W * bpp)
+	return ConvertFrame(layout, dest->data);
+    if (dest->step < min(dest->width, m_Image_W) * bpp){
+	ERR("the rows of the image are too short.");
+	return -1;
+    }
+
+    ImageJob job;
+    job.dest = dest;
+    job.layout = layout;
+    job.src = m_lpFrameBuffer;
+    job.width = m_Image_W;
+    job.height = m_Image_H;
+    job.packet_sz = m_packet_sz;
+    job.flag = format_flag(m_pixel_format) | m_remove_header
+	| Y16_DEPTH(m_y16_depth);
+    job.lut = m_y16_lut.empty() ? NULL : &m_y16_lut[0];
+
+    run_conversion(image_band, &job, min(dest->height, m_Image_H), 1);
+    return 0;
+}
+
+/*
+ * a conversion of rectangles of a frame. The rows of all rectangles
+ * are numbered one after another, and split into bands.
+ */
+struct RoiJob {
+    const ImageDesc* dests;
+    const FrameRect* rects;
+    int         num;
+    int         layout;
+    const char* src;
+    const PacketMap* map;
+    int         flag;
+    const UCHAR* lut;
+};
+
+static void
+roi_band(void* arg, int first, int count)
+{
+    const RoiJob *job = (const RoiJob*)arg;
+    for (int i=0; i<job->num && count>0; i++){
+	int h = max(job->rects[i].height, 0);
+	if (first >= h){
+	    first -= h;
+	    continue;
+	}
+	int n = min(count, h - first);
+	copy_toImageROI(&job->dests[i], job->layout, job->src, job->map,
+			&job->rects[i], job->flag, job->lut, first, n);
+	first = 0;
+	count -= n;
+    }
+}
+
+/** 
+ * Copies rectangles of a captured frame to images.
+ *
+ * Only the pixels in the rectangles are converted, reading the
+ * packets under them, so the cost is by the area of the rectangles
+ * rather than the frame. The top left pixel of dests[i] is the top
+ * left of rects[i], and the pixels out of the frame are not stored.
+ *
+ * @param dests   the images, one for each rectangle.
+ * @param rects   the rectangles of the frame.
+ * @param num     the number of the rectangles.
+ * @param layout  CONV_RGBA, CONV_BGR, CONV_GRAY, or CONV_Y16 for Y16.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @note The conversion is split among threads, see SetConversionThreads().
+ */
+int
+C1394CameraNode::CopyImageROI(const ImageDesc* dests, const FrameRect* rects,
+			      int num, int layout)
+{
+    int bpp = conversion_bytes_per_pixel(layout);
+    if (!m_conv || !m_packet_map || 0 == bpp || !m_conv->to[layout] ||
+	!m_lpFrameBuffer){
+	LOG("this pixel format is not supported yet.");
+	return -1;
+    }
+    int rows = 0;
+    for (int i=0; i<num; i++){
+	int w = min(rects[i].width, dests[i].width);
+	if (w > 0 && dests[i].step < w * bpp){
+	    ERR("the rows of the image " << i << " are too short.");
+	    return -1;
+	}
+	rows += max(rects[i].height, 0);
+    }
+
+    RoiJob job;
+    job.dests = dests;
+    job.rects = rects;
+    job.num = num;
+    job.layout = layout;
+    job.src = m_lpFrameBuffer;
+    job.map = m_packet_map;
+    job.flag = Y16_DEPTH(m_y16_depth);
+    job.lut = m_y16_lut.empty() ? NULL : &m_y16_lut[0];
+
+    run_conversion(roi_band, &job, rows, 1);
+    return 0;
+}
+
+/** 
+ * Copies a rectangle of a captured frame to IplImage buffer.
+ *
+ * The rectangle is at (x,y) of the frame, as large as dest (or its
+ * ROI). The frame is converted to BGR for 3 channels, to gray for 1
+ * channel, and to 16bit pixels for IPL_DEPTH_16U of Y16.
+ *
+ * @param dest  pointer to store the rectangle.
+ * @param x     the left of the rectangle.
+ * @param y     the top of the rectangle.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @sa CopyImageROI()
+ */
+int
+C1394CameraNode::CopyIplImageROI(IplImage* dest, int x, int y)
+{
+#ifndef IPL_IMG_SUPPORTED
+    LOG("This system doesn't  have ipl or OpenCV library.");
+    return -1;
+#else
+    ImageDesc desc;
+    if (!GetIplImageDesc(&desc, dest))
+	return -1;
+    int layout;
+    if (IPL_DEPTH_16U == dest->depth && 1 == dest->nChannels)
+	layout = CONV_Y16;
+    else if (IPL_DEPTH_8U == dest->depth && 3 == dest->nChannels)
+	layout = CONV_BGR;
+    else if (IPL_DEPTH_8U == dest->depth && 1 == dest->nChannels)
+	layout = CONV_GRAY;
+    else {
+	ERR("the image is not of 1 or 3 channels.");
+	return -1;
+    }
+    FrameRect rect;
+    rect.x = x;
+    rect.y = y;
+    rect.width = desc.width;
+    rect.height = desc.height;
+    return CopyImageROI(&desc, &rect, 1, layout);
+#endif //#ifndef IPL_IMG_SUPPORTED
+}
+
+/** 
+ * Sets the effective bit depth of Y16 frames.
+ *
+ * When a Y16 frame is converted to 8bit, the upper 8 bits of the
+ * depth are taken. Use 12 for 12bit sensors which store pixels in the
+ * lower bits. This cancels SetY16Window().
+ *
+ * @param bits  8 to 16. The default is 16.
+ * 
+ * @return Zero on success, or -1 if bits is out of range.
+ */
+int
+C1394CameraNode::SetY16Depth(int bits)
+{
+    if (bits < 8 || 16 < bits){
+	ERR("illegal bit depth " << bits);
+	return -1;
+    }
+    m_y16_depth = bits;
+    m_y16_lut.clear();
+    // the frames cached by the former depth are not used.
+    SetCurrentFrame(m_lpFrameBuffer);
+    return 0;
+}
+
+/** 
+ * Sets a window of Y16 frames.
+ *
+ * When a Y16 frame is converted to 8bit, the pixels from low to high
+ * are mapped to 0..255 linearly by a LUT, and the others are
+ * saturated. This overrides SetY16Depth().
+ *
+ * @param low   the pixel mapped to 0.
+ * @param high  the pixel mapped to 255.
+ * 
+ * @return Zero on success, or -1 if the window is invalid.
+ */
+int
+C1394CameraNode::SetY16Window(int low, int high)
+{
+    if (low < 0 || high <= low || 65535 < high){
+	ERR("illegal window " << low << "-" << high);
+	return -1;
+    }
+    m_y16_lut.resize(65536);
+    int retval = CreateY16WindowMap(&m_y16_lut[0], low, high);
+    // the frames cached by the former window are not used.
+    SetCurrentFrame(m_lpFrameBuffer);
+    return retval;
+}
+
+/** 
+ * Copies a caputured Y16 frame as 16bit pixels.
+ *
+ * The pixels are just swapped to the host byte order.
+ *
+ * @param dest  pointer to store the frame, of width*height pixels.
+ * 
+ * @return Zero on success, or -1 if the frame is not Y16.
+ *
+ * @note The conversion is split among threads, see SetConversionThreads().
+ */
+int
+C1394CameraNode::CopyY16Image(unsigned short* dest)
+{
+    if (VFMT_Y16 != m_pixel_format){
+	LOG("the pixel format is not Y16.");
+	return -1;
+    }
+    if (m_cache){
+	ImageDesc desc;
+	desc.data = (UCHAR*)dest;
+	desc.step = m_Image_W * 2;
+	desc.width = m_Image_W;
+	desc.height = m_Image_H;
+	return CopyCachedImage(&desc, CONV_Y16);
+    }
+    return ConvertFrame(CONV_Y16, dest);
+}
+
+/** 
+ * Copies a caputured Y16 frame to IplImage of IPL_DEPTH_16U.
+ *
+ * @param dest  pointer to store the frame, of 1 channel.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @sa CopyY16Image()
+ */
+int
+C1394CameraNode::CopyIplImage16(IplImage* dest)
+{
+#ifndef IPL_IMG_SUPPORTED
+    LOG("This system doesn't  have ipl or OpenCV library.");
+    return -1;
+#else
+    if (VFMT_Y16 != m_pixel_format){
+	LOG("the pixel format is not Y16.");
+	return -1;
+    }
+    if (IPL_DEPTH_16U != dest->depth || 1 != dest->nChannels){
+	ERR("the image is not IPL_DEPTH_16U of 1 channel.");
+	return -1;
+    }
+    ImageDesc desc;
+    GetIplImageDesc(&desc, dest);
+    return CopyImage(&desc, CONV_Y16);
+#endif //#ifndef IPL_IMG_SUPPORTED
+}
+
+#ifdef IPL_IMG_SUPPORTED
+/*
+ * a downscaling of a frame, which may be split into bands of rows.
+ */
+struct ScaleJob {
+    IplImage*   dest;
+    const char* src;
+    int         width;
+    int         height;
+    int         packet_sz;
+    int         flag;
+    int         factor;
+    bool        gray;
+    const UCHAR* lut;      // window of Y16, or NULL
+};
+
+static void
+scale_band(void* arg, int first, int count)
+{
+    const ScaleJob *job = (const ScaleJob*)arg;
+    if (job->gray)
+	copy_toIplImageGrayScaled(job->dest, job->src, job->width, job->height,
+				  job->packet_sz, job->flag, job->factor,
+				  job->lut, first, count);
+    else
+	copy_toIplImageScaled(job->dest, job->src, job->width, job->height,
+			      job->packet_sz, job->flag, job->factor,
+			      job->lut, first, count);
+}
+#endif //#ifdef IPL_IMG_SUPPORTED
+
+/*
+ * converts the frame to a downscaled image, in parallel if
+ * SetConversionThreads() is set.
+ */
+int
+C1394CameraNode::ScaleFrame(IplImage* dest, int factor, SCALE_MODE mode,
+			    bool gray)
+{
+#ifndef IPL_IMG_SUPPORTED
+    LOG("This system doesn't  have ipl or OpenCV library.");
+    return -1;
+#else
+    if (VFMT_NOT_SUPPORTED <= m_pixel_format || !m_lpFrameBuffer){
+	LOG("this pixel format is not supported yet.");
+	return -1;
+    }
+    if (factor < 1 || 256 < factor){
+	ERR("the factor must be 1..256.");
+	return -1;
+    }
+    if (dest->nChannels != (gray ? 1 : 3) || dest->depth != IPL_DEPTH_8U){
+	ERR("the image must be 8bit of " << (gray ? 1 : 3) << " channel(s).");
+	return -1;
+    }
+    // the ROI of dest, if any, is filled.
+    ImageDesc desc;
+    GetIplImageDesc(&desc, dest);
+    if (desc.width < m_Image_W/factor || desc.height < m_Image_H/factor){
+	ERR("the image is smaller than " << m_Image_W/factor << "x"
+	    << m_Image_H/factor);
+	return -1;
+    }
+    ScaleJob job;
+    job.dest = dest;
+    job.src = m_lpFrameBuffer;
+    job.width = m_Image_W;
+    job.height = m_Image_H;
+    job.packet_sz = m_packet_sz;
+    job.flag = format_flag(m_pixel_format) | m_remove_header
+	| Y16_DEPTH(m_y16_depth);
+    if (mode == SCALE_AVERAGE)
+	job.flag |= SCALE_BOX;
+    job.factor = factor;
+    job.gray = gray;
+    job.lut = m_y16_lut.empty() ? NULL : &m_y16_lut[0];
+
+    run_conversion(scale_band, &job, m_Image_H/factor, 1);
+    return 0;
+#endif //#ifndef IPL_IMG_SUPPORTED
+}
+
+/** 
+ * Copies a caputured frame to IplImage buffer, downscaling it.
+ *
+ * Only the pixels of the downscaled image are read and converted, so
+ * this is much cheaper than CopyIplImage() followed by cvResize().
+ *
+ * @param dest    pointer to store the frame, of at least
+ *                (width/factor) x (height/factor) and 3 channels of
+ *                8bit. If it has a ROI, the ROI is filled.
+ * @param factor  decimation factor of 1..256, e.g. 2, 4 or 8.
+ * @param mode    SCALE_AVERAGE or SCALE_NEAREST.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @note This function uses LUT created by CreateYUVtoRGBAMap().
+ */
+int
+C1394CameraNode::CopyIplImageScaled(IplImage* dest, int factor,
+				    SCALE_MODE mode)
+{
+    return ScaleFrame(dest, factor, mode, false);
+}
+
+/** 
+ * Copies a caputured frame to gray-scaled IplImage, downscaling it.
+ *
+ * @param dest    pointer to store the frame, of at least
+ *                (width/factor) x (height/factor) and 1 channel of 8bit.
+ *                If it has a ROI, the ROI is filled.
+ * @param factor  decimation factor of 1..256, e.g. 2, 4 or 8.
+ * @param mode    SCALE_AVERAGE or SCALE_NEAREST.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @sa CopyIplImageScaled()
+ */
+int
+C1394CameraNode::CopyIplImageGrayScaled(IplImage* dest, int factor,
+					SCALE_MODE mode)
+{
+    return ScaleFrame(dest, factor, mode, true);
+}
+
+/*
+ * a demosaicing of a frame, which may be split into bands of rows.
+ */
+struct BayerJob {
+    void*       dest;
+    int         step;      // bytes per row of BGR, or 0 for RGBA
+    const char* src;
+    int         width;
+    int         height;
+    int         packet_sz;
+    int         flag;
+    int         pattern;
+    const UCHAR* lut;      // window of Y16, or NULL
+};
+
+static void
+demosaic_band(void* arg, int first, int count)
+{
+    const BayerJob *job = (const BayerJob*)arg;
+    if (0 == job->step)
+	copy_BayertoRGBA((RGBA*)job->dest, job->src, job->width, job->height,
+			 job->packet_sz, job->flag, job->pattern, job->lut,
+			 first, count);
+    else
+	copy_BayertoBGR((UCHAR*)job->dest, job->step, job->src,
+			job->width, job->height, job->packet_sz, job->flag,
+			job->pattern, job->lut, first, count);
+}
+
+/*
+ * demosaics the frame, in parallel if SetConversionThreads() is set.
+ */
+int
+C1394CameraNode::DemosaicFrame(void* dest, int step, int pattern,
+			       DEMOSAIC_MODE mode)
+{
+    if (!m_lpFrameBuffer ||
+	(VFMT_Y8 != m_pixel_format && VFMT_Y16 != m_pixel_format)){
+	LOG("Bayer patterns need Y8 or Y16 (RAW8/RAW16).");
+	return -1;
+    }
+    if (pattern < BAYER_RGGB || BAYER_GBRG < pattern ||
+	m_Image_W < 4 || m_Image_H < 4){
+	ERR("invalid Bayer pattern or image size.");
+	return -1;
+    }
+    BayerJob job;
+    job.dest = dest;
+    job.step = step;
+    job.src = m_lpFrameBuffer;
+    job.width = m_Image_W;
+    job.height = m_Image_H;
+    job.packet_sz = m_packet_sz;
+    job.flag = ((VFMT_Y8 == m_pixel_format) ? FMT_Y8 : FMT_Y16)
+	| m_remove_header | Y16_DEPTH(m_y16_depth);
+    if (DEMOSAIC_EDGE == mode)
+	job.flag |= BAYER_EDGE;
+    else if (DEMOSAIC_HALF == mode)
+	job.flag |= BAYER_HALF;
+    job.pattern = pattern;
+    job.lut = m_y16_lut.empty() ? NULL : &m_y16_lut[0];
+
+    int rows = (DEMOSAIC_HALF == mode) ? m_Image_H/2 : m_Image_H;
+    run_conversion(demosaic_band, &job, rows, 1);
+    return 0;
+}
+
+/** 
+ * Copies a caputured Bayer frame to RGBA buffer, demosaicing it.
+ *
+ * The frame must be Y8 or Y16 (e.g. COLOR_RAW8 of Format_7). This
+ * function doesn't need OpenCV.
+ *
+ * DEMOSAIC_HALF makes each 2x2 block into a pixel, which is much
+ * cheaper than the others; the image is (width/2) x (height/2).
+ *
+ * @param dest     pointer to store the frame.
+ * @param pattern  BAYER_RGGB, BAYER_GRBG, BAYER_BGGR or BAYER_GBRG.
+ * @param mode     DEMOSAIC_EDGE, DEMOSAIC_BILINEAR or DEMOSAIC_HALF.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ */
+int
+C1394CameraNode::CopyRGBAImageBayer(void* dest, int pattern,
+				    DEMOSAIC_MODE mode)
+{
+    return DemosaicFrame(dest, 0, pattern, mode);
+}
+
+/** 
+ * Copies a caputured Bayer frame to IplImage buffer, demosaicing it.
+ *
+ * @param dest     pointer to store the frame, of 3 channels of 8bit.
+ *                 If it has a ROI, the ROI is filled.
+ * @param pattern  BAYER_RGGB, BAYER_GRBG, BAYER_BGGR or BAYER_GBRG.
+ * @param mode     DEMOSAIC_EDGE, DEMOSAIC_BILINEAR or DEMOSAIC_HALF.
+ * 
+ * @return Zero on success, or -1 if an error occurred.
+ *
+ * @sa CopyRGBAImageBayer()
+ */
+int
+C1394CameraNode::CopyIplImageBayer(IplImage* dest, int pattern,
+				   DEMOSAIC_MODE mode)
+{
+#ifndef IPL_IMG_SUPPORTED
+    LOG("This system doesn't  have ipl or OpenCV library.");
+    return -1;
+#else
+    int w = m_Image_W, h = m_Image_H;
+    if (DEMOSAIC_HALF == mode){
+	w /= 2;
+	h /= 2;
+    }
+    if (3 != dest->nChannels || IPL_DEPTH_8U != dest->depth){
+	ERR("the image must be 8bit of 3 channels.");
+	return -1;
+    }
+    // the ROI of dest, if any, is filled.
+    ImageDesc desc;
+    GetIplImageDesc(&desc, dest);
+    if (desc.width < w || desc.height < h){
+	ERR("the image is smaller than " << w << "x" << h);
+	return -1;
+    }
+    return DemosaicFrame(desc.data, desc.step, pattern, mode);
+#endif //#ifndef IPL_IMG_SUPPORTED
+}
+
+/*
+ * a repacking of a frame to planar YUV, split into bands of row pairs.
+ */
+struct PlanarJob {
+    const PlanarYUV* dest;
+    int         layout;
+    const char* src;
+    int         width;
+    int         height;
+    int         packet_sz;
+    int         flag;
+};
+
+static void
+planar_band(void* arg, int first, int count)
+{
+    const PlanarJob *job = (const PlanarJob*)arg;
+    copy_toPlanarYUV(job->dest, job->layout, job->src, job->width,
+		     job->height, job->packet_sz, job->flag,
+		     first*2, count*2);
+}
+
+/** 
+ * Copies a captured YUV frame to planar YUV, e.g. for video encoders.
+ *
+ * The frame must be YUV411, YUV422 or YUV444. The bytes are only
+ * repacked (and the chroma averaged or repeated); no colors are
+ * converted. SetupPlanarYUV() sets up the planes in a buffer with
+ * aligned rows.
+ *
+ * @param dest    the planes, of at least the size of the image.
+ * @param layout  PLANAR_I420, PLANAR_NV12 or PLANAR_YV16.
+ * 
+ * @return Zero on success, or -1 if an error occurred, e.g. the
+ * width is odd (or not a multiple of 4 for YUV411).
+ */
+int
+C1394CameraNode::CopyPlanarYUV(const PlanarYUV* dest, int layout)
+{
+    int fmt;
+    switch (m_pixel_format){
     case VFMT_YUV411:
-	copy_YUV411toRGBA((RGBA*)dest,m_lpFrameBuffer,
-			  m_packet_sz,m_num_packet,
-			  m_remove_header);
+	fmt = FMT_YUV411;
 	break;
-    case VFMT_YUV444:
-	copy_YUV444toRGBA((RGBA*)dest,m_lpFrameBuffer,
-			  m_packet_sz,m_num_packet,
-			  m_remove_header);
-	break;
-    case VFMT_RGB888:
-	copy_RGB888toRGBA((RGBA*)dest,m_lpFrameBuffer,
-			  m_packet_sz,m_num_packet,
-			  m_remove_header);
-	break;
-    case VFMT_Y8:
-	copy_Y8toRGBA((RGBA*)dest,m_lpFrameBuffer,
-		      m_packet_sz,m_num_packet,
-		      m_remove_header);
+    case VFMT_YUV422:
+	fmt = FMT_YUV422;
 	break;
-    case VFMT_Y16:
-	copy_Y16toRGBA((RGBA*)dest,m_lpFrameBuffer,
-		       m_packet_sz,m_num_packet,
-		       m_remove_header);
+    case VFMT_YUV444:
+	fmt = FMT_YUV444;
 	break;
     default:
-	LOG("not support this pixel format yet.");
-	break;
+	LOG("planar YUV needs YUV411, YUV422 or YUV444.");
+	return -1;
     }
-  
+    if (!m_lpFrameBuffer || !dest)
+	return -1;
+    if (layout < PLANAR_I420 || PLANAR_YV16 < layout){
+	ERR("invalid layout of planar YUV.");
+	return -1;
+    }
+    // checked here, as the bands can't report that copy_toPlanarYUV()
+    // refused the frame.
+    if ((m_Image_W & 1) || (FMT_YUV411 == fmt && (m_Image_W & 3))){
+	ERR("planar YUV needs an even width (a multiple of 4 for YUV411).");
+	return -1;
+    }
+
+    PlanarJob job;
+    job.dest = dest;
+    job.layout = layout;
+    job.src = m_lpFrameBuffer;
+    job.width = m_Image_W;
+    job.height = m_Image_H;
+    job.packet_sz = m_packet_sz;
+    job.flag = fmt | m_remove_header;
+
+    run_conversion(planar_band, &job, (m_Image_H + 1) / 2, 1);
     return 0;
 }
 
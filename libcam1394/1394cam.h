@@ -9,7 +9,10 @@
 #define _1394cam_h_included_
 
 #include <list>
+#include <map>
+#include <vector>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <libraw1394/raw1394.h>
 #include <libcam1394/1394cam_registers.h>
 
@@ -25,6 +28,12 @@ enum SPD {
 #endif
 
 typedef struct _IplImage IplImage;
+struct PlanarYUV;
+struct ConversionTable;
+struct ImageDesc;
+struct FrameRect;
+struct PacketMap;
+struct FrameCache;
 
 //! pixel format codes
 enum PIXEL_FORMAT {
@@ -37,8 +46,8 @@ enum PIXEL_FORMAT {
     VFMT_NOT_SUPPORTED ,
 };
 
-//! video format codes. This library supports only Format_0 to Format_2 now.
-// @todo Format_6, Format_7 is not supported yet.
+//! video format codes. This library supports Format_0 to Format_2 and Format_7.
+// @todo Format_6 is not supported yet.
 enum FORMAT {
     Format_0 = 0, //!< VGA non-compressed format 
     Format_1 = 1, //!< Super VGA non-compressed format(1)
@@ -47,7 +56,7 @@ enum FORMAT {
     Format_4 = 4, //!< reserved for other format
     Format_5 = 5, //!< reserved for other format
     Format_6 = 6, //!< Still Image Format    (not supported yet)
-    Format_7 = 7, //!< Scalable Image Format (not supported yet)
+    Format_7 = 7, //!< Scalable Image Format
 
     Format_X=-1,
 };
@@ -79,6 +88,23 @@ enum FRAMERATE {
     FrameRate_X=-1, 
 };
 
+//! color coding codes for Format_7.
+enum COLOR_CODING {
+    COLOR_MONO8    = 0,  //!< Y only 8bit
+    COLOR_YUV411   = 1,  //!< YUV 4:1:1
+    COLOR_YUV422   = 2,  //!< YUV 4:2:2
+    COLOR_YUV444   = 3,  //!< YUV 4:4:4
+    COLOR_RGB8     = 4,  //!< RGB 8bit
+    COLOR_MONO16   = 5,  //!< Y only 16bit
+    COLOR_RGB16    = 6,  //!< RGB 16bit
+    COLOR_SMONO16  = 7,  //!< signed Y only 16bit
+    COLOR_SRGB16   = 8,  //!< signed RGB 16bit
+    COLOR_RAW8     = 9,  //!< raw (bayer) 8bit
+    COLOR_RAW16    = 10, //!< raw (bayer) 16bit
+
+    COLOR_X=-1,
+};
+
 //! camera feature codes.
 enum C1394CAMERA_FEATURE {
     BRIGHTNESS      = 0,      //!< brightness control
@@ -130,6 +156,41 @@ enum C1394CAMERA_FSTATE
 
 //-------------------------------------------------------
 
+/**
+ * @class C1394CameraProfile 1394cam.h
+ * @brief a set of camera settings which can be saved, loaded and applied.
+ *
+ * Members set to Format_X, Mode_X, FrameRate_X or -1, and features
+ * whose m_valid is false, are left untouched by
+ * C1394CameraNode::ApplyProfile().
+ */
+class C1394CameraProfile {
+public:
+    //! setting of each feature
+    struct Feature {
+	bool               m_valid;     //!< true if the profile controls this feature
+	C1394CAMERA_FSTATE m_state;     //!< OFF, AUTO, MANUAL or ONE_PUSH
+	unsigned int       m_value;     //!< value for MANUAL state
+	bool               m_abs;       //!< true if m_abs_value is used
+	float              m_abs_value; //!< absolute value for MANUAL state
+    };
+
+    FORMAT    m_format;              //!< video format, or Format_X
+    VMODE     m_mode;                //!< video mode, or Mode_X
+    FRAMERATE m_rate;                //!< frame rate, or FrameRate_X
+    int       m_channel;             //!< isochronus channel, or -1
+    int       m_iso_speed;           //!< SPD, or -1
+    int       m_trigger_mode;        //!< trigger mode, or -1
+    int       m_memory_channel;      //!< memory channel holding this profile, or -1
+    Feature   m_feature[END_OF_FEATURE];
+
+    C1394CameraProfile();
+
+    void Clear();
+    int  Load(const char* filename);
+    int  Save(const char* filename) const;
+};
+
 class C1394Node {
 public:
     unsigned int  m_VenderID;  //!< vender id
@@ -140,6 +201,115 @@ struct BufferInfo {
     unsigned int timestamp;
 };
 
+/**
+ * @struct Format7Info 1394cam.h
+ * @brief  parameters of a Format_7 video mode
+ */
+struct Format7Info {
+    int max_width;               //!< maximum image width
+    int max_height;              //!< maximum image height
+    int unit_width;              //!< unit of the image width
+    int unit_height;             //!< unit of the image height
+    int unit_left;               //!< unit of the horizontal position
+    int unit_top;                //!< unit of the vertical position
+    int left;                    //!< current horizontal position
+    int top;                     //!< current vertical position
+    int width;                   //!< current image width
+    int height;                  //!< current image height
+    COLOR_CODING color_coding;   //!< current color coding
+    quadlet_t color_coding_inq;  //!< bit (31-n) is set if COLOR_CODING n is available
+    int unit_bytes_per_packet;   //!< unit of the packet size
+    int max_bytes_per_packet;    //!< maximum packet size
+    int bytes_per_packet;        //!< current packet size
+    int rec_bytes_per_packet;    //!< recommended packet size, or 0
+    int packets_per_frame;       //!< number of packets per frame
+    uint64_t total_bytes;        //!< bytes per frame including padding
+};
+
+/**
+ * @struct Format7Tuning 1394cam.h
+ * @brief  result of C1394CameraNode::TuneFormat7PacketSize()
+ */
+struct Format7Tuning {
+    int   bytes_per_packet;      //!< chosen packet size
+    float expected_fps;          //!< frame rate expected from the packet size
+    float measured_fps;          //!< measured frame rate
+};
+
+/**
+ * @struct FrameStats 1394cam.h
+ * @brief  statistics of a frame, see C1394CameraNode::ComputeFrameStats()
+ */
+struct FrameStats {
+    int   count;                 //!< number of the sampled pixels
+    float y;                     //!< mean luminance (0..255)
+    float u;                     //!< mean U (Cb), zero for gray (-128..127)
+    float v;                     //!< mean V (Cr), zero for gray (-128..127)
+    float over;                  //!< ratio of the saturated pixels
+    float under;                 //!< ratio of the black pixels
+};
+
+/**
+ * @struct StartInfo 1394cam.h
+ * @brief  result of the synchronized start of each camera
+ */
+struct StartInfo {
+    uint64_t     id;         //!< camera id
+    bool         started;    //!< true if the camera accepted the request
+    bool         received;   //!< true if the first frame has been received
+    unsigned int timestamp;  //!< cycle time of the first frame
+    int          skew;       //!< delay (in cycles) from the earliest camera
+};
+
+struct port_handle;
+
+/**
+ * @class C1394PortRef 1394cam.h
+ * @brief a counted reference to the raw1394 handle of a port.
+ */
+class C1394PortRef {
+public:
+    C1394PortRef();
+    C1394PortRef(const C1394PortRef& ref);
+    ~C1394PortRef();
+    C1394PortRef& operator=(const C1394PortRef& ref);
+
+    void Attach(int port_no);
+    void Detach();
+    int  GetPortNo() const;
+    raw1394handle_t GetHandle();
+private:
+    port_handle *m_port;
+};
+
+/**
+ * @class C1394NodeBuffer 1394cam.h
+ * @brief a buffer owned by a C1394CameraNode.
+ *
+ * The copies of a node, e.g. in CCameraList, don't share the buffer
+ * but start without one, so the buffer is released only once.
+ */
+template <class T> class C1394NodeBuffer {
+public:
+    C1394NodeBuffer() : m_ptr(NULL) {}
+    C1394NodeBuffer(const C1394NodeBuffer&) : m_ptr(NULL) {}
+    ~C1394NodeBuffer() { Reset(NULL); }
+    C1394NodeBuffer& operator=(const C1394NodeBuffer&) {
+	Reset(NULL);
+	return *this;
+    }
+
+    //! releases the current buffer, and owns ptr.
+    void Reset(T* ptr);
+    operator T*() const { return m_ptr; }
+    T* operator->() const { return m_ptr; }
+private:
+    T* m_ptr;
+};
+
+template <> void C1394NodeBuffer<PacketMap>::Reset(PacketMap* ptr);
+template <> void C1394NodeBuffer<FrameCache>::Reset(FrameCache* ptr);
+
 class C1394CameraNode : public C1394Node {
 private:
     enum {
@@ -157,18 +327,26 @@ public:
 
     int   m_port_no;		     // port no of 1394 I/F
     char  m_devicename[32];          // device file name
-    raw1394handle_t m_handle;        // handle of 1394 I/F
+    raw1394handle_t m_handle;        // handle of 1394 I/F, see GetHandle()
     nodeid_t m_node_id;              // node_id of this node
     nodeaddr_t m_command_regs_base;  // base address of camera's cmd reg
+    C1394PortRef m_port;             // handle shared by the cameras on the port
 
     C1394CameraNode();
     virtual ~C1394CameraNode();
 
+    raw1394handle_t GetHandle();
+
     char* GetModelName(char* buffer, size_t length);
     char* GetVenderName(char* buffer, size_t length);
 
     bool ReadReg(nodeaddr_t addr,quadlet_t* value);
     bool WriteReg(nodeaddr_t addr,quadlet_t* value);
+    bool ReadRegBlock(nodeaddr_t addr, quadlet_t* value, int count);
+    bool WriteRegBatch(const nodeaddr_t* addr, const quadlet_t* value,
+		       int count);
+    void Lock();
+    void Unlock();
 
     bool ResetToInitialState();
     bool PowerDown();
@@ -225,6 +403,21 @@ public:
     bool  SetIsoChannel(int  channel);
     bool  SetIsoSpeed(SPD  iso_speed);
 
+    bool  QueryFormat7Info(VMODE mode, Format7Info* info);
+    bool  SetFormat7ROI(VMODE mode, int left, int top, int width, int height);
+    bool  SetFormat7ColorCoding(VMODE mode, COLOR_CODING coding);
+    bool  SetFormat7BytePerPacket(VMODE mode, int bytes);
+    bool  TuneFormat7PacketSize(VMODE mode, int budget=0,
+				Format7Tuning* result=0, int num_sample=30);
+
+    bool  QueryProfile(C1394CameraProfile* profile);
+    int   ApplyProfile(const C1394CameraProfile& profile);
+
+    int   QueryMemoryChannelCount();
+    bool  QueryMemoryChannel(int* channel);
+    bool  SaveMemoryChannel(int channel);
+    bool  RecallMemoryChannel(int channel);
+
     bool  OneShot();
     bool  StartIsoTx(unsigned int count_number =MAX_COUNT_NUMBER);
     bool  StopIsoTx();
@@ -244,6 +437,25 @@ private:
     bool  m_bIsInitalized; // true means this instance has been initalized
 
     int  m_remove_header;
+    const ConversionTable* m_conv; // conversions of the current format
+    C1394NodeBuffer<PacketMap> m_packet_map; // pixels to packets of the format
+    unsigned int m_frame_seq;      // counts the frames, see SetCurrentFrame()
+    C1394NodeBuffer<FrameCache> m_cache;     // converted frames, or NULL
+
+    int  m_y16_depth;                     // effective bit depth of Y16
+    std::vector<unsigned char> m_y16_lut; // window of Y16, or empty
+
+    nodeaddr_t m_format7_csr[8];   // base of Format_7 CSR of each mode, or 0
+    nodeaddr_t GetFormat7CSR(VMODE mode);
+    bool  UpdateFormat7(nodeaddr_t base);
+
+    raw1394handle_t  m_lock_handle;  // the handle m_lock belongs to
+    pthread_mutex_t* m_lock;         // lock of the handle, see GetLock()
+    pthread_mutex_t* GetLock();
+
+    int   ConvertFrame(int layout, void* dest, const char* src=NULL);
+    int   CopyCachedImage(const ImageDesc* dest, int layout);
+    void  SetCurrentFrame(char* frame);
 public:
 
     //! buffer option. \sa UpdateFrameBuffer()
@@ -265,17 +477,30 @@ public:
 	FILETYPE_PGM =0x002,  //!< pgm file.
 	FILETYPE_JPG =0x003,  //!< jpg file.
     };
+    //! downscaling method. \sa CopyIplImageScaled()
+    enum SCALE_MODE {
+	SCALE_NEAREST = 0,    //!< pick a pixel of each block.
+	SCALE_AVERAGE = 1,    //!< average the pixels of each block.
+    };
+    //! demosaicing method. \sa CopyIplImageBayer()
+    enum DEMOSAIC_MODE {
+	DEMOSAIC_BILINEAR = 0, //!< average the nearest pixels of each color.
+	DEMOSAIC_EDGE     = 1, //!< interpolate along the edges.
+	DEMOSAIC_HALF     = 2, //!< a pixel per 2x2 block, at half size.
+    };
 
 public:
     int  AllocateFrameBuffer(int       channel = -1         ,
 			     FORMAT    fmt     = Format_X   ,
 			     VMODE     mode    = Mode_X     ,
 			     FRAMERATE rate    = FrameRate_X);
+    int  SwitchFormat(FORMAT fmt, VMODE mode, FRAMERATE rate = FrameRate_X);
   
     int    GetFrameCount(int*);
     int    SetFrameCount(int);
     void*  UpdateFrameBuffer(BUFFER_OPTION opt=BUFFER_DEFAULT,
 			     BufferInfo* info=0);
+    int    WaitFrameBuffer(int timeout=-1);
     int    GetFrameBufferSize();
     int    GetImageWidth();
     int    GetImageHeight();
@@ -283,16 +508,259 @@ public:
     int    CopyRGBAImage(void* dest);
     int    CopyIplImage(IplImage* dest);
     int    CopyIplImageGray(IplImage* dest);
+    int    CopyImage(const ImageDesc* dest, int layout);
+    int    CopyImageROI(const ImageDesc* dests, const FrameRect* rects,
+			int num, int layout);
+    int    CopyIplImageROI(IplImage* dest, int x, int y);
+    int    EnableConversionCache(bool enable);
+    const ImageDesc* AcquireConvertedFrame(int layout, unsigned int* seq=0);
+    void   ReleaseConvertedFrame(const ImageDesc* image);
+    int    CopyIplImageScaled(IplImage* dest, int factor,
+			      SCALE_MODE mode=SCALE_AVERAGE);
+    int    CopyIplImageGrayScaled(IplImage* dest, int factor,
+				  SCALE_MODE mode=SCALE_AVERAGE);
+    int    SetY16Depth(int bits);
+    int    SetY16Window(int low, int high);
+    int    CopyY16Image(unsigned short* dest);
+    int    CopyIplImage16(IplImage* dest);
+    int    CopyRGBAImageBayer(void* dest, int pattern,
+			      DEMOSAIC_MODE mode=DEMOSAIC_EDGE);
+    int    CopyIplImageBayer(IplImage* dest, int pattern,
+			     DEMOSAIC_MODE mode=DEMOSAIC_EDGE);
+    int    CopyPlanarYUV(const PlanarYUV* dest, int layout);
+
+    int    ComputeFrameStats(FrameStats* stats, int step=8);
 
     int    SaveToFile(char* filename,FILE_TYPE type=FILETYPE_PPM); 
 
 protected:
     int    AllocateBuffer(); 
     int    ReleaseBuffer();
+    int    ScaleFrame(IplImage* dest, int factor, SCALE_MODE mode, bool gray);
+    int    DemosaicFrame(void* dest, int step, int pattern,
+			 DEMOSAIC_MODE mode);
 
     int  m_num_frame; // number of frames in frame buffer.
 };
 
+/**
+ * @class C1394BurstCapture 1394cam.h
+ * @brief captures a fixed number of frames sent by Multi_Shot.
+ */
+class C1394BurstCapture {
+public:
+    //! called once when the burst has completed.
+    typedef void (*Callback)(C1394BurstCapture* burst, void* arg);
+
+    C1394BurstCapture();
+    virtual ~C1394BurstCapture();
+
+    int   Allocate(C1394CameraNode* camera, int num_frame);
+    void  Release();
+
+    int   Start(int timeout=1000, Callback callback=0, void* arg=0);
+    int   Wait();
+    bool  IsDone();
+
+    int   GetNumFrames() const   { return m_num_frame; }
+    int   GetNumCaptured() const { return m_num_captured; }
+    int   GetNumMissing() const  { return m_num_frame - m_num_captured; }
+    int   GetFrameSize() const   { return m_frame_size; }
+    void* GetFrame(int n) const;
+    const BufferInfo* GetFrameInfo(int n) const;
+    int   GetFrameSeq(int n) const;
+
+private:
+    C1394BurstCapture(const C1394BurstCapture&);
+    C1394BurstCapture& operator=(const C1394BurstCapture&);
+
+    static void* thread_main(void* arg);
+    void  Capture();
+    void  ComputeSequence();
+
+    C1394CameraNode* m_camera;
+    char*        m_buffer;        // frames, page aligned
+    size_t       m_buffer_size;   // size of m_buffer in bytes
+    bool         m_locked;        // true if m_buffer is locked in memory
+    BufferInfo*  m_info;          // info of each frame
+    int*         m_seq;           // sequence number of each frame
+    int          m_frame_size;
+    int          m_num_frame;
+    int          m_num_captured;
+    int          m_timeout;
+
+    Callback     m_callback;
+    void*        m_arg;
+
+    bool         m_running;       // true if m_thread has to be joined
+    bool         m_done;
+    pthread_t    m_thread;
+    pthread_mutex_t m_mutex;
+};
+
+/**
+ * @class C1394OnePush 1394cam.h
+ * @brief runs one-push operations of several features and cameras,
+ *        and waits for their completion.
+ */
+class C1394OnePush {
+public:
+    //! called once when all operations have completed or timed out.
+    typedef void (*Callback)(C1394OnePush* op, void* arg);
+
+    C1394OnePush();
+    virtual ~C1394OnePush();
+
+    void  Add(C1394CameraNode* camera, C1394CAMERA_FEATURE feat);
+    void  Clear();
+
+    int   Start(int timeout=10000, Callback callback=0, void* arg=0);
+    int   Wait();
+    bool  IsDone();
+    bool  IsPending(C1394CameraNode* camera, C1394CAMERA_FEATURE feat);
+
+private:
+    C1394OnePush(const C1394OnePush&);
+    C1394OnePush& operator=(const C1394OnePush&);
+
+    struct Target {
+	C1394CameraNode* camera;
+	uint64_t         features;  // bit n is set for feature n
+	uint64_t         pending;
+    };
+
+    static void* thread_main(void* arg);
+    void  Poll();
+    bool  Update(Target* target);
+
+    std::vector<Target> m_targets;
+    int          m_timeout;
+    Callback     m_callback;
+    void*        m_arg;
+    int          m_num_pending;   // # of the targets with pending features
+
+    bool         m_running;       // true if m_thread has to be joined
+    bool         m_done;
+    pthread_t    m_thread;
+    pthread_mutex_t m_mutex;
+};
+
+/**
+ * @class C1394AutoControl 1394cam.h
+ * @brief software auto exposure and white balance driven by the frames.
+ */
+class C1394AutoControl {
+public:
+    C1394AutoControl();
+    virtual ~C1394AutoControl();
+
+    int   Attach(C1394CameraNode* camera);
+    void  Detach();
+
+    void  EnableExposure(bool enable)     { m_exposure = enable; }
+    void  EnableWhiteBalance(bool enable) { m_white_balance = enable; }
+    void  SetTarget(float y, float tolerance=4.f);
+    void  SetResponse(float exposure, float white_balance, int settle=2);
+    void  SetLimit(C1394CAMERA_FEATURE feat, float min, float max);
+
+    int   Process();
+    const FrameStats& GetStats() const { return m_stats; }
+
+private:
+    C1394AutoControl(const C1394AutoControl&);
+    C1394AutoControl& operator=(const C1394AutoControl&);
+
+    struct Control {
+	bool       valid;
+	bool       abs;        // true if controlled with the absolute value
+	nodeaddr_t addr;       // register to write the value
+	quadlet_t  reg;        // control register, for raw values
+	float      min, max;
+	float      value;
+    };
+
+    bool  Setup(C1394CAMERA_FEATURE feat, Control* ctl);
+    bool  Write(Control* ctl, float value);
+    bool  AdjustExposure(float ratio);
+    bool  Balance();
+
+    C1394CameraNode* m_camera;
+    Control      m_shutter;
+    Control      m_gain;
+    Control      m_wb_u;       // B/U of WHITE_BALANCE
+    Control      m_wb_v;       // R/V of WHITE_BALANCE
+    quadlet_t    m_wb_reg;
+
+    bool         m_exposure;
+    bool         m_white_balance;
+    float        m_target;
+    float        m_tolerance;
+    float        m_k_exposure;
+    float        m_k_wb;
+    int          m_settle;     // frames to wait after a change
+    int          m_wait;
+    FrameStats   m_stats;
+};
+
+typedef std::list<C1394CameraNode> CCameraList; //!< camera list
+
+/**
+ * @class C1394CameraRegistry 1394cam.h
+ * @brief keeps track of the cameras on the bus across bus resets.
+ */
+class C1394CameraRegistry {
+public:
+    enum EVENT {
+	CAMERA_ADDED,     //!< a camera is connected.
+	CAMERA_REMOVED,   //!< a camera is disconnected.
+	CAMERA_MOVED,     //!< the node id of a camera has changed.
+    };
+    //! called from the monitor thread for each change.
+    typedef void (*Callback)(C1394CameraRegistry* registry, EVENT event,
+			     const C1394CameraNode& camera, void* arg);
+
+    C1394CameraRegistry();
+    virtual ~C1394CameraRegistry();
+
+    int   Start();
+    void  Stop();
+    void  Rescan();
+
+    void  Subscribe(Callback callback, void* arg);
+    void  Unsubscribe(Callback callback, void* arg);
+
+    int   GetCameraList(CCameraList* list);
+    bool  FindCamera(uint64_t id, C1394CameraNode* camera);
+
+private:
+    C1394CameraRegistry(const C1394CameraRegistry&);
+    C1394CameraRegistry& operator=(const C1394CameraRegistry&);
+
+    struct Port;
+    struct Event;
+    struct Node {
+	bool            is_camera;
+	int             port_no;
+	C1394CameraNode camera;
+    };
+
+    static void* thread_main(void* arg);
+    static int   bus_reset_handler(raw1394handle_t handle,
+				   unsigned int generation);
+    void  Monitor();
+    bool  Update(Port* port, std::vector<Event>* events);
+    void  Notify(const std::vector<Event>& events);
+
+    std::vector<Port*>       m_ports;
+    std::map<uint64_t, Node> m_nodes;    // indexed by GUID
+    std::vector<std::pair<Callback, void*> > m_subscribers;
+
+    bool            m_running;
+    pthread_t       m_thread;
+    pthread_mutex_t m_mutex;
+    int             m_wakeup[2];  // pipe to wake up the monitor thread
+};
+
 #define ISORX_ISOHEADER 0x000001
 
 int EnableCyclemaster(raw1394handle_t handle);
@@ -321,13 +789,29 @@ int GetNumPackets(FORMAT fmt,VMODE mode,FRAMERATE frame_rate);
 int GetImageWidth(FORMAT fmt,VMODE mode);
 int GetImageHeight(FORMAT fmt,VMODE mode);
 SPD GetRequiredSpeed(FORMAT fmt,VMODE mode,FRAMERATE frame_rate);
+SPD GetRequiredSpeed(int bytes_per_packet);
+int GetIsoBandwidth(SPD spd);
+PIXEL_FORMAT GetPixelFormat(COLOR_CODING coding);
 const char* GetVideoFormatString(FORMAT fmt,VMODE mode);
 PIXEL_FORMAT GetPixelFormat(FORMAT fmt, VMODE mode);
 const char* GetSpeedString(SPD rate);
 
-typedef std::list<C1394CameraNode> CCameraList; //!< camera list
 bool GetCameraList(raw1394handle_t,CCameraList *);
 CCameraList::iterator find_camera_by_id(CCameraList& CameraList,uint64_t id);
+bool OpenCameraByGUID(uint64_t guid, C1394CameraNode* camera);
+bool StartIsoTxAll(CCameraList& list, StartInfo* info=0,
+		   bool use_broadcast=false);
+bool TuneFormat7PacketSizeAll(CCameraList& list);
+int  RecallMemoryChannelAll(CCameraList& list, int channel, bool* result=0);
+
+bool ReadCycleTimer(raw1394handle_t handle, uint32_t* cycle_timer,
+		    uint64_t* local_time);
+bool ShotAllAtTime(CCameraList& list, uint64_t local_time,
+		   unsigned int count_number=1, StartInfo* info=0);
+bool ShotAllAtCycle(CCameraList& list, uint32_t cycle_timer,
+		    unsigned int count_number=1, StartInfo* info=0);
+
+int  SetConversionThreads(int num);
 
 void libcam1394_set_debug_level(int level);
 const char *libcam1394_get_version(void);
@@ -0,0 +1,486 @@
+/**
+ * @file    1394cam_autoctl.cc
+ * @brief   frame statistics, and software auto exposure/white balance
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+#include "yuv.h"
+
+using namespace std;
+
+enum {
+    LEVEL_OVER  = 250,
+    LEVEL_UNDER = 5,
+};
+
+/**
+ * Computes the statistics of the current frame buffer.
+ *
+ * The pixels are sampled directly from the frame buffer without
+ * conversion; every step-th pixel of every step-th packet is used.
+ * For Y8 and Y16 (and raw Bayer) frames, u and v are zero.
+ *
+ * @param stats  pointer to store the statistics.
+ * @param step   sampling interval.
+ *
+ * @return Zero on success, or -1 if the frame buffer isn't available.
+ */
+int
+C1394CameraNode::ComputeFrameStats(FrameStats* stats, int step)
+{
+    CHK_PARAM(stats!=NULL);
+    memset(stats, 0, sizeof(*stats));
+    if (!m_lpFrameBuffer || m_packet_sz <= 0)
+	return -1;
+    if (step < 1)
+	step = 1;
+
+    int group;   // bytes of a group of pixels sharing u and v
+    switch (m_pixel_format){
+    case VFMT_YUV444: group = 3; break;
+    case VFMT_YUV422: group = 4; break;
+    case VFMT_YUV411: group = 6; break;
+    case VFMT_RGB888: group = 3; break;
+    case VFMT_Y8:     group = 1; break;
+    case VFMT_Y16:    group = 2; break;
+    default:
+	return -1;
+    }
+
+    const unsigned char *base = (const unsigned char*)m_lpFrameBuffer;
+    int payload = m_packet_sz;
+    if (m_remove_header & REMOVE_HEADER){
+	payload -= 8;
+	base += 4;
+    }
+    const int stride = group * step;
+
+    long sum_y = 0, sum_u = 0, sum_v = 0;
+    int n = 0, n_uv = 0, over = 0, under = 0;
+    for (int pkt=0; pkt<m_num_packet; pkt+=step){
+	const unsigned char *p = base + (size_t)m_packet_sz * pkt;
+	const unsigned char *end = p + payload - group + 1;
+	for ( ; p < end; p += stride){
+	    int y, u = 128, v = 128;
+	    switch (m_pixel_format){
+	    case VFMT_YUV444:
+	    case VFMT_YUV422:
+		u = p[0]; y = p[1]; v = p[2];
+		break;
+	    case VFMT_YUV411:
+		u = p[0]; y = p[1]; v = p[3];
+		break;
+	    case VFMT_RGB888:
+		y = (77*p[0] + 150*p[1] + 29*p[2]) >> 8;
+		u = 128 + ((144*(p[2] - y)) >> 8);   // 0.564*(B-Y)
+		v = 128 + ((183*(p[0] - y)) >> 8);   // 0.713*(R-Y)
+		break;
+	    case VFMT_Y16:
+		y = p[0];                            // upper byte
+		break;
+	    default:
+		y = p[0];
+		break;
+	    }
+	    sum_y += y;
+	    if (y >= LEVEL_OVER)
+		over++;
+	    else if (y <= LEVEL_UNDER)
+		under++;
+	    // the saturated pixels have no reliable chroma.
+	    if (y < LEVEL_OVER && y > LEVEL_UNDER){
+		sum_u += u - 128;
+		sum_v += v - 128;
+		n_uv++;
+	    }
+	    n++;
+	}
+    }
+
+    if (n > 0){
+	stats->count = n;
+	stats->y = (float)sum_y / n;
+	stats->over  = (float)over / n;
+	stats->under = (float)under / n;
+    }
+    if (n_uv > 0){
+	stats->u = (float)sum_u / n_uv;
+	stats->v = (float)sum_v / n_uv;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------
+
+/**
+ * @class C1394AutoControl 1394cam.h
+ *
+ * Process() is called for each frame after UpdateFrameBuffer(). It
+ * samples the frame with C1394CameraNode::ComputeFrameStats(), and
+ * moves SHUTTER and GAIN so that the mean luminance approaches the
+ * target, and WHITE_BALANCE so that the mean chroma approaches gray.
+ *
+ * The exposure is controlled multiplicatively: the shutter is raised
+ * first when the frame is dark, and the gain is lowered first when
+ * it is bright. The absolute values are used if the camera supports
+ * them. After a change, a few frames are skipped until the camera
+ * reflects it.
+ *
+ * @code
+ *   C1394AutoControl ctl;
+ *   camera.AllocateFrameBuffer();
+ *   ctl.Attach(&camera);
+ *   camera.StartIsoTx();
+ *   for (;;){
+ *       camera.UpdateFrameBuffer();
+ *       ctl.Process();
+ *       ...
+ *   }
+ * @endcode
+ */
+
+C1394AutoControl::C1394AutoControl()
+    : m_camera(NULL), m_wb_reg(0),
+      m_exposure(true), m_white_balance(true),
+      m_target(110.f), m_tolerance(4.f),
+      m_k_exposure(0.8f), m_k_wb(0.5f), m_settle(2), m_wait(0)
+{
+    memset(&m_shutter, 0, sizeof(m_shutter));
+    memset(&m_gain, 0, sizeof(m_gain));
+    memset(&m_wb_u, 0, sizeof(m_wb_u));
+    memset(&m_wb_v, 0, sizeof(m_wb_v));
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+C1394AutoControl::~C1394AutoControl()
+{
+}
+
+/**
+ * Sets the target of the mean luminance.
+ *
+ * @param y          target (0..255)
+ * @param tolerance  no change is made within target +/- tolerance.
+ */
+void
+C1394AutoControl::SetTarget(float y, float tolerance)
+{
+    m_target = y;
+    m_tolerance = tolerance;
+}
+
+/**
+ * Sets how fast the controls respond.
+ *
+ * @param exposure       0..1; 1 corrects the whole error at once.
+ * @param white_balance  0..1; 1 corrects the whole error at once.
+ * @param settle         frames to wait after a change.
+ */
+void
+C1394AutoControl::SetResponse(float exposure, float white_balance, int settle)
+{
+    m_k_exposure = exposure;
+    m_k_wb = white_balance;
+    m_settle = settle;
+}
+
+/**
+ * Limits the range of a control.
+ *
+ * The limits are in the absolute unit (e.g. seconds for SHUTTER) if
+ * the camera supports the absolute control, otherwise in the raw
+ * unit. Call this function after Attach().
+ *
+ * @param feat  SHUTTER, GAIN or WHITE_BALANCE.
+ * @param min
+ * @param max
+ */
+void
+C1394AutoControl::SetLimit(C1394CAMERA_FEATURE feat, float min, float max)
+{
+    Control *c[2] = { NULL, NULL };
+    switch (feat){
+    case SHUTTER:       c[0] = &m_shutter; break;
+    case GAIN:          c[0] = &m_gain; break;
+    case WHITE_BALANCE: c[0] = &m_wb_u; c[1] = &m_wb_v; break;
+    default:
+	ERR("the feature " << feature_table[feat] << " is not controlled.");
+	return;
+    }
+    for (int i=0; i<2 && c[i]; i++){
+	if (min > c[i]->min)
+	    c[i]->min = min;
+	if (max < c[i]->max)
+	    c[i]->max = max;
+    }
+}
+
+/*
+ * reads the range and the current value, and takes the manual control.
+ */
+bool
+C1394AutoControl::Setup(C1394CAMERA_FEATURE feat, Control* ctl)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    C1394CameraNode *cam = m_camera;
+    if (!cam->HasFeature(feat) || !cam->HasCapability(feat, MANUAL))
+	return false;
+
+    if (cam->HasAbsControl(feat)){
+	float value;
+	if (!cam->GetAbsParameterRange(feat, &ctl->min, &ctl->max) ||
+	    !cam->GetAbsParameter(feat, &value) ||
+	    !cam->SetAbsParameter(feat, value))
+	    return false;
+	quadlet_t off = 0;
+	cam->ReadReg(cam->m_command_regs_base + OFFSET_ABS_CSR_HI_INQ_0
+		     + 4*feat, &off);
+	ctl->abs = true;
+	ctl->addr = CSR_REGISTER_BASE + off*4 + 0x0008;
+	ctl->value = value;
+    } else {
+	unsigned int min, max, value;
+	if (!cam->GetParameterRange(feat, &min, &max) ||
+	    !cam->GetParameter(feat, &value) ||
+	    !cam->SetParameter(feat, value))
+	    return false;
+	ctl->abs = false;
+	ctl->addr = cam->m_command_regs_base + OFFSET_BRIGHTNESS + 4*feat;
+	ctl->reg = SetParam(BRIGHTNESS,Presence_Inq,1)
+	    | SetParam(BRIGHTNESS,ON_OFF,1);
+	ctl->min = min;
+	ctl->max = max;
+	ctl->value = value;
+    }
+    ctl->valid = true;
+    return true;
+}
+
+/**
+ * Attaches the controller to the camera.
+ *
+ * SHUTTER, GAIN and WHITE_BALANCE are switched to the manual state,
+ * and the following frames control them.
+ *
+ * @param camera
+ *
+ * @return Zero on success, or -1 if the camera has none of them.
+ */
+int
+C1394AutoControl::Attach(C1394CameraNode* camera)
+{
+    CHK_PARAM(camera!=NULL);
+    Detach();
+    m_camera = camera;
+
+    Setup(SHUTTER, &m_shutter);
+    Setup(GAIN, &m_gain);
+
+    // WHITE_BALANCE holds U and V in a register, so both are raw.
+    memset(&m_wb_u, 0, sizeof(m_wb_u));
+    memset(&m_wb_v, 0, sizeof(m_wb_v));
+    unsigned int min, max, value;
+    if (camera->HasFeature(WHITE_BALANCE) &&
+	camera->HasCapability(WHITE_BALANCE, MANUAL) &&
+	camera->GetParameterRange(WHITE_BALANCE, &min, &max) &&
+	camera->GetParameter(WHITE_BALANCE, &value) &&
+	camera->SetParameter(WHITE_BALANCE, value)){
+	m_wb_u.valid = m_wb_v.valid = true;
+	m_wb_u.min = m_wb_v.min = min;
+	m_wb_u.max = m_wb_v.max = max;
+	m_wb_u.value = GetParam(WHITE_BALANCE,U_Value,value);
+	m_wb_v.value = GetParam(WHITE_BALANCE,V_Value,value);
+	m_wb_reg = SetParam(BRIGHTNESS,Presence_Inq,1)
+	    | SetParam(BRIGHTNESS,ON_OFF,1);
+    }
+
+    m_wait = m_settle;
+    if (!m_shutter.valid && !m_gain.valid && !m_wb_u.valid){
+	ERR("the camera has no controllable feature.");
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Detaches the controller. The features are left as they are.
+ */
+void
+C1394AutoControl::Detach()
+{
+    m_camera = NULL;
+    m_shutter.valid = m_gain.valid = false;
+    m_wb_u.valid = m_wb_v.valid = false;
+}
+
+/*
+ * writes the value with a single register write.
+ */
+bool
+C1394AutoControl::Write(Control* ctl, float value)
+{
+    if (value < ctl->min) value = ctl->min;
+    if (value > ctl->max) value = ctl->max;
+
+    quadlet_t tmp;
+    if (ctl->abs){
+	if (value == ctl->value)
+	    return false;
+	memcpy(&tmp, &value, sizeof(tmp));
+    } else {
+	value = floorf(value + 0.5f);
+	if (value == ctl->value)
+	    return false;
+	tmp = ctl->reg | SetParam(BRIGHTNESS,Value,(unsigned int)value);
+    }
+    if (!m_camera->WriteReg(ctl->addr, &tmp))
+	return false;
+    ctl->value = value;
+    return true;
+}
+
+/*
+ * multiplies the exposure by the ratio.
+ *
+ * @return true if changed.
+ */
+bool
+C1394AutoControl::AdjustExposure(float ratio)
+{
+    bool changed = false;
+    Control *order[2];
+    if (ratio > 1.f){
+	order[0] = &m_shutter; order[1] = &m_gain;
+    } else {
+	order[0] = &m_gain;    order[1] = &m_shutter;
+    }
+
+    for (int i=0; i<2 && fabsf(ratio - 1.f) > 0.01f; i++){
+	Control *c = order[i];
+	if (!c->valid)
+	    continue;
+	float value;
+	if (c == &m_gain && c->abs){
+	    // the absolute gain is in dB.
+	    value = c->value + 20.f * log10f(ratio);
+	} else if (c->value > 0.f){
+	    value = c->value * ratio;
+	    // the raw values must move at least one step.
+	    if (!c->abs && fabsf(value - c->value) < 1.f)
+		value = c->value + (ratio > 1.f ? 1.f : -1.f);
+	} else {
+	    value = c->value + (ratio > 1.f ? 1.f : 0.f);
+	}
+	float old = c->value;
+	if (!Write(c, value))
+	    continue;
+	changed = true;
+
+	// the rest of the ratio is given to the next control.
+	if (c == &m_gain && c->abs){
+	    ratio /= powf(10.f, (c->value - old) / 20.f);
+	} else if (old > 0.f){
+	    ratio /= c->value / old;
+	} else {
+	    break;
+	}
+    }
+    return changed;
+}
+
+/*
+ * moves WHITE_BALANCE so that the mean chroma approaches gray.
+ *
+ * @return true if changed.
+ */
+bool
+C1394AutoControl::Balance()
+{
+    if (!m_wb_u.valid || (fabsf(m_stats.u) < 1.f && fabsf(m_stats.v) < 1.f))
+	return false;
+
+    // -128..127 of the chroma is mapped to the range of the register.
+    const float scale = (m_wb_u.max - m_wb_u.min) / 256.f;
+    float u = m_wb_u.value - m_k_wb * m_stats.u * scale;
+    float v = m_wb_v.value - m_k_wb * m_stats.v * scale;
+    if (fabsf(u - m_wb_u.value) < 1.f && fabsf(m_stats.u) >= 1.f)
+	u = m_wb_u.value + (m_stats.u > 0 ? -1.f : 1.f);
+    if (fabsf(v - m_wb_v.value) < 1.f && fabsf(m_stats.v) >= 1.f)
+	v = m_wb_v.value + (m_stats.v > 0 ? -1.f : 1.f);
+    if (u < m_wb_u.min) u = m_wb_u.min;
+    if (u > m_wb_u.max) u = m_wb_u.max;
+    if (v < m_wb_v.min) v = m_wb_v.min;
+    if (v > m_wb_v.max) v = m_wb_v.max;
+    u = floorf(u + 0.5f);
+    v = floorf(v + 0.5f);
+    if (u == m_wb_u.value && v == m_wb_v.value)
+	return false;
+
+    quadlet_t tmp = m_wb_reg
+	| SetParam(WHITE_BALANCE,U_Value,(unsigned int)u)
+	| SetParam(WHITE_BALANCE,V_Value,(unsigned int)v);
+    if (!m_camera->WriteReg(m_camera->m_command_regs_base
+			    + OFFSET_BRIGHTNESS + 4*WHITE_BALANCE, &tmp))
+	return false;
+    m_wb_u.value = u;
+    m_wb_v.value = v;
+    return true;
+}
+
+/**
+ * Controls the camera with the current frame.
+ *
+ * @return 0 if the frame is within the targets, 1 if the camera is
+ * adjusted or the adjustment is settling, or -1 if an error occurred.
+ */
+int
+C1394AutoControl::Process()
+{
+    if (!m_camera)
+	return -1;
+    if (m_wait > 0){
+	m_wait--;
+	return 1;
+    }
+    if (0 != m_camera->ComputeFrameStats(&m_stats))
+	return -1;
+
+    bool changed = false;
+    if (m_exposure && m_stats.count > 0){
+	float y = m_stats.y;
+	if (fabsf(y - m_target) > m_tolerance || m_stats.over > 0.05f){
+	    float ratio = m_target / (y > 1.f ? y : 1.f);
+	    // the saturated pixels hide how bright the scene is.
+	    if (m_stats.over > 0.05f && ratio > 0.8f)
+		ratio = 0.8f;
+	    ratio = powf(ratio, m_k_exposure);
+	    changed = AdjustExposure(ratio) || changed;
+	}
+    }
+    if (m_white_balance)
+	changed = Balance() || changed;
+
+    if (changed){
+	m_wait = m_settle;
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
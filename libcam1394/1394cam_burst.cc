@@ -0,0 +1,340 @@
+/**
+ * @file    1394cam_burst.cc
+ * @brief   burst capture on top of Multi_Shot
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <libraw1394/raw1394.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+/**
+ * @class C1394BurstCapture 1394cam.h
+ *
+ * The frames of a burst are copied from the DMA ring of the driver
+ * into a preallocated buffer as they arrive, so a burst may be much
+ * longer than the ring. The buffer is locked in memory if the
+ * RLIMIT_MEMLOCK allows.
+ *
+ * @code
+ *   C1394BurstCapture burst;
+ *   camera.AllocateFrameBuffer();
+ *   burst.Allocate(&camera, 100);
+ *   burst.Start();
+ *   burst.Wait();
+ *   for (int i=0; i<burst.GetNumCaptured(); i++)
+ *       process(burst.GetFrame(i));
+ * @endcode
+ */
+
+C1394BurstCapture::C1394BurstCapture()
+    : m_camera(NULL), m_buffer(NULL), m_buffer_size(0), m_locked(false),
+      m_info(NULL), m_seq(NULL), m_frame_size(0), m_num_frame(0),
+      m_num_captured(0), m_timeout(1000), m_callback(NULL), m_arg(NULL),
+      m_running(false), m_done(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+C1394BurstCapture::~C1394BurstCapture()
+{
+    Release();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Allocates the buffer for the burst.
+ *
+ * The frame buffer of the camera must have been allocated by
+ * C1394CameraNode::AllocateFrameBuffer().
+ *
+ * @param camera     the camera to capture.
+ * @param num_frame  the number of frames of a burst (1..65535).
+ *
+ * @return Zero on success, or a negative value if an error occurred.
+ */
+int
+C1394BurstCapture::Allocate(C1394CameraNode* camera, int num_frame)
+{
+    Release();
+
+    if (!camera || num_frame <= 0 || 0xffff < num_frame){
+	ERR("illegal param passed.");
+	return -EINVAL;
+    }
+    m_frame_size = camera->GetFrameBufferSize();
+    if (m_frame_size <= 0){
+	ERR("the frame buffer is not allocated.");
+	return -EINVAL;
+    }
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    m_buffer_size = (size_t)m_frame_size * num_frame;
+    m_buffer_size = (m_buffer_size + page - 1) / page * page;
+
+    void *p = NULL;
+    if (0 != posix_memalign(&p, page, m_buffer_size)){
+	ERR("can't allocate " << m_buffer_size << " bytes.");
+	m_buffer_size = 0;
+	return -ENOMEM;
+    }
+    m_buffer = (char*)p;
+    if (0 == mlock(m_buffer, m_buffer_size)){
+	m_locked = true;
+    } else {
+	WRN("mlock() failed. " << strerror(errno));
+    }
+    // touches all pages now, not while capturing.
+    memset(m_buffer, 0, m_buffer_size);
+
+    m_info = new BufferInfo[num_frame];
+    m_seq  = new int[num_frame];
+    m_camera = camera;
+    m_num_frame = num_frame;
+    m_num_captured = 0;
+    return 0;
+}
+
+/**
+ * Releases the buffer. Waits for the running burst if any.
+ */
+void
+C1394BurstCapture::Release()
+{
+    Wait();
+    if (m_buffer){
+	if (m_locked)
+	    munlock(m_buffer, m_buffer_size);
+	free(m_buffer);
+    }
+    delete[] m_info;
+    delete[] m_seq;
+    m_buffer = NULL;
+    m_buffer_size = 0;
+    m_locked = false;
+    m_info = NULL;
+    m_seq = NULL;
+    m_camera = NULL;
+    m_frame_size = 0;
+    m_num_frame = 0;
+    m_num_captured = 0;
+}
+
+/**
+ * Starts a burst.
+ *
+ * The camera is kicked by Multi_Shot, and the frames are captured by
+ * a thread. The isochronus transmission must be stopped beforehand,
+ * otherwise frames of the continuous stream are taken as the burst.
+ * When the burst has completed, or no frame arrives within the
+ * timeout, the callback is called from the thread.
+ *
+ * @param timeout   timeout in msec for each frame.
+ * @param callback  function called on completion, or NULL.
+ * @param arg       argument passed to the callback.
+ *
+ * @return Zero on success, or a negative value if an error occurred.
+ */
+int
+C1394BurstCapture::Start(int timeout, Callback callback, void* arg)
+{
+    if (!m_buffer){
+	ERR("the buffer is not allocated.");
+	return -EINVAL;
+    }
+    Wait();
+
+    m_timeout = timeout;
+    m_callback = callback;
+    m_arg = arg;
+    m_num_captured = 0;
+    m_done = false;
+
+    int retval = pthread_create(&m_thread, NULL, thread_main, this);
+    if (0 != retval){
+	ERR("pthread_create() failed. " << strerror(retval));
+	return -retval;
+    }
+    m_running = true;
+
+    if (!m_camera->StartIsoTx(m_num_frame)){
+	ERR("StartIsoTx() failed.");
+    }
+    return 0;
+}
+
+/**
+ * Waits until the burst completes.
+ *
+ * @return the number of captured frames.
+ */
+int
+C1394BurstCapture::Wait()
+{
+    if (m_running){
+	pthread_join(m_thread, NULL);
+	m_running = false;
+    }
+    return m_num_captured;
+}
+
+/**
+ * Checks whether the burst has completed.
+ *
+ * @return True if the burst has completed.
+ */
+bool
+C1394BurstCapture::IsDone()
+{
+    pthread_mutex_lock(&m_mutex);
+    bool done = m_done || !m_running;
+    pthread_mutex_unlock(&m_mutex);
+    return done;
+}
+
+/**
+ * Returns the pointer of the n-th captured frame.
+ *
+ * @param n  0..GetNumCaptured()-1
+ *
+ * @return pointer of the frame, or NULL.
+ */
+void*
+C1394BurstCapture::GetFrame(int n) const
+{
+    if (n < 0 || m_num_captured <= n)
+	return NULL;
+    return m_buffer + (size_t)m_frame_size * n;
+}
+
+/**
+ * Returns the BufferInfo of the n-th captured frame.
+ *
+ * @param n  0..GetNumCaptured()-1
+ *
+ * @return pointer of the BufferInfo, or NULL.
+ */
+const BufferInfo*
+C1394BurstCapture::GetFrameInfo(int n) const
+{
+    if (n < 0 || m_num_captured <= n)
+	return NULL;
+    return &m_info[n];
+}
+
+/**
+ * Returns the position of the n-th captured frame in the burst.
+ *
+ * The position is estimated from the timestamps, so it is greater
+ * than n if some frames before the n-th frame are missing.
+ *
+ * @param n  0..GetNumCaptured()-1
+ *
+ * @return the position, or -1.
+ */
+int
+C1394BurstCapture::GetFrameSeq(int n) const
+{
+    if (n < 0 || m_num_captured <= n)
+	return -1;
+    return m_seq[n];
+}
+
+void*
+C1394BurstCapture::thread_main(void* arg)
+{
+    C1394BurstCapture *self = (C1394BurstCapture*)arg;
+    self->Capture();
+    return NULL;
+}
+
+void
+C1394BurstCapture::Capture()
+{
+    int n = 0;
+    while (n < m_num_frame){
+	int r = m_camera->WaitFrameBuffer(m_timeout);
+	if (r <= 0){
+	    if (0 == r)
+		LOG("burst timed out after " << n << " frame(s).");
+	    break;
+	}
+	BufferInfo info;
+	memset(&info, 0, sizeof(info));
+	void *p = m_camera->UpdateFrameBuffer(C1394CameraNode::AS_FIFO, &info);
+	if (!p)
+	    break;
+	memcpy(m_buffer + (size_t)m_frame_size * n, p, m_frame_size);
+	m_info[n] = info;
+	n++;
+    }
+    m_num_captured = n;
+    ComputeSequence();
+
+    if (n < m_num_frame){
+	WRN(m_num_frame - n << " frame(s) of the burst are missing.");
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_done = true;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (m_callback)
+	m_callback(this, m_arg);
+}
+
+/*
+ * estimates the position of each frame from the frame interval.
+ */
+void
+C1394BurstCapture::ComputeSequence()
+{
+    if (m_num_captured <= 0)
+	return;
+
+    int interval = 0;
+    FORMAT f; VMODE m; FRAMERATE r;
+    if (m_camera->QueryFormat(&f, &m, &r) && f <= Format_2 &&
+	FrameRate_0 <= r && r <= FrameRate_5){
+	// 1.875fps * 2^r
+	interval = 64000 / (15 << r);
+    } else {
+	// the shortest interval is the nominal one.
+	for (int i=1; i<m_num_captured; i++){
+	    int d = cycle_time_diff(m_info[i].timestamp, m_info[i-1].timestamp);
+	    if (d > 0 && (0 == interval || d < interval))
+		interval = d;
+	}
+    }
+
+    m_seq[0] = 0;
+    for (int i=1; i<m_num_captured; i++){
+	int step = 1;
+	if (interval > 0){
+	    int d = cycle_time_diff(m_info[i].timestamp, m_info[i-1].timestamp);
+	    step = (d + interval/2) / interval;
+	    if (step < 1)
+		step = 1;
+	}
+	m_seq[i] = m_seq[i-1] + step;
+    }
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,278 @@
+/**
+ * @file    1394cam_cache.cc
+ * @brief   sharing the converted frames among consumers
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <libraw1394/raw1394.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+#include "yuv.h"
+
+using namespace std;
+
+/*
+ * Each converted frame is an entry keyed by the sequence number of the
+ * frame and the layout. The first consumer asking for a key converts
+ * the frame into a free entry, and the others asking meanwhile wait
+ * for it; later ones just take it. The entries are referenced while
+ * consumers read them, and an entry no longer referenced is reused
+ * for another key, keeping its buffer.
+ */
+
+enum {
+    MAX_CACHED = 8,
+};
+
+struct CachedFrame {
+    unsigned int  seq;
+    int           layout;     // CONV_*, or -1 if never used
+    int           refcount;
+    bool          ready;      // converted, or failed
+    bool          failed;
+    vector<unsigned char> data;
+    ImageDesc     desc;
+};
+
+struct FrameCache {
+    pthread_mutex_t mutex;
+    pthread_cond_t  ready;
+    int             num_frame;
+    CachedFrame     frames[MAX_CACHED];
+};
+
+/**
+ * Enables or disables the cache of the converted frames.
+ *
+ * While enabled, each frame is converted to each layout at most once,
+ * by the first of AcquireConvertedFrame(), CopyRGBAImage(),
+ * CopyIplImage() and so on, and the others share the result. This
+ * pays when several threads take the same frames, e.g. to display, to
+ * record and to analyze them.
+ *
+ * Call this before the consumers start, and disable the cache only
+ * after they release all the frames.
+ *
+ * A copy of the node starts with the cache disabled.
+ *
+ * @param enable  true to enable.
+ *
+ * @return Zero on success.
+ */
+int
+C1394CameraNode::EnableConversionCache(bool enable)
+{
+    if (enable == (NULL != m_cache))
+	return 0;
+    if (enable){
+	FrameCache *cache = new FrameCache;
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->ready, NULL);
+	cache->num_frame = 0;
+	m_cache.Reset(cache);
+    } else {
+	m_cache.Reset(NULL);
+    }
+    return 0;
+}
+
+template <>
+void
+C1394NodeBuffer<FrameCache>::Reset(FrameCache* ptr)
+{
+    if (m_ptr){
+	pthread_cond_destroy(&m_ptr->ready);
+	pthread_mutex_destroy(&m_ptr->mutex);
+	delete m_ptr;
+    }
+    m_ptr = ptr;
+}
+
+/*
+ * sets the current frame, and counts it as a new one unless NULL. The
+ * drivers may return the same buffer again for a new frame.
+ */
+void
+C1394CameraNode::SetCurrentFrame(char* frame)
+{
+    if (m_cache)
+	pthread_mutex_lock(&m_cache->mutex);
+    if (frame)
+	m_frame_seq++;
+    m_lpFrameBuffer = frame;
+    if (m_cache)
+	pthread_mutex_unlock(&m_cache->mutex);
+}
+
+/**
+ * Gets the current frame converted to a layout, shared with others.
+ *
+ * The frame is converted only if no one has done yet; see
+ * EnableConversionCache(). The image must not be modified, and must
+ * be released by ReleaseConvertedFrame(). The images of up to 8
+ * frames and layouts may be held at a time.
+ *
+ * The sequence number advances at each UpdateFrameBuffer() which
+ * returns a frame, and at SetY16Depth() and SetY16Window().
+ *
+ * @param layout  CONV_RGBA, CONV_BGR, CONV_GRAY, or CONV_Y16 for Y16.
+ * @param seq     pointer to store the sequence number of the frame,
+ *                or NULL.
+ *
+ * @return the image, or NULL if an error occurred.
+ *
+ * @note The alpha components of CONV_RGBA are undefined.
+ */
+const ImageDesc*
+C1394CameraNode::AcquireConvertedFrame(int layout, unsigned int* seq)
+{
+    int bpp = conversion_bytes_per_pixel(layout);
+    if (!m_cache){
+	ERR("the conversion cache is not enabled.");
+	return NULL;
+    }
+    if (!m_conv || 0 == bpp || !m_conv->to[layout]){
+	LOG("this pixel format is not supported yet.");
+	return NULL;
+    }
+
+    FrameCache *cache = m_cache;
+    pthread_mutex_lock(&cache->mutex);
+    const char *src = m_lpFrameBuffer;
+    unsigned int cur = m_frame_seq;
+    if (!src){
+	pthread_mutex_unlock(&cache->mutex);
+	return NULL;
+    }
+
+    CachedFrame *f = NULL, *spare = NULL;
+    for (int i=0; i<cache->num_frame; i++){
+	CachedFrame *e = &cache->frames[i];
+	if (e->layout == layout && e->seq == cur && !e->failed){
+	    f = e;
+	    break;
+	}
+	// the buffers of the same layout are reused first.
+	if (0 == e->refcount &&
+	    (!spare || (spare->layout != layout && e->layout == layout)))
+	    spare = e;
+    }
+    if (f){
+	f->refcount++;
+	while (!f->ready)
+	    pthread_cond_wait(&cache->ready, &cache->mutex);
+	if (f->failed){
+	    f->refcount--;
+	    f = NULL;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	if (f && seq)
+	    *seq = cur;
+	return f ? &f->desc : NULL;
+    }
+    if (!spare){
+	if (MAX_CACHED == cache->num_frame){
+	    pthread_mutex_unlock(&cache->mutex);
+	    ERR("all the cached frames are in use.");
+	    return NULL;
+	}
+	spare = &cache->frames[cache->num_frame++];
+    }
+    f = spare;
+    f->seq = cur;
+    f->layout = layout;
+    f->refcount = 1;
+    f->ready = false;
+    f->failed = false;
+    pthread_mutex_unlock(&cache->mutex);
+
+    // the others wait for this entry, so it is converted unlocked.
+    size_t size = (size_t)m_Image_W * m_Image_H * bpp;
+    if (f->data.size() < size)
+	f->data.resize(size);
+    f->desc.data = &f->data[0];
+    f->desc.step = m_Image_W * bpp;
+    f->desc.width = m_Image_W;
+    f->desc.height = m_Image_H;
+    bool ok = (0 == ConvertFrame(layout, &f->data[0], src));
+
+    pthread_mutex_lock(&cache->mutex);
+    f->ready = true;
+    f->failed = !ok;
+    if (!ok)
+	f->refcount--;
+    pthread_cond_broadcast(&cache->ready);
+    pthread_mutex_unlock(&cache->mutex);
+    if (ok && seq)
+	*seq = cur;
+    return ok ? &f->desc : NULL;
+}
+
+/**
+ * Releases the image got by AcquireConvertedFrame().
+ *
+ * @param image  the image, or NULL.
+ */
+void
+C1394CameraNode::ReleaseConvertedFrame(const ImageDesc* image)
+{
+    if (!m_cache || !image)
+	return;
+    scoped_lock lock(&m_cache->mutex);
+    for (int i=0; i<m_cache->num_frame; i++){
+	CachedFrame *f = &m_cache->frames[i];
+	if (&f->desc == image && f->refcount > 0){
+	    f->refcount--;
+	    return;
+	}
+    }
+    ERR("the image is not cached.");
+}
+
+/*
+ * copies the current frame from the cache, clipped to dest. The alpha
+ * components of CONV_RGBA are left as they are.
+ */
+int
+C1394CameraNode::CopyCachedImage(const ImageDesc* dest, int layout)
+{
+    const ImageDesc *src = AcquireConvertedFrame(layout);
+    if (!src)
+	return -1;
+    const int bpp = conversion_bytes_per_pixel(layout);
+    const int w = min(dest->width, src->width);
+    const int h = min(dest->height, src->height);
+    for (int y=0; y<h; y++){
+	const unsigned char *s = src->data + (size_t)y * src->step;
+	unsigned char *d = dest->data + (size_t)y * dest->step;
+	if (CONV_RGBA != layout){
+	    memcpy(d, s, w * bpp);
+	    continue;
+	}
+	for (int x=0; x<w; x++, s+=4, d+=4){
+	    d[0] = s[0];
+	    d[1] = s[1];
+	    d[2] = s[2];
+	}
+    }
+    ReleaseConvertedFrame(src);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
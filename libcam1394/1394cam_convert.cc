@@ -0,0 +1,214 @@
+/**
+ * @file    1394cam_convert.cc
+ * @brief   worker threads for the color conversion
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libraw1394/raw1394.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+/*
+ * The pool has num_thread-1 workers; the thread calling
+ * run_conversion() converts the first band itself. Each worker
+ * always gets the same band of the frame, so it keeps writing the
+ * same range of the destination.
+ *
+ * Only one frame is converted by the pool at a time. If another
+ * thread is converting, the caller converts its frame alone instead
+ * of waiting.
+ */
+
+namespace {
+
+enum {
+    MAX_THREAD = 64,
+};
+
+struct Band {
+    int first;
+    int count;
+};
+
+struct Worker {
+    pthread_t    thread;
+    int          index;
+    unsigned int seen;     // generation of the last frame converted
+};
+
+pthread_mutex_t busy  = PTHREAD_MUTEX_INITIALIZER; // held while converting
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // guards the below
+pthread_cond_t  start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  done  = PTHREAD_COND_INITIALIZER;
+
+int          num_thread = 1;
+Worker       workers[MAX_THREAD];
+unsigned int generation = 0;
+int          num_pending = 0;
+bool         quit = false;
+
+void (*job_func)(void* arg, int first, int count);
+void*        job_arg;
+Band         bands[MAX_THREAD];
+
+void*
+worker_main(void* arg)
+{
+    Worker *self = (Worker*)arg;
+
+    pthread_mutex_lock(&mutex);
+    for (;;){
+	while (!quit && self->seen == generation)
+	    pthread_cond_wait(&start, &mutex);
+	if (quit)
+	    break;
+	self->seen = generation;
+	Band band = bands[self->index];
+	pthread_mutex_unlock(&mutex);
+
+	if (band.count > 0)
+	    job_func(job_arg, band.first, band.count);
+
+	pthread_mutex_lock(&mutex);
+	if (0 == --num_pending)
+	    pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+/*
+ * stops all workers. 'busy' must be held.
+ */
+void
+stop_workers()
+{
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&mutex);
+    for (int i=1; i<num_thread; i++)
+	pthread_join(workers[i].thread, NULL);
+    quit = false;
+    num_thread = 1;
+}
+
+} // namespace
+
+/**
+ * Sets the number of threads converting a frame.
+ *
+ * CopyRGBAImage(), CopyIplImage() and CopyIplImageGray() split the
+ * frame into bands of packets, and convert the bands in parallel by
+ * a pool of persistent worker threads. The bands are aligned to the
+ * rows of the image whenever possible. The pool is shared by all
+ * cameras.
+ *
+ * @param num  the number of threads including the caller. 0 means
+ *             the number of online CPUs, and 1 disables the pool.
+ *
+ * @return the number of threads actually used.
+ */
+int
+SetConversionThreads(int num)
+{
+    if (num <= 0){
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num = (cpus > 0) ? cpus : 1;
+    }
+    if (num > MAX_THREAD)
+	num = MAX_THREAD;
+
+    scoped_lock lock(&busy);
+    if (num == num_thread)
+	return num_thread;
+    stop_workers();
+
+    for (int i=1; i<num; i++){
+	workers[i].index = i;
+	workers[i].seen = generation;
+	int retval = pthread_create(&workers[i].thread, NULL, worker_main,
+				    &workers[i]);
+	if (0 != retval){
+	    ERR("pthread_create() failed. " << strerror(retval));
+	    break;
+	}
+	num_thread = i + 1;
+    }
+    LOG("color conversion uses " << num_thread << " thread(s).");
+    return num_thread;
+}
+
+/*
+ * converts a frame, splitting it into bands of packets.
+ *
+ * @param func        converts 'count' packets from 'first'.
+ * @param arg         passed to func.
+ * @param num_packet  the number of packets per frame.
+ * @param unit        the number of packets per band is rounded up to
+ *                    a multiple of this, e.g. the packets per row.
+ */
+void
+run_conversion(void (*func)(void* arg, int first, int count), void* arg,
+	       int num_packet, int unit)
+{
+    if (num_packet < 2 || 0 != pthread_mutex_trylock(&busy)){
+	func(arg, 0, num_packet);
+	return;
+    }
+    if (num_thread <= 1){
+	pthread_mutex_unlock(&busy);
+	func(arg, 0, num_packet);
+	return;
+    }
+
+    int per = (num_packet + num_thread - 1) / num_thread;
+    if (unit > 1 && unit <= per)
+	per = (per + unit - 1) / unit * unit;
+
+    pthread_mutex_lock(&mutex);
+    job_func = func;
+    job_arg = arg;
+    for (int i=0; i<num_thread; i++){
+	int first = i * per;
+	int last = first + per;
+	if (first > num_packet)
+	    first = num_packet;
+	if (last > num_packet)
+	    last = num_packet;
+	bands[i].first = first;
+	bands[i].count = last - first;
+    }
+    num_pending = num_thread - 1;
+    generation++;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&mutex);
+
+    if (bands[0].count > 0)
+	func(arg, bands[0].first, bands[0].count);
+
+    pthread_mutex_lock(&mutex);
+    while (num_pending > 0)
+	pthread_cond_wait(&done, &mutex);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_mutex_unlock(&busy);
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
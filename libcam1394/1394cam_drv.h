@@ -14,6 +14,13 @@ struct libcam1394_driver {
      void* (*updateFrameBuffer)(libcam1394_driver* ctx,
 				C1394CameraNode::BUFFER_OPTION opt, 
 				BufferInfo* info);
+     // optional; returns 1 if a frame is ready, 0 on timeout or -1.
+     int (*waitFrame)(libcam1394_driver* ctx, int timeout);
+     // optional; reuses the buffer for a new packet layout, returns
+     // 0 on success or -1 if the buffer must be reopened.
+     int (*requeue)(libcam1394_driver* ctx,
+		    int channel,
+		    int sz_packet, int num_packet, int *header_size);
 };
 
 libcam1394_driver * open_1394_driver(int port_no, const char *devicename,
@@ -0,0 +1,553 @@
+/**
+ * @file    1394cam_format7.cc
+ * @brief   Format_7 (scalable image format) support
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+// quadlet index of each register in the Format_7 CSR
+#define F7(name) (OFFSET_##name/4)
+#define NUM_FORMAT7_REGS (F7(UNIT_POSITION_INQ)+1)
+
+/**
+ * Returns the base address of the Format_7 CSR of the mode.
+ *
+ * @param mode
+ *
+ * @return the address, or 0 if the camera doesn't have the mode.
+ */
+nodeaddr_t
+C1394CameraNode::GetFormat7CSR(VMODE mode)
+{
+    if (mode < Mode_0 || Mode_7 < mode)
+	return 0;
+    if (m_format7_csr[mode])
+	return m_format7_csr[mode];
+
+    quadlet_t tmp;
+    if (!ReadReg(Addr(V_FORMAT_INQ), &tmp) ||
+	0==GetParam(V_FORMAT_INQ,Format_7,tmp)){
+	LOG("your camera has no format_7 feature");
+	return 0;
+    }
+    if (!ReadReg(Addr(V_MODE_INQ_7), &tmp) ||
+	0==((tmp >> (31-mode))&0x1)){
+	LOG("your camera has no format_7 mode_"<<mode<<" feature");
+	return 0;
+    }
+    if (!ReadReg(Addr(V_CSR_INQ_7_0) + mode*4, &tmp))
+	return 0;
+    m_format7_csr[mode] = CSR_REGISTER_BASE + tmp*4;
+    return m_format7_csr[mode];
+}
+
+/*
+ * Makes the camera validate the written parameters.
+ *
+ * Cameras without VALUE_SETTING update PACKET_PARA_INQ and so on
+ * by themselves.
+ */
+bool
+C1394CameraNode::UpdateFormat7(nodeaddr_t base)
+{
+    quadlet_t tmp;
+    if (!ReadReg(base + OFFSET_VALUE_SETTING, &tmp))
+	return false;
+    if (0==GetParam(VALUE_SETTING,Presence,tmp))
+	return true;
+
+    tmp = SetParam(VALUE_SETTING,Setting_1,1);
+    WriteReg(base + OFFSET_VALUE_SETTING, &tmp);
+    for (int retry=0; retry<100; retry++){
+	if (!ReadReg(base + OFFSET_VALUE_SETTING, &tmp))
+	    return false;
+	if (0==GetParam(VALUE_SETTING,Setting_1,tmp))
+	    break;
+	usleep(1000);
+    }
+    if (GetParam(VALUE_SETTING,Setting_1,tmp)){
+	ERR("camera didn't update format_7 parameters.");
+	return false;
+    }
+    if (GetParam(VALUE_SETTING,ErrorFlag_1,tmp)){
+	ERR("bad image position, size or color coding.");
+	return false;
+    }
+    if (GetParam(VALUE_SETTING,ErrorFlag_2,tmp)){
+	ERR("bad packet size.");
+	return false;
+    }
+    return true;
+}
+
+/**
+ * Retrieves the parameters of the Format_7 mode.
+ *
+ * @param mode  a video mode of Format_7.
+ * @param info  pointer to store the parameters.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::QueryFormat7Info(VMODE mode, Format7Info* info)
+{
+    CHK_PARAM(info!=NULL);
+    nodeaddr_t base = GetFormat7CSR(mode);
+    if (!base)
+	return false;
+
+    quadlet_t r[NUM_FORMAT7_REGS];
+    if (!ReadRegBlock(base, r, NUM_FORMAT7_REGS))
+	return false;
+
+    info->max_width   = GetParam(MAX_IMAGE_SIZE_INQ,Hmax,r[F7(MAX_IMAGE_SIZE_INQ)]);
+    info->max_height  = GetParam(MAX_IMAGE_SIZE_INQ,Vmax,r[F7(MAX_IMAGE_SIZE_INQ)]);
+    info->unit_width  = GetParam(UNIT_SIZE_INQ,Hunit,r[F7(UNIT_SIZE_INQ)]);
+    info->unit_height = GetParam(UNIT_SIZE_INQ,Vunit,r[F7(UNIT_SIZE_INQ)]);
+    info->unit_left   = GetParam(UNIT_POSITION_INQ,Hposunit,r[F7(UNIT_POSITION_INQ)]);
+    info->unit_top    = GetParam(UNIT_POSITION_INQ,Vposunit,r[F7(UNIT_POSITION_INQ)]);
+    // UNIT_POSITION_INQ is defined since IIDC 1.30.
+    if (0 == info->unit_left)
+	info->unit_left = info->unit_width;
+    if (0 == info->unit_top)
+	info->unit_top = info->unit_height;
+    info->left   = GetParam(IMAGE_POSITION,Left,r[F7(IMAGE_POSITION)]);
+    info->top    = GetParam(IMAGE_POSITION,Top,r[F7(IMAGE_POSITION)]);
+    info->width  = GetParam(IMAGE_SIZE,Width,r[F7(IMAGE_SIZE)]);
+    info->height = GetParam(IMAGE_SIZE,Height,r[F7(IMAGE_SIZE)]);
+    info->color_coding = (COLOR_CODING)GetParam(COLOR_CODING_ID,Coding_ID,
+						r[F7(COLOR_CODING_ID)]);
+    info->color_coding_inq = r[F7(COLOR_CODING_INQ)];
+    info->unit_bytes_per_packet =
+	GetParam(PACKET_PARA_INQ,UnitBytePerPacket,r[F7(PACKET_PARA_INQ)]);
+    info->max_bytes_per_packet =
+	GetParam(PACKET_PARA_INQ,MaxBytePerPacket,r[F7(PACKET_PARA_INQ)]);
+    info->bytes_per_packet =
+	GetParam(BYTE_PER_PACKET,BytePerPacket,r[F7(BYTE_PER_PACKET)]);
+    info->rec_bytes_per_packet =
+	GetParam(BYTE_PER_PACKET,RecBytePerPacket,r[F7(BYTE_PER_PACKET)]);
+    info->total_bytes = ((uint64_t)r[F7(TOTAL_BYTES_HI_INQ)] << 32)
+	| r[F7(TOTAL_BYTES_LO_INQ)];
+    info->packets_per_frame = r[F7(PACKET_PER_FRAME_INQ)];
+
+    // PACKET_PER_FRAME_INQ is defined since IIDC 1.30.
+    if (0 == info->packets_per_frame && 0 < info->bytes_per_packet){
+	uint64_t total = info->total_bytes;
+	if (0 == total){
+	    int bits = 0;
+	    switch (GetPixelFormat(info->color_coding)){
+	    case VFMT_YUV444: case VFMT_RGB888: bits = 24; break;
+	    case VFMT_YUV422: case VFMT_Y16:    bits = 16; break;
+	    case VFMT_YUV411:                   bits = 12; break;
+	    case VFMT_Y8:                       bits =  8; break;
+	    default:                            break;
+	    }
+	    total = (uint64_t)info->width * info->height * bits / 8;
+	}
+	info->packets_per_frame = (total + info->bytes_per_packet - 1)
+	    / info->bytes_per_packet;
+    }
+    return true;
+}
+
+/**
+ * Sets the region of interest of the Format_7 mode.
+ *
+ * The packet size is set to the recommended (or maximum) one if the
+ * current packet size is no longer valid.
+ *
+ * @param mode    a video mode of Format_7.
+ * @param left    horizontal position, a multiple of the position unit.
+ * @param top     vertical position, a multiple of the position unit.
+ * @param width   image width, a multiple of the size unit.
+ * @param height  image height, a multiple of the size unit.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::SetFormat7ROI(VMODE mode, int left, int top,
+			       int width, int height)
+{
+    scoped_lock lock(GetLock());
+    Format7Info info;
+    if (!QueryFormat7Info(mode, &info))
+	return false;
+
+    if (width <= 0 || height <= 0 ||
+	left < 0 || top < 0 ||
+	info.max_width  < left + width ||
+	info.max_height < top + height ||
+	(info.unit_width  && width  % info.unit_width)  ||
+	(info.unit_height && height % info.unit_height) ||
+	(info.unit_left   && left   % info.unit_left)   ||
+	(info.unit_top    && top    % info.unit_top)){
+	ERR("bad ROI ("<<left<<","<<top<<")-"<<width<<"x"<<height);
+	return false;
+    }
+
+    nodeaddr_t base = GetFormat7CSR(mode);
+    quadlet_t tmp;
+    // moves to the origin first, so that the new size always fits.
+    tmp = SetParam(IMAGE_POSITION,Left,0) | SetParam(IMAGE_POSITION,Top,0);
+    WriteReg(base + OFFSET_IMAGE_POSITION, &tmp);
+    tmp = SetParam(IMAGE_SIZE,Width,width) | SetParam(IMAGE_SIZE,Height,height);
+    WriteReg(base + OFFSET_IMAGE_SIZE, &tmp);
+    tmp = SetParam(IMAGE_POSITION,Left,left) | SetParam(IMAGE_POSITION,Top,top);
+    WriteReg(base + OFFSET_IMAGE_POSITION, &tmp);
+    if (!UpdateFormat7(base))
+	return false;
+
+    if (!QueryFormat7Info(mode, &info))
+	return false;
+    if (0 == info.bytes_per_packet ||
+	info.max_bytes_per_packet < info.bytes_per_packet ||
+	(info.unit_bytes_per_packet &&
+	 info.bytes_per_packet % info.unit_bytes_per_packet)){
+	int bpp = info.rec_bytes_per_packet;
+	if (0 == bpp)
+	    bpp = info.max_bytes_per_packet;
+	return SetFormat7BytePerPacket(mode, bpp);
+    }
+    return true;
+}
+
+/**
+ * Sets the color coding of the Format_7 mode.
+ *
+ * @param mode    a video mode of Format_7.
+ * @param coding  a COLOR_CODING.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::SetFormat7ColorCoding(VMODE mode, COLOR_CODING coding)
+{
+    scoped_lock lock(GetLock());
+    Format7Info info;
+    if (!QueryFormat7Info(mode, &info))
+	return false;
+    if (coding < COLOR_MONO8 || 31 < coding ||
+	0 == ((info.color_coding_inq >> (31-coding)) & 0x1)){
+	ERR("your camera has no color coding "<<coding<<" on mode_"<<mode);
+	return false;
+    }
+    nodeaddr_t base = GetFormat7CSR(mode);
+    quadlet_t tmp = SetParam(COLOR_CODING_ID,Coding_ID,coding);
+    WriteReg(base + OFFSET_COLOR_CODING_ID, &tmp);
+    return UpdateFormat7(base);
+}
+
+/**
+ * Sets the packet size of the Format_7 mode.
+ *
+ * The frame rate of Format_7 is determined by the packet size, since
+ * one packet is sent per isochronus cycle (125usec).
+ *
+ * @param mode   a video mode of Format_7.
+ * @param bytes  packet size, a multiple of the unit packet size.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::SetFormat7BytePerPacket(VMODE mode, int bytes)
+{
+    scoped_lock lock(GetLock());
+    Format7Info info;
+    if (!QueryFormat7Info(mode, &info))
+	return false;
+    if (bytes <= 0 || info.max_bytes_per_packet < bytes ||
+	(info.unit_bytes_per_packet && bytes % info.unit_bytes_per_packet)){
+	ERR("bad packet size "<<bytes<<" (unit "<<info.unit_bytes_per_packet
+	    <<", max "<<info.max_bytes_per_packet<<")");
+	return false;
+    }
+    nodeaddr_t base = GetFormat7CSR(mode);
+    quadlet_t tmp = SetParam(BYTE_PER_PACKET,BytePerPacket,bytes);
+    WriteReg(base + OFFSET_BYTE_PER_PACKET, &tmp);
+    return UpdateFormat7(base);
+}
+
+/*
+ * measures the frame rate by receiving some frames.
+ *
+ * @return the frame rate, 0 if no frame arrived, or -1 on error.
+ */
+static float
+measure_frame_rate(C1394CameraNode& camera, int num_sample)
+{
+    if (camera.AllocateFrameBuffer())
+	return -1;
+    camera.StartIsoTx();
+
+    const int NUM_SKIP = 2;
+    int *interval = new int[num_sample];
+    int n = 0;
+    unsigned int last = 0;
+    for (int i=0; i<NUM_SKIP+num_sample+1; i++){
+	if (camera.WaitFrameBuffer(1000) <= 0)
+	    break;
+	BufferInfo info;
+	memset(&info, 0, sizeof(info));
+	if (!camera.UpdateFrameBuffer(C1394CameraNode::AS_FIFO, &info))
+	    break;
+	if (i > NUM_SKIP)
+	    interval[n++] = cycle_time_diff(info.timestamp, last);
+	last = info.timestamp;
+    }
+    camera.StopIsoTx();
+
+    float fps = 0.f;
+    if (n > 0){
+	// the median is robust against dropped frames.
+	sort(interval, interval+n);
+	if (interval[n/2] > 0)
+	    fps = 8000.f / interval[n/2];
+    }
+    delete[] interval;
+    return fps;
+}
+
+/**
+ * Chooses the packet size of the Format_7 mode which gives the
+ * highest frame rate within the bandwidth budget.
+ *
+ * The largest packet size within the budget is tried first. If the
+ * measured frame rate is lower than expected, the camera itself limits
+ * the frame rate, so the smallest packet size that keeps the measured
+ * frame rate is chosen to leave bandwidth for other cameras. The
+ * result is verified by measuring the frame intervals.
+ *
+ * @note The frame buffer is reallocated, and the isochronus
+ * transmission is stopped on return.
+ *
+ * @param mode        a video mode of Format_7, whose ROI and color
+ *                    coding have been set.
+ * @param budget      bandwidth budget in bytes per cycle, or 0 to use
+ *                    all bandwidth of the current speed.
+ * @param result      pointer to store the result, or NULL.
+ * @param num_sample  number of frame intervals to measure.
+ *
+ * @return True on success, or false if the camera sends no frame.
+ */
+bool
+C1394CameraNode::TuneFormat7PacketSize(VMODE mode, int budget,
+				       Format7Tuning* result, int num_sample)
+{
+    Format7Info info;
+    if (!QueryFormat7Info(mode, &info))
+	return false;
+
+    if (budget <= 0){
+	SPD spd;
+	QueryIsoSpeed(&spd);
+	budget = GetIsoBandwidth(spd);
+    }
+    const int unit = (info.unit_bytes_per_packet > 0) ?
+	info.unit_bytes_per_packet : 4;
+    int limit = (budget < info.max_bytes_per_packet) ?
+	budget : info.max_bytes_per_packet;
+    limit -= limit % unit;
+    if (limit < unit){
+	ERR("bandwidth budget "<<budget<<" is less than the unit packet size.");
+	return false;
+    }
+    uint64_t total = info.total_bytes;
+    if (0 == total)
+	total = (uint64_t)info.packets_per_frame * info.bytes_per_packet;
+
+    int bpp = limit;
+    if (!SetFormat7BytePerPacket(mode, bpp) || !QueryFormat7Info(mode, &info))
+	return false;
+    float expected = 8000.f / info.packets_per_frame;
+    float measured = measure_frame_rate(*this, num_sample);
+    LOG("format_7 "<<bpp<<" bytes/packet: expected "<<expected
+	<<"fps, measured "<<measured<<"fps");
+    if (measured <= 0){
+	ERR("no frame has been received at "<<bpp<<" bytes/packet.");
+	return false;
+    }
+
+    if (measured < expected*0.95f && 0 < total){
+	// the camera is slower than the bus; use only what it needs.
+	int cycles = (int)(8000.f / measured);
+	int small = (int)((total + cycles - 1) / cycles);
+	small = (small + unit - 1) / unit * unit;
+	if (small < bpp && SetFormat7BytePerPacket(mode, small) &&
+	    QueryFormat7Info(mode, &info)){
+	    float e = 8000.f / info.packets_per_frame;
+	    float m = measure_frame_rate(*this, num_sample);
+	    LOG("format_7 "<<small<<" bytes/packet: expected "<<e
+		<<"fps, measured "<<m<<"fps");
+	    if (m >= measured*0.95f){
+		bpp = small;
+		expected = e;
+		measured = m;
+	    } else {
+		// reverts, and reallocates the buffer for it.
+		SetFormat7BytePerPacket(mode, bpp);
+		AllocateFrameBuffer();
+	    }
+	}
+    }
+
+    if (result){
+	result->bytes_per_packet = bpp;
+	result->expected_fps = expected;
+	result->measured_fps = measured;
+    }
+    return true;
+}
+
+/**
+ * Tunes the packet sizes of all Format_7 cameras, sharing the
+ * bandwidth of each port fairly.
+ *
+ * The bandwidth used by the cameras in the fixed formats is
+ * subtracted first, and the rest is divided equally among the
+ * Format_7 cameras on the port. A camera whose share is less than
+ * its unit packet size is not tuned.
+ *
+ * @param list  cameras.
+ *
+ * @return True if all Format_7 cameras have been tuned.
+ */
+bool
+TuneFormat7PacketSizeAll(CCameraList& list)
+{
+    const int NUM_PORT = 16;
+    int used[NUM_PORT];
+    int num_f7[NUM_PORT];
+    SPD spd[NUM_PORT];
+    memset(used, 0, sizeof(used));
+    memset(num_f7, 0, sizeof(num_f7));
+    for (int i=0; i<NUM_PORT; i++)
+	spd[i] = SPD_3200M;
+
+    CCameraList::iterator cam;
+    for (cam=list.begin(); cam!=list.end(); cam++){
+	int port = cam->m_port_no;
+	if (port < 0 || NUM_PORT <= port)
+	    continue;
+	FORMAT f; VMODE m; FRAMERATE r;
+	SPD s;
+	cam->QueryFormat(&f, &m, &r);
+	cam->QueryIsoSpeed(&s);
+	// the slowest camera bounds the bandwidth of the port.
+	if (s < spd[port])
+	    spd[port] = s;
+	if (Format_7 == f)
+	    num_f7[port]++;
+	else if (GetPacketSize(f, m, r) > 0)
+	    used[port] += GetPacketSize(f, m, r);
+    }
+
+    bool r = true;
+    for (cam=list.begin(); cam!=list.end(); cam++){
+	int port = cam->m_port_no;
+	FORMAT f; VMODE m; FRAMERATE rate;
+	cam->QueryFormat(&f, &m, &rate);
+	if (Format_7 != f || port < 0 || NUM_PORT <= port)
+	    continue;
+	int budget = (GetIsoBandwidth(spd[port]) - used[port]) / num_f7[port];
+	LOG("camera "<<cam->GetID()<<" budget "<<budget<<" bytes/cycle");
+	// TuneFormat7PacketSize() takes 0 or less as the whole bandwidth.
+	Format7Info info;
+	if (!cam->QueryFormat7Info(m, &info)){
+	    r = false;
+	    continue;
+	}
+	int unit = (info.unit_bytes_per_packet > 0) ?
+	    info.unit_bytes_per_packet : 4;
+	if (budget < unit){
+	    ERR("camera "<<cam->GetID()<<": no bandwidth is left on port "
+		<<port<<".");
+	    r = false;
+	    continue;
+	}
+	if (!cam->TuneFormat7PacketSize(m, budget))
+	    r = false;
+    }
+    return r;
+}
+
+/**
+ * Returns the isochronus bandwidth per cycle.
+ *
+ * 100usec of each 125usec cycle is available for isochronus packets,
+ * which is 1228 bytes at S100, doubled at each faster speed. This is
+ * shared by all cameras on the port; the payload of a single packet
+ * is further limited by Format7Info::max_bytes_per_packet.
+ *
+ * @param spd
+ *
+ * @return bytes per cycle.
+ */
+int GetIsoBandwidth(SPD spd)
+{
+    return 1228 << spd;
+}
+
+/**
+ * Returns the pixel format of the color coding.
+ *
+ * Raw (bayer) codings are handled as gray images.
+ *
+ * @param coding
+ *
+ * @return PIXEL_FORMAT
+ */
+PIXEL_FORMAT GetPixelFormat(COLOR_CODING coding)
+{
+    switch (coding){
+    case COLOR_MONO8:   return VFMT_Y8;
+    case COLOR_YUV411:  return VFMT_YUV411;
+    case COLOR_YUV422:  return VFMT_YUV422;
+    case COLOR_YUV444:  return VFMT_YUV444;
+    case COLOR_RGB8:    return VFMT_RGB888;
+    case COLOR_MONO16:  return VFMT_Y16;
+    case COLOR_RAW8:    return VFMT_Y8;
+    case COLOR_RAW16:   return VFMT_Y16;
+    default:            return VFMT_NOT_SUPPORTED;
+    }
+}
+
+/**
+ * Returns bus speed required for the packet size.
+ *
+ * @param bytes_per_packet
+ *
+ * @return SPD
+ */
+SPD GetRequiredSpeed(int bytes_per_packet)
+{
+    if (bytes_per_packet <= 1024)
+	return SPD_100M;
+    if (bytes_per_packet <= 2048)
+	return SPD_200M;
+    if (bytes_per_packet <= 4096)
+	return SPD_400M;
+    if (bytes_per_packet <= 8192)
+	return SPD_800M;
+    return SPD_1600M;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,87 @@
+/**
+ * @file   1394cam_internal.h
+ * @brief  declarations shared among the implementation files of libcam1394
+ *
+ * This header is not installed.
+ */
+
+#if !defined(_1394cam_internal_h_included_)
+#define _1394cam_internal_h_included_
+
+#include <unistd.h>
+#include <pthread.h>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#define CHK_PARAM(exp) {if (!(exp)) LOG( "illegal param passed. " << __STRING(exp)); }
+#define EXCEPT_FOR_FORMAT_6_ONLY  {if (is_format6) return false;}
+
+#define Addr(name) (m_command_regs_base+OFFSET_##name)
+#define EQU(val,mask,pattern)  (0==(((val)&(mask))^(pattern)))
+
+#define ADDR_CONFIGURATION_ROM        (CSR_REGISTER_BASE + CSR_CONFIG_ROM)
+
+#define WAIT usleep(500)
+
+// string-tables for feature codes and feature states (see 1394cam.cc)
+extern const char *feature_table[];
+extern const char *featurestate_table[];
+
+// converts 16bit cycle time of BufferInfo::timestamp (3bit seconds,
+// 13bit cycle count) into the cycle count. It wraps every 8 seconds.
+#define CYCLE_TIME_WRAP (8*8000)
+static inline int
+cycle_time_to_count(unsigned int timestamp)
+{
+    return ((timestamp >> 13) & 0x7)*8000 + (timestamp & 0x1fff);
+}
+
+// cycles from the timestamp 'from' to the timestamp 'to'.
+static inline int
+cycle_time_diff(unsigned int to, unsigned int from)
+{
+    return (cycle_time_to_count(to) - cycle_time_to_count(from)
+	    + CYCLE_TIME_WRAP) % CYCLE_TIME_WRAP;
+}
+
+// recursive lock of a raw1394 handle (see 1394cam.cc)
+pthread_mutex_t* get_handle_lock(raw1394handle_t handle);
+
+// holds a lock while in the scope.
+class scoped_lock {
+    pthread_mutex_t *m_mutex;
+public:
+    scoped_lock(pthread_mutex_t *mutex) : m_mutex(mutex) {
+	pthread_mutex_lock(m_mutex);
+    }
+    ~scoped_lock() {
+	pthread_mutex_unlock(m_mutex);
+    }
+};
+
+// probes the node, and fills pNode if it is a camera (see 1394cam.cc)
+int  callback_1394Camera(raw1394handle_t handle, nodeid_t node_id,
+			 C1394CameraNode* pNode, raw1394_portinfo* portinfo,
+			 void* arg);
+
+// helpers for operations on several cameras (see 1394cam.cc)
+int  write_reg_all(CCameraList& list, nodeaddr_t offset, quadlet_t value,
+		   bool* result);
+void compute_start_skew(StartInfo* info, int n);
+void receive_first_frames(CCameraList& list, const bool* started,
+			  StartInfo* info, int timeout);
+
+// how long to wait for the first frame of each camera (in msec)
+const int FIRST_FRAME_TIMEOUT = 2000;
+
+// converts a frame by bands of packets in parallel (see 1394cam_convert.cc)
+void run_conversion(void (*func)(void* arg, int first, int count), void* arg,
+		    int num_packet, int unit);
+
+#endif // #if !defined(_1394cam_internal_h_included_)
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,335 @@
+/**
+ * @file    1394cam_onepush.cc
+ * @brief   one-push operations and waiting for their completion
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <libraw1394/raw1394.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+/**
+ * @class C1394OnePush 1394cam.h
+ *
+ * The One_Push bits of each camera are set by a batch of writes, and
+ * then watched by a thread with one block read per camera. The
+ * polling interval starts short, grows while nothing changes, and
+ * shrinks again whenever an operation completes.
+ *
+ * @code
+ *   C1394OnePush op;
+ *   for (cam=list.begin(); cam!=list.end(); cam++){
+ *       op.Add(&(*cam), WHITE_BALANCE);
+ *       op.Add(&(*cam), SHUTTER);
+ *   }
+ *   op.Start(5000);
+ *   if (op.Wait())
+ *       ERR("some cameras didn't converge.");
+ * @endcode
+ */
+
+enum {
+    MIN_INTERVAL = 10,   // msec
+    MAX_INTERVAL = 320,  // msec
+};
+
+#define FEATURE_BIT(feat) (((uint64_t)1) << (feat))
+
+C1394OnePush::C1394OnePush()
+    : m_timeout(10000), m_callback(NULL), m_arg(NULL), m_num_pending(0),
+      m_running(false), m_done(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+C1394OnePush::~C1394OnePush()
+{
+    Wait();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/**
+ * Adds a feature to push.
+ *
+ * @param camera
+ * @param feat
+ */
+void
+C1394OnePush::Add(C1394CameraNode* camera, C1394CAMERA_FEATURE feat)
+{
+    CHK_PARAM(camera!=NULL);
+    CHK_PARAM(BRIGHTNESS<=feat && feat<END_OF_FEATURE);
+    Wait();
+    for (size_t i=0; i<m_targets.size(); i++){
+	if (m_targets[i].camera == camera){
+	    m_targets[i].features |= FEATURE_BIT(feat);
+	    return;
+	}
+    }
+    Target t;
+    t.camera = camera;
+    t.features = FEATURE_BIT(feat);
+    t.pending = 0;
+    m_targets.push_back(t);
+}
+
+/**
+ * Removes all features. Waits for the running operations if any.
+ */
+void
+C1394OnePush::Clear()
+{
+    Wait();
+    m_targets.clear();
+}
+
+/**
+ * Starts the one-push operations.
+ *
+ * The features which don't have the one-push capability are
+ * ignored. When all operations have completed, or the timeout has
+ * expired, the callback is called from the thread.
+ *
+ * @param timeout   timeout in msec for all operations.
+ * @param callback  function called on completion, or NULL.
+ * @param arg       argument passed to the callback.
+ *
+ * @return Zero on success, or a negative value if an error occurred.
+ */
+int
+C1394OnePush::Start(int timeout, Callback callback, void* arg)
+{
+    Wait();
+
+    m_timeout = timeout;
+    m_callback = callback;
+    m_arg = arg;
+    m_done = false;
+    m_num_pending = 0;
+
+    for (size_t i=0; i<m_targets.size(); i++){
+	Target &t = m_targets[i];
+	C1394CameraNode *cam = t.camera;
+	t.pending = 0;
+
+	quadlet_t inq[END_OF_FEATURE];
+	quadlet_t ctl[END_OF_FEATURE];
+	nodeaddr_t addr[END_OF_FEATURE];
+	quadlet_t value[END_OF_FEATURE];
+	int count = 0;
+
+	cam->Lock();
+	if (!cam->ReadRegBlock(cam->m_command_regs_base + OFFSET_BRIGHTNESS_INQ,
+			       inq, END_OF_FEATURE) ||
+	    !cam->ReadRegBlock(cam->m_command_regs_base + OFFSET_BRIGHTNESS,
+			       ctl, END_OF_FEATURE)){
+	    cam->Unlock();
+	    ERR("can't read the features of camera " << hex << cam->GetID()
+		<< dec);
+	    continue;
+	}
+	for (int f=0; f<END_OF_FEATURE; f++){
+	    if (0 == (t.features & FEATURE_BIT(f)))
+		continue;
+	    if (0 == GetParam(BRIGHTNESS_INQ,Presence_Inq,inq[f]) ||
+		0 == GetParam(BRIGHTNESS_INQ,One_Push_Inq,inq[f])){
+		ERR("the feature " << feature_table[f]
+		    << " has no one-push capability.");
+		continue;
+	    }
+	    quadlet_t tmp = ctl[f];
+	    tmp |=  SetParam(BRIGHTNESS,Presence_Inq,1);
+	    tmp |=  SetParam(BRIGHTNESS,ON_OFF,1);
+	    tmp |=  SetParam(BRIGHTNESS,One_Push,1);
+	    tmp &= ~SetParam(BRIGHTNESS,A_M_Mode,1);
+	    addr[count] = cam->m_command_regs_base + OFFSET_BRIGHTNESS + 4*f;
+	    value[count] = tmp;
+	    count++;
+	    t.pending |= FEATURE_BIT(f);
+	}
+	if (!cam->WriteRegBatch(addr, value, count)){
+	    ERR("can't start one-push of camera " << hex << cam->GetID()
+		<< dec);
+	    t.pending = 0;
+	}
+	cam->Unlock();
+	if (t.pending)
+	    m_num_pending++;
+    }
+
+    int retval = pthread_create(&m_thread, NULL, thread_main, this);
+    if (0 != retval){
+	ERR("pthread_create() failed. " << strerror(retval));
+	return -retval;
+    }
+    m_running = true;
+    return 0;
+}
+
+/**
+ * Waits until all operations complete or time out.
+ *
+ * @return the number of the cameras whose operations haven't completed.
+ */
+int
+C1394OnePush::Wait()
+{
+    if (m_running){
+	pthread_join(m_thread, NULL);
+	m_running = false;
+    }
+    return m_num_pending;
+}
+
+/**
+ * Checks whether the operations have completed or timed out.
+ *
+ * @return True if done.
+ */
+bool
+C1394OnePush::IsDone()
+{
+    pthread_mutex_lock(&m_mutex);
+    bool done = m_done || !m_running;
+    pthread_mutex_unlock(&m_mutex);
+    return done;
+}
+
+/**
+ * Checks whether the operation of the feature is still running.
+ *
+ * @param camera
+ * @param feat
+ *
+ * @return True if the One_Push bit of the feature hasn't been cleared.
+ */
+bool
+C1394OnePush::IsPending(C1394CameraNode* camera, C1394CAMERA_FEATURE feat)
+{
+    bool pending = false;
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i=0; i<m_targets.size(); i++){
+	if (m_targets[i].camera == camera)
+	    pending = (0 != (m_targets[i].pending & FEATURE_BIT(feat)));
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return pending;
+}
+
+void*
+C1394OnePush::thread_main(void* arg)
+{
+    C1394OnePush *self = (C1394OnePush*)arg;
+    self->Poll();
+    return NULL;
+}
+
+static int
+elapsed_msec(const struct timeval& from)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - from.tv_sec)*1000 + (now.tv_usec - from.tv_usec)/1000;
+}
+
+void
+C1394OnePush::Poll()
+{
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    int interval = MIN_INTERVAL;
+    int num_pending = m_num_pending;
+    while (num_pending > 0){
+	int rest = m_timeout - elapsed_msec(start);
+	if (rest <= 0){
+	    WRN("one-push timed out; " << num_pending
+		<< " camera(s) haven't completed.");
+	    break;
+	}
+	usleep(1000 * (interval < rest ? interval : rest));
+
+	bool progress = false;
+	num_pending = 0;
+	for (size_t i=0; i<m_targets.size(); i++){
+	    if (0 == m_targets[i].pending)
+		continue;
+	    if (Update(&m_targets[i]))
+		progress = true;
+	    if (m_targets[i].pending)
+		num_pending++;
+	}
+	pthread_mutex_lock(&m_mutex);
+	m_num_pending = num_pending;
+	pthread_mutex_unlock(&m_mutex);
+
+	if (progress){
+	    interval = MIN_INTERVAL;
+	} else if (interval < MAX_INTERVAL){
+	    interval *= 2;
+	}
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_done = true;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (m_callback)
+	m_callback(this, m_arg);
+}
+
+/*
+ * reads the pending features with a block read.
+ *
+ * @return true if some operations have completed.
+ */
+bool
+C1394OnePush::Update(Target* t)
+{
+    int lo = 0;
+    while (0 == (t->pending & FEATURE_BIT(lo)))
+	lo++;
+    int hi = END_OF_FEATURE - 1;
+    while (0 == (t->pending & FEATURE_BIT(hi)))
+	hi--;
+
+    quadlet_t ctl[END_OF_FEATURE];
+    C1394CameraNode *cam = t->camera;
+    if (!cam->ReadRegBlock(cam->m_command_regs_base + OFFSET_BRIGHTNESS + 4*lo,
+			   ctl, hi - lo + 1))
+	return false;
+
+    uint64_t pending = t->pending;
+    for (int f=lo; f<=hi; f++){
+	if ((pending & FEATURE_BIT(f)) &&
+	    0 == GetParam(BRIGHTNESS,One_Push,ctl[f - lo])){
+	    DBG("one-push of " << feature_table[f] << " completed.");
+	    pending &= ~FEATURE_BIT(f);
+	}
+    }
+    if (pending == t->pending)
+	return false;
+
+    pthread_mutex_lock(&m_mutex);
+    t->pending = pending;
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,716 @@
+/**
+ * @file    1394cam_profile.cc
+ * @brief   camera profile, a declarative set of camera settings
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+/**
+ * @class C1394CameraProfile 1394cam.h
+ *
+ * A profile is saved as a plain text file, one setting per line.
+ * Lines beginning with '#' are ignored.
+ *
+ *   format 0
+ *   mode 3
+ *   rate 4
+ *   channel 1
+ *   speed 2
+ *   trigger_mode 0
+ *   memory_channel 1
+ *   brightness manual 0x80
+ *   shutter manual abs 0.0333
+ *   gain auto
+ *   white_balance one_push
+ */
+
+C1394CameraProfile::C1394CameraProfile()
+{
+    Clear();
+}
+
+/**
+ * Resets the profile to the "don't care" state.
+ */
+void
+C1394CameraProfile::Clear()
+{
+    m_format = Format_X;
+    m_mode   = Mode_X;
+    m_rate   = FrameRate_X;
+    m_channel = -1;
+    m_iso_speed = -1;
+    m_trigger_mode = -1;
+    m_memory_channel = -1;
+    for (int i=0; i<END_OF_FEATURE; i++){
+	m_feature[i].m_valid = false;
+	m_feature[i].m_state = OFF;
+	m_feature[i].m_value = 0;
+	m_feature[i].m_abs = false;
+	m_feature[i].m_abs_value = 0.f;
+    }
+}
+
+static int
+lookup_feature(const char *name)
+{
+    for (int i=0; i<END_OF_FEATURE; i++){
+	if (0==strcmp(feature_table[i], "reserved"))
+	    continue;
+	if (0==strcasecmp(feature_table[i], name))
+	    return i;
+    }
+    return -1;
+}
+
+static int
+lookup_feature_state(const char *name)
+{
+    for (int i=0; i<END_OF_FSTATE; i++){
+	if (0==strcasecmp(featurestate_table[i], name))
+	    return i;
+    }
+    return -1;
+}
+
+/**
+ * Loads the profile from the file.
+ *
+ * @param filename
+ *
+ * @return Zero on success, or -1 if an error occurred.
+ */
+int
+C1394CameraProfile::Load(const char* filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp){
+	ERR("can't open profile (" << filename << ") : " << strerror(errno));
+	return -1;
+    }
+
+    Clear();
+
+    int result = 0;
+    int line_no = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)){
+	line_no++;
+	char *hash = strchr(line, '#');
+	if (hash)
+	    *hash = '\0';
+
+	char key[64], arg0[64], arg1[64], arg2[64];
+	int n = sscanf(line, "%63s %63s %63s %63s", key, arg0, arg1, arg2);
+	if (n <= 0)
+	    continue;
+
+	if (n < 2){
+	    ERR(filename << "(" << line_no << "): missing value.");
+	    result = -1;
+	    continue;
+	}
+
+	char *end = NULL;
+	long val = strtol(arg0, &end, 0);
+	bool is_num = ('\0' == *end);
+
+	if (!strcasecmp(key, "format") && is_num){
+	    m_format = (FORMAT)val;
+	} else if (!strcasecmp(key, "mode") && is_num){
+	    m_mode = (VMODE)val;
+	} else if (!strcasecmp(key, "rate") && is_num){
+	    m_rate = (FRAMERATE)val;
+	} else if (!strcasecmp(key, "channel") && is_num){
+	    m_channel = val;
+	} else if (!strcasecmp(key, "speed") && is_num){
+	    m_iso_speed = val;
+	} else if (!strcasecmp(key, "trigger_mode") && is_num){
+	    m_trigger_mode = val;
+	} else if (!strcasecmp(key, "memory_channel") && is_num){
+	    m_memory_channel = val;
+	} else {
+	    int feat = lookup_feature(key);
+	    int state = lookup_feature_state(arg0);
+	    if (feat < 0 || state < 0){
+		ERR(filename << "(" << line_no << "): bad setting " << key);
+		result = -1;
+		continue;
+	    }
+	    Feature &f = m_feature[feat];
+	    f.m_valid = true;
+	    f.m_state = (C1394CAMERA_FSTATE)state;
+	    f.m_abs = false;
+	    if (MANUAL == f.m_state){
+		if (n >= 4 && !strcasecmp(arg1, "abs")){
+		    f.m_abs = true;
+		    f.m_abs_value = strtod(arg2, &end);
+		} else if (n >= 3){
+		    f.m_value = strtoul(arg1, &end, 0);
+		} else {
+		    end = arg0;
+		}
+		if ('\0' != *end){
+		    ERR(filename << "(" << line_no << "): bad value for "
+			<< key);
+		    f.m_valid = false;
+		    result = -1;
+		}
+	    }
+	}
+    }
+    fclose(fp);
+    return result;
+}
+
+/**
+ * Saves the profile to the file.
+ *
+ * @param filename
+ *
+ * @return Zero on success, or -1 if an error occurred.
+ */
+int
+C1394CameraProfile::Save(const char* filename) const
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp){
+	ERR("can't create profile (" << filename << ") : " << strerror(errno));
+	return -1;
+    }
+
+    fprintf(fp, "# libcam1394 camera profile\n");
+    if (Format_X != m_format)
+	fprintf(fp, "format %d\n", m_format);
+    if (Mode_X != m_mode)
+	fprintf(fp, "mode %d\n", m_mode);
+    if (FrameRate_X != m_rate)
+	fprintf(fp, "rate %d\n", m_rate);
+    if (0 <= m_channel)
+	fprintf(fp, "channel %d\n", m_channel);
+    if (0 <= m_iso_speed)
+	fprintf(fp, "speed %d\n", m_iso_speed);
+    if (0 <= m_trigger_mode)
+	fprintf(fp, "trigger_mode %d\n", m_trigger_mode);
+    if (0 <= m_memory_channel)
+	fprintf(fp, "memory_channel %d\n", m_memory_channel);
+
+    for (int i=0; i<END_OF_FEATURE; i++){
+	const Feature &f = m_feature[i];
+	if (!f.m_valid)
+	    continue;
+	fprintf(fp, "%s %s", feature_table[i], featurestate_table[f.m_state]);
+	if (MANUAL == f.m_state){
+	    if (f.m_abs)
+		fprintf(fp, " abs %.9g", f.m_abs_value);
+	    else
+		fprintf(fp, " 0x%x", f.m_value);
+	}
+	fprintf(fp, "\n");
+    }
+
+    int r = ferror(fp) ? -1 : 0;
+    if (0 != fclose(fp))
+	r = -1;
+    return r;
+}
+
+//--------------------------------------------------------------------------
+
+/**
+ * Retrieves the current settings of the camera as a profile.
+ *
+ * @param profile  pointer to store the settings.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::QueryProfile(C1394CameraProfile* profile)
+{
+    CHK_PARAM(profile!=NULL);
+    profile->Clear();
+
+    // Cur_V_Frm_Rate, Cur_V_Mode, Cur_V_Format, ISO_Channel/ISO_Speed
+    quadlet_t cur[4];
+    if (!ReadRegBlock(Addr(Cur_V_Frm_Rate), cur, 4))
+	return false;
+    profile->m_rate   = (FRAMERATE)GetParam(Cur_V_Frm_Rate,,cur[0]);
+    profile->m_mode   = (VMODE)GetParam(Cur_V_Mode,,cur[1]);
+    profile->m_format = (FORMAT)GetParam(Cur_V_Format,,cur[2]);
+    if (0==GetParam(Operation_Mode,,cur[3])){
+	profile->m_channel   = GetParam(ISO_Channel_L,,cur[3]);
+	profile->m_iso_speed = GetParam(ISO_Speed_L,,cur[3]);
+    } else {
+	profile->m_channel   = GetParam(ISO_Channel_B,,cur[3]);
+	profile->m_iso_speed = GetParam(ISO_Speed_B,,cur[3]);
+    }
+
+    quadlet_t inq[END_OF_FEATURE];
+    quadlet_t ctl[END_OF_FEATURE];
+    if (!ReadRegBlock(Addr(BRIGHTNESS_INQ), inq, END_OF_FEATURE) ||
+	!ReadRegBlock(Addr(BRIGHTNESS), ctl, END_OF_FEATURE))
+	return false;
+
+    for (int i=0; i<END_OF_FEATURE; i++){
+	if (0==GetParam(BRIGHTNESS_INQ,Presence_Inq,inq[i]))
+	    continue;
+
+	C1394CameraProfile::Feature &f = profile->m_feature[i];
+	bool on = (0!=GetParam(BRIGHTNESS,ON_OFF,ctl[i]));
+
+	if (TRIGGER == i){
+	    profile->m_trigger_mode = GetParam(TRIGGER_MODE,Trigger_Mode,ctl[i]);
+	    f.m_valid = true;
+	    f.m_state = on ? MANUAL : OFF;
+	    continue;
+	}
+
+	if (!on){
+	    f.m_state = OFF;
+	} else if (GetParam(BRIGHTNESS,A_M_Mode,ctl[i])){
+	    f.m_state = AUTO;
+	} else {
+	    // a running one-push operation is recorded as its result.
+	    f.m_state = MANUAL;
+	}
+	f.m_value = GetParam(BRIGHTNESS,Value,ctl[i]);
+	f.m_abs = (GetParam(BRIGHTNESS_INQ,Abs_Control_Inq,inq[i]) &&
+		   GetParam(BRIGHTNESS,Abs_Control,ctl[i]));
+	if (f.m_abs){
+	    quadlet_t off = 0;
+	    ReadReg(Addr(ABS_CSR_HI_INQ_0)+4*i, &off);
+	    ReadReg(CSR_REGISTER_BASE + off*4 + 0x0008,
+		    (quadlet_t*)&f.m_abs_value);
+	}
+	// the value can't be restored if the camera doesn't report it.
+	f.m_valid = !(MANUAL == f.m_state && !f.m_abs &&
+		      0==GetParam(BRIGHTNESS_INQ,ReadOut_Inq,inq[i]));
+    }
+    return true;
+}
+
+/*
+ * computes the control register value for the feature setting.
+ *
+ * @return true if the camera is capable of the setting.
+ */
+static bool
+make_feature_register(quadlet_t *target, quadlet_t cur, quadlet_t inq,
+		      const C1394CameraProfile::Feature &f)
+{
+    quadlet_t tmp = cur | SetParam(BRIGHTNESS,Presence_Inq,1);
+
+    switch (f.m_state){
+    case OFF:
+	if (0==GetParam(BRIGHTNESS_INQ,On_Off_Inq,inq))
+	    return false;
+	tmp &= ~SetParam(BRIGHTNESS,ON_OFF,1);
+	break;
+    case AUTO:
+	if (0==GetParam(BRIGHTNESS_INQ,Auto_Inq,inq))
+	    return false;
+	tmp |= SetParam(BRIGHTNESS,ON_OFF,1);
+	tmp |= SetParam(BRIGHTNESS,A_M_Mode,1);
+	break;
+    case MANUAL:
+	if (0==GetParam(BRIGHTNESS_INQ,Manual_Inq,inq))
+	    return false;
+	tmp |=  SetParam(BRIGHTNESS,ON_OFF,1);
+	tmp &= ~SetParam(BRIGHTNESS,A_M_Mode,1);
+	tmp &= ~SetParam(BRIGHTNESS,One_Push,1);
+	if (f.m_abs){
+	    if (0==GetParam(BRIGHTNESS_INQ,Abs_Control_Inq,inq))
+		return false;
+	    tmp |= SetParam(BRIGHTNESS,Abs_Control,1);
+	} else {
+	    unsigned int min = GetParam(BRIGHTNESS_INQ,MIN_Value,inq);
+	    unsigned int max = GetParam(BRIGHTNESS_INQ,MAX_Value,inq);
+	    // WHITE_BALANCE and TEMPERATURE hold two values in the field.
+	    unsigned int hi = GetParam(WHITE_BALANCE,U_Value,f.m_value);
+	    unsigned int lo = GetParam(WHITE_BALANCE,V_Value,f.m_value);
+	    if (hi && (hi < min || max < hi))
+		return false;
+	    if (lo < min || max < lo)
+		return false;
+	    tmp &= ~SetParam(BRIGHTNESS,Abs_Control,1);
+	    tmp &= ~SetParam(BRIGHTNESS,Value,0xffffff);
+	    tmp |=  SetParam(BRIGHTNESS,Value,f.m_value);
+	}
+	break;
+    case ONE_PUSH:
+	if (0==GetParam(BRIGHTNESS_INQ,One_Push_Inq,inq))
+	    return false;
+	tmp |=  SetParam(BRIGHTNESS,ON_OFF,1);
+	tmp |=  SetParam(BRIGHTNESS,One_Push,1);
+	tmp &= ~SetParam(BRIGHTNESS,A_M_Mode,1);
+	break;
+    default:
+	return false;
+    }
+    *target = tmp;
+    return true;
+}
+
+/*
+ * a list of register writes.
+ */
+struct reg_write_list {
+    enum { MAX_WRITES = END_OF_FEATURE+8 };
+    nodeaddr_t addr[MAX_WRITES];
+    quadlet_t  value[MAX_WRITES];
+    int        count;
+
+    reg_write_list():count(0){}
+    void add(nodeaddr_t a, quadlet_t v){
+	addr[count] = a;
+	value[count] = v;
+	count++;
+    }
+};
+
+/**
+ * Applies the profile to the camera.
+ *
+ * The current state of the camera is read with a few block reads,
+ * and only the registers which differ from the profile are written
+ * as a batch. Applying the same profile twice costs no write.
+ *
+ * If the profile has a memory channel and the camera differs from
+ * the profile, the channel is recalled, and the camera is compared
+ * again. When the channel holds the same settings as the profile,
+ * the recall is the only write; otherwise the differences left are
+ * corrected as usual.
+ *
+ * @note The video format should be changed while the camera stops
+ * isochronus transmission.
+ *
+ * @param profile  a C1394CameraProfile to apply.
+ *
+ * @return the number of written registers, or -1 if some settings
+ * could not be applied.
+ */
+int
+C1394CameraNode::ApplyProfile(const C1394CameraProfile& profile)
+{
+    scoped_lock lock(GetLock());
+    bool failed = false;
+    int num_write = 0;
+    bool recalled = false;
+    reg_write_list video;
+    reg_write_list feature;
+    reg_write_list abs_value;
+    int ch, spd;
+
+    // the camera is compared with the profile, and compared again after
+    // the memory channel is recalled, only if something differs.
+    for (;;){
+	failed = false;
+	video.count = feature.count = abs_value.count = 0;
+	int num_one_push = 0;
+
+	quadlet_t cur[4];
+	if (!ReadRegBlock(Addr(Cur_V_Frm_Rate), cur, 4))
+	    return -1;
+
+	// format, mode, frame rate, channel and speed.
+	FORMAT    cur_f = (FORMAT)GetParam(Cur_V_Format,,cur[2]);
+	VMODE     cur_m = (VMODE)GetParam(Cur_V_Mode,,cur[1]);
+	FRAMERATE cur_r = (FRAMERATE)GetParam(Cur_V_Frm_Rate,,cur[0]);
+	FORMAT    f = (Format_X    != profile.m_format)? profile.m_format: cur_f;
+	VMODE     m = (Mode_X      != profile.m_mode)  ? profile.m_mode  : cur_m;
+	FRAMERATE r = (FrameRate_X != profile.m_rate)  ? profile.m_rate  : cur_r;
+	if (f != cur_f || m != cur_m || r != cur_r){
+	    quadlet_t tmp;
+	    ReadReg(Addr(V_FORMAT_INQ), &tmp);
+	    bool ok = (0 != ((tmp >> (31-f))&0x1));
+	    if (ok){
+		ReadReg(Addr(V_MODE_INQ_0) + f*4, &tmp);
+		ok = (0 != ((tmp >> (31-m))&0x1));
+	    }
+	    if (ok && Format_7 != f){
+		ReadReg(Addr(V_RATE_INQ_0_0) + f*0x20 + m*4, &tmp);
+		ok = (0 != ((tmp >> (31-r))&0x1));
+	    }
+	    if (!ok){
+		ERR("your camera has no format_"<<f<<" mode_"<<m
+		    <<" framerate_"<<r<<" feature");
+		failed = true;
+		f = cur_f; m = cur_m; r = cur_r;
+	    }
+	    if (f != cur_f)
+		video.add(Addr(Cur_V_Format), SetParam(Cur_V_Format,,f));
+	    if (m != cur_m)
+		video.add(Addr(Cur_V_Mode), SetParam(Cur_V_Mode,,m));
+	    if (r != cur_r && Format_7 != f)
+		video.add(Addr(Cur_V_Frm_Rate), SetParam(Cur_V_Frm_Rate,,r));
+	}
+
+	const bool cur_b = (0 != GetParam(Operation_Mode,,cur[3]));
+	int cur_ch  = cur_b ? GetParam(ISO_Channel_B,,cur[3])
+			    : GetParam(ISO_Channel_L,,cur[3]);
+	int cur_spd = cur_b ? GetParam(ISO_Speed_B,,cur[3])
+			    : GetParam(ISO_Speed_L,,cur[3]);
+	ch  = (0 <= profile.m_channel)  ? profile.m_channel   : cur_ch;
+	spd = (0 <= profile.m_iso_speed)? profile.m_iso_speed : cur_spd;
+	if (0 <= f && f <= Format_2){
+	    SPD req_speed = GetRequiredSpeed(f, m, r);
+	    if (req_speed > spd)
+		spd = req_speed;
+	}
+	if (ch != cur_ch || spd != cur_spd){
+	    const bool need_1394b = (spd >= SPD_800M);
+	    quadlet_t tmp = cur[3];
+	    if (need_1394b){
+		quadlet_t inq;
+		ReadReg(Addr(BASIC_FUNC_INQ), &inq);
+		if (0==GetParam(BASIC_FUNC_INQ,1394b_mode_Capability,inq)){
+		    ERR("no 1394b mode capability");
+		    failed = true;
+		    spd = cur_spd;
+		}
+	    }
+	    if (!need_1394b || spd == cur_spd){
+		tmp &= ~SetParam(Operation_Mode,,1);
+		tmp &= ~SetParam(ISO_Channel_L,,0xfffff);
+		tmp &= ~SetParam(ISO_Speed_L,,0xfffff);
+		tmp |=  SetParam(ISO_Channel_L,,ch);
+		tmp |=  SetParam(ISO_Speed_L,,spd);
+	    } else {
+		tmp |=  SetParam(Operation_Mode,,1);
+		tmp &= ~SetParam(ISO_Channel_B,,0xfffff);
+		tmp &= ~SetParam(ISO_Speed_B,,0xfffff);
+		tmp |=  SetParam(ISO_Channel_B,,ch);
+		tmp |=  SetParam(ISO_Speed_B,,spd);
+	    }
+	    if (tmp != cur[3])
+		video.add(Addr(ISO_Channel_L), tmp);
+	}
+
+	// features
+	bool need_feature = (0 <= profile.m_trigger_mode);
+	for (int i=0; i<END_OF_FEATURE; i++)
+	    need_feature = need_feature || profile.m_feature[i].m_valid;
+
+	quadlet_t inq[END_OF_FEATURE];
+	quadlet_t ctl[END_OF_FEATURE];
+	if (need_feature &&
+	    (!ReadRegBlock(Addr(BRIGHTNESS_INQ), inq, END_OF_FEATURE) ||
+	     !ReadRegBlock(Addr(BRIGHTNESS), ctl, END_OF_FEATURE)))
+	    return -1;
+
+	for (int i=0; need_feature && i<END_OF_FEATURE; i++){
+	    const C1394CameraProfile::Feature &pf = profile.m_feature[i];
+	    const bool use_trigger_mode = (TRIGGER == i && 0 <= profile.m_trigger_mode);
+	    if (!pf.m_valid && !use_trigger_mode)
+		continue;
+	    if (0==GetParam(BRIGHTNESS_INQ,Presence_Inq,inq[i])){
+		ERR("the feature "<<feature_table[i]<<" is not available.");
+		failed = true;
+		continue;
+	    }
+
+	    quadlet_t tmp = ctl[i];
+	    if (TRIGGER == i){
+		tmp |= SetParam(TRIGGER_MODE,Presence_Inq,1);
+		if (pf.m_valid){
+		    if (OFF == pf.m_state)
+			tmp &= ~SetParam(TRIGGER_MODE,ON_OFF,1);
+		    else
+			tmp |=  SetParam(TRIGGER_MODE,ON_OFF,1);
+		}
+		if (use_trigger_mode){
+		    tmp &= ~SetParam(TRIGGER_MODE,Trigger_Mode,0xfffff);
+		    tmp |=  SetParam(TRIGGER_MODE,Trigger_Mode,profile.m_trigger_mode);
+		}
+	    } else if (!make_feature_register(&tmp, ctl[i], inq[i], pf)){
+		ERR("the feature "<<feature_table[i]<<" can't be set to "
+		    <<featurestate_table[pf.m_state]);
+		failed = true;
+		continue;
+	    }
+	    // writing One_Push starts the operation even if nothing differs.
+	    if (tmp != ctl[i] || ONE_PUSH == pf.m_state)
+		feature.add(Addr(BRIGHTNESS)+4*i, tmp);
+	    if (tmp == ctl[i] && ONE_PUSH == pf.m_state)
+		num_one_push++;
+
+	    if (MANUAL == pf.m_state && pf.m_abs){
+		quadlet_t off = 0;
+		quadlet_t val = 0;
+		ReadReg(Addr(ABS_CSR_HI_INQ_0)+4*i, &off);
+		nodeaddr_t addr = CSR_REGISTER_BASE + off*4 + 0x0008;
+		ReadReg(addr, &val);
+		quadlet_t target;
+		memcpy(&target, &pf.m_abs_value, sizeof(target));
+		if (target != val)
+		    abs_value.add(addr, target);
+	    }
+	}
+
+	int num_diff = video.count + feature.count + abs_value.count
+	    - num_one_push;
+	if (recalled){
+	    LOG("ApplyProfile: " << num_diff << " register(s) differ from "
+		"memory channel " << profile.m_memory_channel);
+	    break;
+	}
+	if (profile.m_memory_channel < 0 || 0 == num_diff)
+	    break;
+	if (!RecallMemoryChannel(profile.m_memory_channel)){
+	    WRN("memory channel " << profile.m_memory_channel
+		<< " is not recalled.");
+	    break;
+	}
+	num_write++;
+	recalled = true;
+    }
+    m_channel = ch;
+    m_iso_speed = spd;
+
+    // the absolute values must be written after Abs_Control is enabled.
+    if (!WriteRegBatch(video.addr, video.value, video.count) ||
+	!WriteRegBatch(feature.addr, feature.value, feature.count) ||
+	!WriteRegBatch(abs_value.addr, abs_value.value, abs_value.count))
+	return -1;
+    num_write += video.count + feature.count + abs_value.count;
+
+    LOG("ApplyProfile: " << num_write << " register(s) written");
+    return failed ? -1 : num_write;
+}
+
+//--------------------------------------------------------------------------
+
+/**
+ * Returns the number of the memory channels for user settings.
+ *
+ * Channel 0 holds the factory defaults and can be recalled only;
+ * channels 1..QueryMemoryChannelCount() can be saved and recalled.
+ *
+ * @return the number of user channels, zero if the camera has none.
+ */
+int
+C1394CameraNode::QueryMemoryChannelCount()
+{
+    quadlet_t inq = 0;
+    if (!ReadReg(Addr(BASIC_FUNC_INQ), &inq))
+	return 0;
+    return GetParam(BASIC_FUNC_INQ,Memory_Channel,inq);
+}
+
+/**
+ * Retrieves the memory channel recalled last.
+ *
+ * @note The current settings may have been changed since the recall.
+ *
+ * @param channel  pointer to store the channel.
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::QueryMemoryChannel(int* channel)
+{
+    CHK_PARAM(channel!=NULL);
+    quadlet_t tmp = 0;
+    if (!ReadReg(Addr(Cur_Mem_Ch), &tmp))
+	return false;
+    *channel = GetParam(Cur_Mem_Ch,,tmp);
+    return true;
+}
+
+/**
+ * Saves the current settings into a memory channel of the camera.
+ *
+ * @param channel  1..QueryMemoryChannelCount()
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::SaveMemoryChannel(int channel)
+{
+    scoped_lock lock(GetLock());
+    if (channel < 1 || QueryMemoryChannelCount() < channel){
+	ERR("memory channel " << channel << " is not available.");
+	return false;
+    }
+
+    quadlet_t tmp = SetParam(Mem_Save_Ch,,channel);
+    if (!WriteReg(Addr(Mem_Save_Ch), &tmp))
+	return false;
+    tmp = SetParam(Memory_Save,,1);
+    if (!WriteReg(Addr(Memory_Save), &tmp))
+	return false;
+
+    // Memory_Save is cleared by the camera when the save completes.
+    for (int i=0; i<2000; i++){
+	if (!ReadReg(Addr(Memory_Save), &tmp))
+	    return false;
+	if (0 == GetParam(Memory_Save,,tmp))
+	    return true;
+	WAIT;
+    }
+    ERR("timeout; saving memory channel " << channel);
+    return false;
+}
+
+/**
+ * Recalls the settings stored in a memory channel of the camera.
+ *
+ * @param channel  0 (factory defaults) or 1..QueryMemoryChannelCount()
+ *
+ * @return True on success.
+ */
+bool
+C1394CameraNode::RecallMemoryChannel(int channel)
+{
+    if (channel < 0 || QueryMemoryChannelCount() < channel){
+	ERR("memory channel " << channel << " is not available.");
+	return false;
+    }
+    quadlet_t tmp = SetParam(Cur_Mem_Ch,,channel);
+    return WriteReg(Addr(Cur_Mem_Ch), &tmp);
+}
+
+/**
+ * Recalls a memory channel of every camera.
+ *
+ * The write requests are pipelined, so switching the settings of
+ * many cameras costs about one transaction time.
+ *
+ * @param list     cameras.
+ * @param channel  the memory channel to recall.
+ * @param result   array of list.size() to store the result of each
+ *                 camera, or NULL.
+ *
+ * @return the number of cameras which accepted the recall.
+ */
+int
+RecallMemoryChannelAll(CCameraList& list, int channel, bool* result)
+{
+    if (channel < 0 || 15 < channel){
+	ERR("illegal param passed.");
+	return 0;
+    }
+    return write_reg_all(list, OFFSET_Cur_Mem_Ch,
+			 SetParam(Cur_Mem_Ch,,channel), result);
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
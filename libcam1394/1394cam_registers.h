@@ -280,10 +280,16 @@ BitInfo_ctrl_reg_for_feat(CAPTURE_QUALITY)
     BitInfo(IMAGE_SIZE,Width,0,15)
     BitInfo(IMAGE_SIZE,Height,16,31)
     BitInfo(COLOR_CODING_ID,Coding_ID,0,7)
-    BitInfo(VALUE_SETTING,Presence   ,0,1)
-    BitInfo(VALUE_SETTING,Setting_1  ,1,2)
-    BitInfo(VALUE_SETTING,ErrorFlag_1,8,9)
-    BitInfo(VALUE_SETTING,ErrorFlag_2,9,10)
+    BitInfo(PACKET_PARA_INQ,UnitBytePerPacket,0,15)
+    BitInfo(PACKET_PARA_INQ,MaxBytePerPacket,16,31)
+    BitInfo(BYTE_PER_PACKET,BytePerPacket,0,15)
+    BitInfo(BYTE_PER_PACKET,RecBytePerPacket,16,31)
+    BitInfo(UNIT_POSITION_INQ,Hposunit,0,15)
+    BitInfo(UNIT_POSITION_INQ,Vposunit,16,31)
+    BitInfo(VALUE_SETTING,Presence   ,0,0)
+    BitInfo(VALUE_SETTING,Setting_1  ,1,1)
+    BitInfo(VALUE_SETTING,ErrorFlag_1,8,8)
+    BitInfo(VALUE_SETTING,ErrorFlag_2,9,9)
     
 #undef BitInfo_ctrl_reg_for_feat
 #undef RegInfo
@@ -0,0 +1,689 @@
+/**
+ * @file    1394cam_registry.cc
+ * @brief   camera registry following bus resets, and opening by GUID
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+#if defined HAVE_JUJU
+#include <linux/firewire-cdev.h>
+#endif
+
+using namespace std;
+
+/**
+ * @class C1394CameraRegistry 1394cam.h
+ *
+ * The registry listens for the bus resets of every port with a
+ * dedicated raw1394 handle. After a bus reset, the GUID of each node
+ * is read from its bus info block, and only the nodes whose GUID is
+ * new are probed. The subscribers are notified of the cameras added,
+ * removed or moved to another node id.
+ *
+ * @code
+ *   static void changed(C1394CameraRegistry*, C1394CameraRegistry::EVENT ev,
+ *                       const C1394CameraNode& cam, void*)
+ *   {
+ *       if (C1394CameraRegistry::CAMERA_ADDED == ev)
+ *           restart_recorder(cam.GetID());
+ *   }
+ *
+ *   C1394CameraRegistry registry;
+ *   registry.Subscribe(changed, NULL);
+ *   registry.Start();
+ * @endcode
+ */
+
+// a port watched by the registry.
+struct C1394CameraRegistry::Port {
+    C1394CameraRegistry* registry;
+    int              port_no;
+    char             name[32];     // device name of the port
+    raw1394handle_t  monitor;      // receives bus reset events
+    C1394PortRef     ref;          // handle for probing the nodes
+    unsigned int     generation;
+    unsigned int     request;      // counts the requests of Update()
+    unsigned int     scanned;      // request done by the last Update()
+    int              retry;        // # of the remaining retries
+};
+
+struct C1394CameraRegistry::Event {
+    EVENT           event;
+    C1394CameraNode camera;
+};
+
+enum {
+    MAX_PORT        = 16,
+    MONITOR_TIMEOUT = 200,         // msec, also the interval of the retries
+    MAX_RETRY       = 10,
+};
+
+C1394CameraRegistry::C1394CameraRegistry()
+    : m_running(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    m_wakeup[0] = m_wakeup[1] = -1;
+}
+
+C1394CameraRegistry::~C1394CameraRegistry()
+{
+    Stop();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+int
+C1394CameraRegistry::bus_reset_handler(raw1394handle_t handle,
+				       unsigned int generation)
+{
+    Port *port = (Port*)raw1394_get_userdata(handle);
+    raw1394_update_generation(handle, generation);
+    port->generation = generation;
+    pthread_mutex_lock(&port->registry->m_mutex);
+    port->request++;
+    port->retry = MAX_RETRY;
+    pthread_mutex_unlock(&port->registry->m_mutex);
+    LOG("bus reset on port " << port->port_no
+	<< ", generation " << generation);
+    return 0;
+}
+
+/**
+ * Scans the bus, and starts to watch the bus resets.
+ *
+ * The cameras found on the bus are reported to the subscribers as
+ * CAMERA_ADDED before this function returns.
+ *
+ * @return Zero on success, or a negative value if an error occurred.
+ */
+int
+C1394CameraRegistry::Start()
+{
+    if (m_running)
+	return 0;
+
+    raw1394handle_t handle = raw1394_new_handle();
+    if (!handle){
+	ERR("couldn't get raw1394 handle. " << strerror(errno));
+	return -errno;
+    }
+    struct raw1394_portinfo portinfo[MAX_PORT];
+    int num_port = raw1394_get_port_info(handle, portinfo, MAX_PORT);
+    raw1394_destroy_handle(handle);
+    if (num_port < 0){
+	ERR("couldn't get card info. " << strerror(errno));
+	return -1;
+    }
+
+    for (int i=0; i<num_port; i++){
+	Port *port = new Port;
+	port->registry = this;
+	port->port_no = i;
+	memcpy(port->name, portinfo[i].name, sizeof(port->name));
+	port->monitor = raw1394_new_handle_on_port(i);
+	if (!port->monitor){
+	    ERR("couldn't open port " << i << ". " << strerror(errno));
+	    delete port;
+	    continue;
+	}
+	raw1394_set_userdata(port->monitor, port);
+	raw1394_set_bus_reset_handler(port->monitor, bus_reset_handler);
+	raw1394_busreset_notify(port->monitor, RAW1394_NOTIFY_ON);
+	port->ref.Attach(i);
+	port->generation = raw1394_get_generation(port->monitor);
+	port->request = 1;
+	port->scanned = 0;
+	port->retry = MAX_RETRY;
+	m_ports.push_back(port);
+    }
+
+    // the monitor thread retries the ports which can't be read now.
+    vector<Event> events;
+    for (size_t i=0; i<m_ports.size(); i++){
+	if (Update(m_ports[i], &events))
+	    m_ports[i]->scanned = m_ports[i]->request;
+    }
+    Notify(events);
+
+    if (0 != pipe(m_wakeup)){
+	ERR("pipe() failed. " << strerror(errno));
+	m_wakeup[0] = m_wakeup[1] = -1;
+	Stop();
+	return -1;
+    }
+    fcntl(m_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(m_wakeup[1], F_SETFL, O_NONBLOCK);
+
+    m_running = true;
+    int retval = pthread_create(&m_thread, NULL, thread_main, this);
+    if (0 != retval){
+	ERR("pthread_create() failed. " << strerror(retval));
+	m_running = false;
+	Stop();
+	return -retval;
+    }
+    return 0;
+}
+
+/**
+ * Stops watching the bus. The cameras are forgotten.
+ */
+void
+C1394CameraRegistry::Stop()
+{
+    pthread_mutex_lock(&m_mutex);
+    bool running = m_running;
+    m_running = false;
+    pthread_mutex_unlock(&m_mutex);
+    if (running)
+	pthread_join(m_thread, NULL);
+
+    for (size_t i=0; i<m_ports.size(); i++){
+	raw1394_destroy_handle(m_ports[i]->monitor);
+	delete m_ports[i];
+    }
+    m_ports.clear();
+    m_nodes.clear();
+    for (int i=0; i<2; i++){
+	if (0 <= m_wakeup[i])
+	    close(m_wakeup[i]);
+	m_wakeup[i] = -1;
+    }
+}
+
+/**
+ * Checks every port now, as if a bus reset had occurred.
+ *
+ * The ports are scanned by the monitor thread, which notifies the
+ * subscribers as for a bus reset; this function returns at once.
+ */
+void
+C1394CameraRegistry::Rescan()
+{
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i=0; i<m_ports.size(); i++){
+	m_ports[i]->request++;
+	m_ports[i]->retry = MAX_RETRY;
+    }
+    bool running = m_running;
+    pthread_mutex_unlock(&m_mutex);
+    if (running && 1 != write(m_wakeup[1], "", 1))
+	DBG("the monitor thread is already woken up.");
+}
+
+/**
+ * Registers a function to be notified of the changes.
+ *
+ * @param callback
+ * @param arg       argument passed to the callback.
+ */
+void
+C1394CameraRegistry::Subscribe(Callback callback, void* arg)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_subscribers.push_back(make_pair(callback, arg));
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Unregisters a function registered by Subscribe().
+ *
+ * @param callback
+ * @param arg
+ */
+void
+C1394CameraRegistry::Unsubscribe(Callback callback, void* arg)
+{
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i=0; i<m_subscribers.size(); i++){
+	if (m_subscribers[i].first == callback &&
+	    m_subscribers[i].second == arg){
+	    m_subscribers.erase(m_subscribers.begin() + i);
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Retrieves the cameras currently on the bus.
+ *
+ * @param list  list to store the cameras.
+ *
+ * @return the number of the cameras.
+ */
+int
+C1394CameraRegistry::GetCameraList(CCameraList* list)
+{
+    CHK_PARAM(list!=NULL);
+    list->clear();
+    pthread_mutex_lock(&m_mutex);
+    map<uint64_t, Node>::iterator i;
+    for (i=m_nodes.begin(); i!=m_nodes.end(); i++){
+	if (i->second.is_camera)
+	    list->push_back(i->second.camera);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return list->size();
+}
+
+/**
+ * Finds a camera by its id.
+ *
+ * @param id      camera id, see C1394CameraNode::GetID().
+ * @param camera  pointer to store the camera.
+ *
+ * @return True if the camera is on the bus.
+ */
+bool
+C1394CameraRegistry::FindCamera(uint64_t id, C1394CameraNode* camera)
+{
+    bool found = false;
+    pthread_mutex_lock(&m_mutex);
+    map<uint64_t, Node>::iterator i;
+    for (i=m_nodes.begin(); i!=m_nodes.end(); i++){
+	if (i->second.is_camera && i->second.camera.GetID() == id){
+	    if (camera)
+		*camera = i->second.camera;
+	    found = true;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return found;
+}
+
+void*
+C1394CameraRegistry::thread_main(void* arg)
+{
+    C1394CameraRegistry *self = (C1394CameraRegistry*)arg;
+    self->Monitor();
+    return NULL;
+}
+
+void
+C1394CameraRegistry::Monitor()
+{
+    const int n = m_ports.size();
+    struct pollfd *fds = new struct pollfd[n+1];
+    for (int i=0; i<n; i++){
+	fds[i].fd = raw1394_get_fd(m_ports[i]->monitor);
+	fds[i].events = POLLIN;
+    }
+    // woken up by Rescan().
+    fds[n].fd = m_wakeup[0];
+    fds[n].events = POLLIN;
+
+    for (;;){
+	pthread_mutex_lock(&m_mutex);
+	bool running = m_running;
+	pthread_mutex_unlock(&m_mutex);
+	if (!running)
+	    break;
+
+	int retval = poll(fds, n+1, MONITOR_TIMEOUT);
+	if (retval < 0 && EINTR != errno){
+	    ERR("poll() failed. " << strerror(errno));
+	    break;
+	}
+	for (int i=0; i<n && retval>0; i++){
+	    if (fds[i].revents & POLLIN)
+		raw1394_loop_iterate(m_ports[i]->monitor);
+	}
+	if (retval > 0 && (fds[n].revents & POLLIN)){
+	    char buf[64];
+	    while (0 < read(m_wakeup[0], buf, sizeof(buf)))
+		;
+	}
+
+	// a request made while Update() runs is kept for the next turn.
+	vector<Event> events;
+	for (int i=0; i<n; i++){
+	    Port *port = m_ports[i];
+	    pthread_mutex_lock(&m_mutex);
+	    unsigned int request = port->request;
+	    pthread_mutex_unlock(&m_mutex);
+	    if (request == port->scanned)
+		continue;
+	    if (Update(port, &events)){
+		port->scanned = request;
+		continue;
+	    }
+	    pthread_mutex_lock(&m_mutex);
+	    bool give_up = (--port->retry <= 0);
+	    pthread_mutex_unlock(&m_mutex);
+	    if (give_up){
+		WRN("gave up scanning port " << port->port_no);
+		port->scanned = request;
+	    }
+	}
+	Notify(events);
+    }
+    delete[] fds;
+}
+
+/*
+ * reads GUID from the bus info block of the node.
+ */
+static bool
+read_guid(raw1394handle_t handle, nodeid_t node_id, uint64_t* guid)
+{
+    quadlet_t tmp[2];
+    nodeaddr_t addr = CSR_REGISTER_BASE + CSR_CONFIG_ROM + 0x0c;
+    if (0 > raw1394_read(handle, node_id, addr, 4, &tmp[0]) ||
+	0 > raw1394_read(handle, node_id, addr + 4, 4, &tmp[1]))
+	return false;
+    *guid = ((uint64_t)ntohl(tmp[0]) << 32) | ntohl(tmp[1]);
+    return true;
+}
+
+/*
+ * updates the nodes of the port.
+ *
+ * @return false if some nodes couldn't be read; the removed cameras
+ *         aren't detected then, and the port should be retried.
+ */
+bool
+C1394CameraRegistry::Update(Port* port, vector<Event>* events)
+{
+    raw1394handle_t handle = port->ref.GetHandle();
+    if (!handle)
+	return false;
+    scoped_lock lock(get_handle_lock(handle));
+    raw1394_update_generation(handle, port->generation);
+
+    struct raw1394_portinfo portinfo;
+    memset(&portinfo, 0, sizeof(portinfo));
+    memcpy(portinfo.name, port->name, sizeof(portinfo.name));
+    portinfo.nodes = raw1394_get_nodecount(handle);
+
+    bool complete = true;
+    map<uint64_t, nodeid_t> seen;
+    for (int i=0; i<portinfo.nodes; i++){
+	nodeid_t node_id = 0xffc0 | i;
+	uint64_t guid;
+	if (!read_guid(handle, node_id, &guid)){
+	    DBG("can't read GUID of node " << i);
+	    complete = false;
+	    continue;
+	}
+	seen[guid] = node_id;
+
+	pthread_mutex_lock(&m_mutex);
+	map<uint64_t, Node>::iterator known = m_nodes.find(guid);
+	bool is_known = (known != m_nodes.end());
+	if (is_known && known->second.is_camera &&
+	    known->second.camera.m_node_id != node_id){
+	    known->second.camera.m_node_id = node_id;
+	    Event ev = { CAMERA_MOVED, known->second.camera };
+	    events->push_back(ev);
+	}
+	pthread_mutex_unlock(&m_mutex);
+	if (is_known)
+	    continue;
+
+	// a new node, probes its unit directory.
+	Node node;
+	node.port_no = port->port_no;
+	node.is_camera = callback_1394Camera(handle, node_id, &node.camera,
+					     &portinfo, &port->ref);
+	pthread_mutex_lock(&m_mutex);
+	m_nodes[guid] = node;
+	pthread_mutex_unlock(&m_mutex);
+	if (node.is_camera){
+	    LOG("camera " << hex << node.camera.GetID() << dec
+		<< " added on port " << port->port_no);
+	    Event ev = { CAMERA_ADDED, node.camera };
+	    events->push_back(ev);
+	}
+    }
+
+    if (!complete)
+	return false;
+
+    pthread_mutex_lock(&m_mutex);
+    map<uint64_t, Node>::iterator i = m_nodes.begin();
+    while (i != m_nodes.end()){
+	if (i->second.port_no != port->port_no ||
+	    seen.find(i->first) != seen.end()){
+	    i++;
+	    continue;
+	}
+	if (i->second.is_camera){
+	    LOG("camera " << hex << i->second.camera.GetID() << dec
+		<< " removed from port " << port->port_no);
+	    Event ev = { CAMERA_REMOVED, i->second.camera };
+	    events->push_back(ev);
+	}
+	m_nodes.erase(i++);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+void
+C1394CameraRegistry::Notify(const vector<Event>& events)
+{
+    if (events.empty())
+	return;
+    pthread_mutex_lock(&m_mutex);
+    vector<pair<Callback, void*> > subscribers = m_subscribers;
+    pthread_mutex_unlock(&m_mutex);
+
+    for (size_t i=0; i<events.size(); i++){
+	for (size_t j=0; j<subscribers.size(); j++){
+	    subscribers[j].first(this, events[i].event, events[i].camera,
+				 subscribers[j].second);
+	}
+    }
+}
+
+//--------------------------------------------------------------------------
+
+#if defined HAVE_JUJU
+/*
+ * retrieves the card and the node id of a firewire device file.
+ */
+static bool
+get_juju_device_info(const char *devname, int *card, nodeid_t *node_id,
+		     uint64_t *guid)
+{
+    int fd = open(devname, O_RDONLY);
+    if (fd < 0)
+	return false;
+
+    struct fw_cdev_get_info get_info;
+    struct fw_cdev_event_bus_reset reset;
+    __u32 rom[5];
+    memset(&get_info, 0, sizeof(get_info));
+    memset(&reset, 0, sizeof(reset));
+    memset(rom, 0, sizeof(rom));
+    get_info.version = FW_CDEV_VERSION;
+    get_info.rom = (__u64)(unsigned long)rom;
+    get_info.rom_length = sizeof(rom);
+    get_info.bus_reset = (__u64)(unsigned long)&reset;
+    int retval = ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info);
+    close(fd);
+    if (retval < 0)
+	return false;
+
+    if (card)
+	*card = get_info.card;
+    if (node_id)
+	*node_id = reset.node_id;
+    if (guid)
+	*guid = ((uint64_t)rom[3] << 32) | rom[4];
+    return true;
+}
+
+/*
+ * finds the device file of the node by GUID. The sysfs attributes
+ * are used if available, so that no device is opened in vain.
+ */
+static bool
+find_juju_device(uint64_t guid, char *devname, size_t len)
+{
+    static const char *sysfs = "/sys/bus/firewire/devices";
+    DIR *dir = opendir(sysfs);
+    bool use_sysfs = (NULL != dir);
+    if (!dir)
+	dir = opendir("/dev");
+    if (!dir)
+	return false;
+
+    bool found = false;
+    struct dirent *ent;
+    while (!found && (ent = readdir(dir))){
+	// fw0, fw1, ...; units such as fw1.0 are skipped.
+	const char *name = ent->d_name;
+	if (0 != strncmp(name, "fw", 2) ||
+	    name[2] < '0' || '9' < name[2] || strchr(name, '.'))
+	    continue;
+
+	uint64_t node_guid = 0;
+	if (use_sysfs){
+	    char path[512];
+	    snprintf(path, sizeof(path), "%s/%s/guid", sysfs, name);
+	    FILE *fp = fopen(path, "r");
+	    if (!fp)
+		continue;
+	    char buf[32];
+	    if (fgets(buf, sizeof(buf), fp))
+		node_guid = strtoull(buf, NULL, 16);
+	    fclose(fp);
+	} else {
+	    char path[512];
+	    snprintf(path, sizeof(path), "/dev/%s", name);
+	    if (!get_juju_device_info(path, NULL, NULL, &node_guid))
+		continue;
+	}
+	if (node_guid == guid){
+	    snprintf(devname, len, "/dev/%s", name);
+	    found = true;
+	}
+    }
+    closedir(dir);
+    return found;
+}
+
+/*
+ * finds the port and the node id of the node by GUID.
+ */
+static bool
+find_node_by_juju(uint64_t guid,
+		  struct raw1394_portinfo *portinfo, int num_port,
+		  int *port_no, nodeid_t *node_id)
+{
+    char devname[512];
+    int card;
+    if (!find_juju_device(guid, devname, sizeof(devname)) ||
+	!get_juju_device_info(devname, &card, node_id, NULL))
+	return false;
+    LOG("GUID " << hex << guid << dec << " is " << devname);
+
+    // the ports are named after the device file of the local node.
+    for (int i=0; i<num_port; i++){
+	int port_card;
+	if (get_juju_device_info(portinfo[i].name, &port_card, NULL, NULL) &&
+	    port_card == card){
+	    *port_no = i;
+	    return true;
+	}
+    }
+    return false;
+}
+#endif // #if defined HAVE_JUJU
+
+/**
+ * Opens the camera by its GUID without scanning the bus.
+ *
+ * With the juju stack the node is looked up by sysfs or
+ * FW_CDEV_IOC_GET_INFO. Otherwise the GUID of each node is read from
+ * its bus info block. In both cases only the matched node is probed.
+ *
+ * @param guid    GUID (EUI-64) of the camera, which is usually the
+ *                same as C1394CameraNode::GetID().
+ * @param camera  pointer to store the camera.
+ *
+ * @return True if the camera is found.
+ */
+bool
+OpenCameraByGUID(uint64_t guid, C1394CameraNode* camera)
+{
+    CHK_PARAM(camera!=NULL);
+
+    raw1394handle_t handle = raw1394_new_handle();
+    if (!handle){
+	ERR("couldn't get raw1394 handle. " << strerror(errno));
+	return false;
+    }
+    struct raw1394_portinfo portinfo[MAX_PORT];
+    int num_port = raw1394_get_port_info(handle, portinfo, MAX_PORT);
+    raw1394_destroy_handle(handle);
+    if (num_port <= 0){
+	ERR("couldn't get card info. " << strerror(errno));
+	return false;
+    }
+
+    int port_no = -1;
+    nodeid_t node_id = 0;
+#if defined HAVE_JUJU
+    if (!find_node_by_juju(guid, portinfo, num_port, &port_no, &node_id))
+	port_no = -1;
+#endif
+
+    for (int i=0; i<num_port; i++){
+	if (0 <= port_no && i != port_no)
+	    continue;
+
+	C1394PortRef port;
+	port.Attach(i);
+	handle = port.GetHandle();
+	if (!handle)
+	    continue;
+	scoped_lock lock(get_handle_lock(handle));
+
+	if (0 <= port_no){
+	    if (callback_1394Camera(handle, node_id, camera,
+				    &portinfo[i], &port))
+		return true;
+	    // the node may have moved, try the bus info blocks.
+	    port_no = -1;
+	    i = -1;
+	    continue;
+	}
+
+	int nodes = raw1394_get_nodecount(handle);
+	for (int n=0; n<nodes; n++){
+	    uint64_t node_guid;
+	    if (read_guid(handle, 0xffc0 | n, &node_guid) && node_guid == guid)
+		return callback_1394Camera(handle, 0xffc0 | n, camera,
+					   &portinfo[i], &port);
+	}
+    }
+    ERR("camera " << hex << guid << dec << " is not found.");
+    return false;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,186 @@
+/**
+ * @file    1394cam_sched.cc
+ * @brief   software trigger of several cameras scheduled by the cycle timer
+ * @author  YOSHIMOTO Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <libraw1394/raw1394.h>
+#include <libraw1394/csr.h>
+
+#include "common.h"
+#include "1394cam_registers.h"
+#include "1394cam.h"
+#include "1394cam_internal.h"
+
+using namespace std;
+
+// the cycle timer wraps every 128 seconds.
+#define CYCLES_PER_SECOND  8000
+#define CYCLE_TIMER_WRAP   (128*CYCLES_PER_SECOND)
+
+/*
+ * the number of cycles (seconds*8000+cycle_count) of the cycle timer.
+ */
+static int
+cycle_timer_to_cycles(uint32_t cycle_timer)
+{
+    return ((cycle_timer >> 25) & 0x7f)*CYCLES_PER_SECOND
+	+ ((cycle_timer >> 12) & 0x1fff);
+}
+
+static uint64_t
+get_local_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/**
+ * Reads the cycle timer of the 1394 I/F and the local time.
+ *
+ * @param handle       handle of the 1394 I/F.
+ * @param cycle_timer  pointer to store the CYCLE_TIME register.
+ * @param local_time   pointer to store the local time (in usec since Epoch)
+ *                     at which the cycle timer was read.
+ *
+ * @return True on success.
+ */
+bool
+ReadCycleTimer(raw1394handle_t handle, uint32_t* cycle_timer,
+	       uint64_t* local_time)
+{
+    scoped_lock lock(get_handle_lock(handle));
+#if defined(HAVE_RAW1394_READ_CYCLE_TIMER)
+    if (0 == raw1394_read_cycle_timer(handle, cycle_timer, local_time))
+	return true;
+    DBG("raw1394_read_cycle_timer() failed. " << strerror(errno));
+#endif
+    // fall back to the CYCLE_TIME register of the local node.
+    uint64_t before = get_local_time();
+    quadlet_t tmp;
+    if (0 > raw1394_read(handle, raw1394_get_local_id(handle),
+			 CSR_REGISTER_BASE + CSR_CYCLE_TIME, 4, &tmp)){
+	ERR("can't read cycle timer. " << strerror(errno));
+	return false;
+    }
+    uint64_t after = get_local_time();
+    *cycle_timer = ntohl(tmp);
+    *local_time = before + (after - before)/2;
+    return true;
+}
+
+/**
+ * Fires OneShot or Multi_Shot on all cameras at the local time.
+ *
+ * The requests are prepared in advance. This function sleeps until
+ * shortly before the time, spins until the time and then issues the
+ * requests to all cameras as pipelined asynchronous writes, so the
+ * cameras receive them within a few bus cycles.
+ *
+ * If info is not NULL and the frame buffer of a camera has been
+ * allocated, this function waits for the first frame of the camera
+ * and reports its cycle time and the skew from the earliest camera.
+ * A camera whose frame does not arrive within FIRST_FRAME_TIMEOUT
+ * msec is reported as not received.
+ *
+ * @param list          cameras to trigger.
+ * @param local_time    time to fire in usec since Epoch.
+ *                      Zero means now.
+ * @param count_number  number of frames; one for One_Shot.
+ * @param info          array of list.size() StartInfo, or NULL.
+ *
+ * @return True if all cameras accepted the request.
+ */
+bool
+ShotAllAtTime(CCameraList& list, uint64_t local_time,
+	      unsigned int count_number, StartInfo* info)
+{
+    const int n = list.size();
+    if (n <= 0)
+	return true;
+
+    quadlet_t value;
+    if (count_number <= 1){
+	value = SetParam(One_Shot,,1);
+    } else {
+	value = SetParam(Multi_Shot,,1);
+	value|= SetParam(Count_Number,,count_number);
+    }
+
+    // the scheduler wakes up a bit early and spins until the time.
+    const uint64_t SPIN_USEC = 2000;
+    uint64_t now = get_local_time();
+    if (local_time > now + SPIN_USEC)
+	usleep(local_time - now - SPIN_USEC);
+    while ((now = get_local_time()) < local_time)
+	;
+    if (local_time && now - local_time > 125){
+	WRN("fired " << (now - local_time) << " usec late.");
+    }
+
+    bool *started = new bool[n];
+    int num_started = write_reg_all(list, OFFSET_One_Shot, value, started);
+    DBG("requests done in " << (get_local_time() - now) << " usec.");
+
+    if (info){
+	receive_first_frames(list, started, info, FIRST_FRAME_TIMEOUT);
+    }
+
+    delete[] started;
+    return num_started == n;
+}
+
+/**
+ * Fires OneShot or Multi_Shot on all cameras at the bus cycle.
+ *
+ * The cycle is converted to the local time with the cycle timer of
+ * the port of the first camera, then ShotAllAtTime() is called.
+ * A cycle in the past (or more than 64 seconds ahead) fires at once.
+ *
+ * @param list          cameras to trigger.
+ * @param cycle_timer   cycle to fire, in the format of the CYCLE_TIME
+ *                      register. The cycle offset is ignored.
+ * @param count_number  number of frames; one for One_Shot.
+ * @param info          array of list.size() StartInfo, or NULL.
+ *
+ * @return True if all cameras accepted the request.
+ */
+bool
+ShotAllAtCycle(CCameraList& list, uint32_t cycle_timer,
+	       unsigned int count_number, StartInfo* info)
+{
+    if (list.empty())
+	return true;
+
+    uint32_t cur_cycle;
+    uint64_t cur_time;
+    if (!ReadCycleTimer(list.front().GetHandle(), &cur_cycle, &cur_time))
+	return false;
+
+    int delta = (cycle_timer_to_cycles(cycle_timer)
+		 - cycle_timer_to_cycles(cur_cycle)
+		 + CYCLE_TIMER_WRAP) % CYCLE_TIMER_WRAP;
+    uint64_t local_time = 0;
+    if (delta < CYCLE_TIMER_WRAP/2){
+	// 125 usec per cycle, minus the time already passed in the cycle.
+	local_time = cur_time + delta*125ULL
+	    - (cur_cycle & 0xfff)*125ULL/3072;
+    } else {
+	WRN("the cycle has already passed.");
+    }
+    return ShotAllAtTime(list, local_time, count_number, info);
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
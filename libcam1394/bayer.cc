@@ -0,0 +1,404 @@
+/*!
+  @file  bayer.cc
+  @brief demosaic Bayer patterns of Y8/Y16 frames
+  @author  YOSHIMOTO,Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "yuv.h"
+#include "yuv_simd.h"
+
+using namespace std;
+
+/*
+ * Each output row is made from the rows around it, so the rows are
+ * read from the frame into a ring, padded by mirroring (row -1 is row
+ * 1, and so on). Mirroring keeps the colors of the pattern.
+ *
+ * The bilinear method averages the nearest pixels of each color. The
+ * edge-aware method interpolates G along the direction of smaller
+ * gradient (with a second order correction from the own color), and
+ * then R and B from the differences to G, which are smoother than the
+ * colors themselves.
+ *
+ * With BAYER_HALF, each 2x2 block is made into one pixel (G is the
+ * average of the two), so only two rows are read for each output row
+ * and nothing is interpolated.
+ */
+
+enum {
+    PAD       = 2,   // pixels padded on each side of a row
+    NUM_RAW   = 8,   // rows held in the ring; 7 are needed at a time
+    NUM_GREEN = 4,   // G rows held in the ring; 3 are needed at a time
+};
+
+static inline int
+avg(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+static inline UCHAR
+clamp(int v)
+{
+    return (v < 0) ? 0 : (255 < v) ? 255 : v;
+}
+
+/*
+ * the scalar versions of the kernels in yuv2rgb_simd.cc, from the
+ * pixel x. They give the same results.
+ */
+static void
+bilinear_row(UCHAR* own, UCHAR* g, UCHAR* other,
+	     const UCHAR* u, const UCHAR* c, const UCHAR* d,
+	     int x, int n, int gf)
+{
+    for (; x<n; x++){
+	int h = avg(c[x-1], c[x+1]);
+	int v = avg(u[x], d[x]);
+	if (0 == ((x + gf) & 1)){
+	    own[x]   = c[x];
+	    g[x]     = avg(h, v);
+	    other[x] = avg(avg(u[x-1], u[x+1]), avg(d[x-1], d[x+1]));
+	} else {
+	    own[x]   = h;
+	    g[x]     = c[x];
+	    other[x] = v;
+	}
+    }
+}
+
+static void
+green_row(UCHAR* g, const UCHAR* uu, const UCHAR* u, const UCHAR* c,
+	  const UCHAR* d, const UCHAR* dd, int x, int n, int gf)
+{
+    if ((x + gf) & 1){
+	g[x] = c[x];
+	x++;
+    }
+    for (; x<n; x+=2){
+	int lh = 2*c[x] - c[x-2] - c[x+2];
+	int lv = 2*c[x] - uu[x] - dd[x];
+	int gh = 2*(c[x-1] + c[x+1]) + lh;
+	int gv = 2*(u[x] + d[x]) + lv;
+	int dh = abs(c[x-1] - c[x+1]) + abs(lh);
+	int dv = abs(u[x] - d[x]) + abs(lv);
+	int s = (dh < dv) ? 2*gh : (dv < dh) ? 2*gv : gh + gv;
+	g[x] = clamp((s + 4) >> 3);
+	if (x+1 < n)
+	    g[x+1] = c[x+1];
+    }
+}
+
+static void
+chroma_row(UCHAR* own, UCHAR* other,
+	   const UCHAR* gu, const UCHAR* gc, const UCHAR* gd,
+	   const UCHAR* u, const UCHAR* c, const UCHAR* d,
+	   int x, int n, int gf)
+{
+    for (; x<n; x++){
+	if (0 == ((x + gf) & 1)){
+	    int s = (u[x-1] - gu[x-1]) + (u[x+1] - gu[x+1])
+		+ (d[x-1] - gd[x-1]) + (d[x+1] - gd[x+1]);
+	    own[x]   = c[x];
+	    other[x] = clamp(gc[x] + ((s + 2) >> 2));
+	} else {
+	    int h = (c[x-1] - gc[x-1]) + (c[x+1] - gc[x+1]);
+	    int v = (u[x] - gu[x]) + (d[x] - gd[x]);
+	    own[x]   = clamp(gc[x] + ((h + 1) >> 1));
+	    other[x] = clamp(gc[x] + ((v + 1) >> 1));
+	}
+    }
+}
+
+static void
+half_row(UCHAR* ct, UCHAR* g, UCHAR* cb, const UCHAR* t, const UCHAR* b,
+	 int x, int n, int gf)
+{
+    for (; x<n; x++){
+	const UCHAR *p = t + 2*x, *q = b + 2*x;
+	ct[x] = p[gf];
+	g[x]  = avg(p[1-gf], q[gf]);
+	cb[x] = q[1-gf];
+    }
+}
+
+/*
+ * fills the padding of a row by mirroring.
+ */
+static inline void
+mirror_row(UCHAR* row, int width)
+{
+    for (int i=1; i<=PAD; i++){
+	row[-i] = row[i];
+	row[width - 1 + i] = row[width - 1 - i];
+    }
+}
+
+/*
+ * demosaics the rows of a frame, one by one.
+ */
+class BayerRows {
+public:
+    BayerRows(const UCHAR* frame, int width, int height, int packet_sz,
+	      int flag, int pattern, const UCHAR* lut);
+
+    void Process(int y, UCHAR* r, UCHAR* g, UCHAR* b);
+
+private:
+    const UCHAR* Row8(int y, UCHAR* buf);
+    const UCHAR* Raw(int y);
+    const UCHAR* Green(int y);
+    int  Mirror(int y) const {
+	return (y < 0) ? -y : (m_height <= y) ? 2*(m_height - 1) - y : y;
+    }
+    // 1 if the row starts with G.
+    int  GreenFirst(int y) const { return (y + m_pattern) & 1; }
+    // true if the row has R and G.
+    bool RedRow(int y) const { return 0 == ((y + (m_pattern >> 1)) & 1); }
+
+    const UCHAR* m_frame;
+    int  m_width;
+    int  m_height;
+    int  m_packet_sz;
+    int  m_flag;
+    int  m_pattern;
+    const UCHAR* m_lut;     // window of Y16, or NULL
+    int  m_stride;
+
+    vector<UCHAR> m_raw;    // NUM_RAW padded rows
+    int  m_raw_row[NUM_RAW];
+    vector<UCHAR> m_green;  // NUM_GREEN padded rows
+    int  m_green_row[NUM_GREEN];
+    vector<UCHAR> m_tmp;
+    vector<UCHAR> m_half;   // top and bottom rows for BAYER_HALF
+};
+
+BayerRows::BayerRows(const UCHAR* frame, int width, int height,
+		     int packet_sz, int flag, int pattern, const UCHAR* lut)
+    : m_frame(frame), m_width(width), m_height(height),
+      m_packet_sz(packet_sz), m_flag(flag), m_pattern(pattern), m_lut(lut),
+      m_stride(width + 2*PAD),
+      m_raw(m_stride * NUM_RAW), m_green(m_stride * NUM_GREEN),
+      m_tmp(width * 2), m_half((flag & BAYER_HALF) ? width * 2 : 0)
+{
+    for (int i=0; i<NUM_RAW; i++)
+	m_raw_row[i] = -1;
+    for (int i=0; i<NUM_GREEN; i++)
+	m_green_row[i] = -1;
+}
+
+/*
+ * returns the row y of 8bit pixels. It may be stored into buf.
+ */
+const UCHAR*
+BayerRows::Row8(int y, UCHAR* buf)
+{
+    if (FMT_Y16 != (m_flag & FMT_MASK))
+	return get_frame_row(m_frame, y, m_width, m_packet_sz, m_flag, buf);
+
+    const UCHAR *src = get_frame_row(m_frame, y, m_width*2, m_packet_sz,
+				     m_flag, &m_tmp[0]);
+    conv_Y16to8(buf, src, m_width, m_flag, m_lut);
+    return buf;
+}
+
+/*
+ * returns the pixel 0 of the padded row y.
+ */
+const UCHAR*
+BayerRows::Raw(int y)
+{
+    y = Mirror(y);
+    int slot = y % NUM_RAW;
+    UCHAR *row = &m_raw[slot * m_stride] + PAD;
+    if (m_raw_row[slot] == y)
+	return row;
+
+    const UCHAR *src = Row8(y, row);
+    if (src != row)
+	memcpy(row, src, m_width);
+    mirror_row(row, m_width);
+    m_raw_row[slot] = y;
+    return row;
+}
+
+/*
+ * returns the pixel 0 of the padded row y of G, for the edge-aware
+ * method.
+ */
+const UCHAR*
+BayerRows::Green(int y)
+{
+    y = Mirror(y);
+    int slot = y % NUM_GREEN;
+    UCHAR *row = &m_green[slot * m_stride] + PAD;
+    if (m_green_row[slot] == y)
+	return row;
+
+    const UCHAR *uu = Raw(y-2), *u = Raw(y-1), *c = Raw(y);
+    const UCHAR *d = Raw(y+1), *dd = Raw(y+2);
+    int gf = GreenFirst(y);
+    int n = bayer_green_simd(row, uu, u, c, d, dd, m_width, gf);
+    green_row(row, uu, u, c, d, dd, n, m_width, gf);
+    mirror_row(row, m_width);
+    m_green_row[slot] = y;
+    return row;
+}
+
+/*
+ * demosaics the row y into planes of R, G and B. With BAYER_HALF, y
+ * is the row of the half size image.
+ */
+void
+BayerRows::Process(int y, UCHAR* r, UCHAR* g, UCHAR* b)
+{
+    // the top row of each block has the same colors as row 0.
+    int row = (m_flag & BAYER_HALF) ? 2*y : y;
+    UCHAR *own = r, *other = b;
+    if (!RedRow(row)){
+	own = b;
+	other = r;
+    }
+    int gf = GreenFirst(row);
+
+    if (m_flag & BAYER_HALF){
+	const UCHAR *t = Row8(row, &m_half[0]);
+	const UCHAR *d = Row8(row + 1, &m_half[m_width]);
+	int w = m_width / 2;
+	int n = bayer_half_simd(own, g, other, t, d, w, gf);
+	half_row(own, g, other, t, d, n, w, gf);
+	return;
+    }
+
+    if (m_flag & BAYER_EDGE){
+	const UCHAR *gu = Green(y-1), *gc = Green(y), *gd = Green(y+1);
+	const UCHAR *u = Raw(y-1), *c = Raw(y), *d = Raw(y+1);
+	int n = bayer_chroma_simd(own, other, gu, gc, gd, u, c, d,
+				  m_width, gf);
+	chroma_row(own, other, gu, gc, gd, u, c, d, n, m_width, gf);
+	memcpy(g, gc, m_width);
+    } else {
+	const UCHAR *u = Raw(y-1), *c = Raw(y), *d = Raw(y+1);
+	int n = bayer_bilinear_simd(own, g, other, u, c, d, m_width, gf);
+	bilinear_row(own, g, other, u, c, d, n, m_width, gf);
+    }
+}
+
+/*
+ * checks the parameters, and returns the size of the output image.
+ */
+static bool
+check_bayer(int width, int height, int flag, int pattern,
+	    int* out_w, int* first_row, int* num_rows)
+{
+    int fmt = flag & FMT_MASK;
+    if (FMT_Y8 != fmt && FMT_Y16 != fmt)
+	return false;
+    if (width < 2*PAD || height < 2*PAD || pattern < 0 || 3 < pattern)
+	return false;
+
+    int out_h = height;
+    *out_w = width;
+    if (flag & BAYER_HALF){
+	out_h = height / 2;
+	*out_w = width / 2;
+    }
+    if (*first_row < 0 || out_h < *first_row)
+	return false;
+    if (*num_rows < 0 || *first_row + *num_rows > out_h)
+	*num_rows = out_h - *first_row;
+    return true;
+}
+
+/*
+ * demosaic a Bayer pattern of Y8/Y16 to BGR.
+ *
+ * @param dst        pointer to destination image data.
+ * @param step       the size of each row of dst in bytes.
+ * @param frame      pointer to source image data.
+ * @param width      the width of the frame.
+ * @param height     the height of the frame, 4 or more.
+ * @param packet_sz  the size of each packet.
+ * @param flag       FMT_Y8 or FMT_Y16 | REMOVE_HEADER |
+ *                   BAYER_EDGE or BAYER_HALF | Y16_DEPTH()
+ * @param pattern    BAYER_RGGB, BAYER_GRBG, BAYER_BGGR or BAYER_GBRG.
+ * @param lut        LUT of Y16 made by CreateY16WindowMap(), or NULL.
+ * @param first_row  the first row to store.
+ * @param num_rows   the number of rows to store, or -1 for all.
+ *
+ * With BAYER_HALF, dst is width/2 x height/2, and first_row and
+ * num_rows count its rows.
+ */
+bool
+copy_BayertoBGR(UCHAR* dst, int step, const void* frame,
+		int width, int height, int packet_sz, int flag, int pattern,
+		const UCHAR* lut, int first_row, int num_rows)
+{
+    int out_w;
+    if (!check_bayer(width, height, flag, pattern, &out_w,
+		     &first_row, &num_rows))
+	return false;
+
+    BayerRows rows((const UCHAR*)frame, width, height, packet_sz, flag,
+		   pattern, lut);
+    vector<UCHAR> plane(out_w * 3);
+    UCHAR *r = &plane[0], *g = r + out_w, *b = g + out_w;
+    for (int y=first_row; y<first_row+num_rows; y++){
+	rows.Process(y, r, g, b);
+	UCHAR *p = dst + (size_t)y * step;
+	int x = conv_planar_toBGR_simd(p, r, g, b, out_w);
+	for (p+=x*3; x<out_w; x++){
+	    *p++ = b[x];
+	    *p++ = g[x];
+	    *p++ = r[x];
+	}
+    }
+    return true;
+}
+
+/*
+ * demosaic a Bayer pattern of Y8/Y16 to RGBA.
+ *
+ * The alpha components are left as they are.
+ *
+ * @sa copy_BayertoBGR()
+ */
+bool
+copy_BayertoRGBA(RGBA* dst, const void* frame,
+		 int width, int height, int packet_sz, int flag, int pattern,
+		 const UCHAR* lut, int first_row, int num_rows)
+{
+    int out_w;
+    if (!check_bayer(width, height, flag, pattern, &out_w,
+		     &first_row, &num_rows))
+	return false;
+
+    BayerRows rows((const UCHAR*)frame, width, height, packet_sz, flag,
+		   pattern, lut);
+    vector<UCHAR> plane(out_w * 3);
+    UCHAR *r = &plane[0], *g = r + out_w, *b = g + out_w;
+    for (int y=first_row; y<first_row+num_rows; y++){
+	rows.Process(y, r, g, b);
+	RGBA *p = dst + (size_t)y * out_w;
+	int x = conv_planar_toRGBA_simd(p, r, g, b, out_w);
+	for (p+=x; x<out_w; x++, p++){
+	    p->r = r[x];
+	    p->g = g[x];
+	    p->b = b[x];
+	}
+    }
+    return true;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -68,6 +68,10 @@ struct drv_juju_data {
      int sz_packet;
      int num_packet;
      int buffer_size;               // sz_packet*num_packet
+     int slot_size;                 // stride of the frames in mmaped[]
+     int max_packet;                // # of entries of packets[]
+     int num_queued;                // # of frames queued to the kernel
+     int num_stale;                 // # of frames queued with an old layout
 
      int num_frame;
 
@@ -121,7 +125,7 @@ queue_dma_desc(drv_juju_data *d, int index)
      fw_cdev_iso_packet *pkt = d->packets;
      memset(&q, 0, sizeof(q));
      q.packets = ptr_to_u64(pkt);
-     q.data = ptr_to_u64(d->mmaped + d->buffer_size*index);
+     q.data = ptr_to_u64(d->mmaped + d->slot_size*index);
      q.size = d->num_packet * sizeof( pkt[0] );
      q.handle = d->isorxhandle;
 
@@ -134,6 +138,7 @@ queue_dma_desc(drv_juju_data *d, int index)
 	  ERR("FW_CDEV_IOC_QUEUE_ISO is not completed.");
 	  goto err;
      }
+     d->num_queued++;
      return 0;
 err:
      return -1;
@@ -166,11 +171,12 @@ drv_juju_close(libcam1394_driver *ctx)
      drv_juju_data *d = GETDATA(ctx);
 
      if (d->mmaped) {
-	  munmap(d->mmaped, d->buffer_size * d->num_frame);
+	  munmap(d->mmaped, d->slot_size * d->num_frame);
 	  d->mmaped = NULL;
      }
 
      if (d->packets) {
+	  free(d->packets);
 	  d->packets = NULL;
      }
  
@@ -253,6 +259,10 @@ drv_juju_mmap(libcam1394_driver *ctx,
      d->sz_packet = sz_packet;
      d->num_packet = num_packet;
      d->buffer_size = sz_packet * num_packet;
+     d->slot_size = d->buffer_size;
+     d->max_packet = num_frame * num_packet;
+     d->num_queued = 0;
+     d->num_stale = 0;
      d->num_frame = num_frame;
      d->index = 0;
      d->total_frame = 0;
@@ -261,7 +271,7 @@ drv_juju_mmap(libcam1394_driver *ctx,
      LOG("header size: " << get_header_size(d) );
      LOG("buffer size: " << d->buffer_size);
 
-     d->mmaped = (char*)mmap(NULL, d->buffer_size * d->num_frame, 
+     d->mmaped = (char*)mmap(NULL, d->slot_size * d->num_frame, 
 			     PROT_READ, MAP_SHARED, 
 			     d->fd, 0);
      if (MAP_FAILED == d->mmaped) {
@@ -302,11 +312,16 @@ enum FETCH_STATUS {
      FS_SUCCESS,
      FS_FAILED,
      FS_TIMEOUT,
+     FS_STALE,                      // a frame of the old layout was dropped
 };
 
+/*
+ * Fetches the next frame. The frame fetched before is queued again
+ * unless requeue is false.
+ */
 static FETCH_STATUS
 drv_juju_fetch_next(drv_juju_data *d, int timeout, 
-		    BufferInfo *info, void **frame)
+		    BufferInfo *info, void **frame, bool requeue=true)
 {
      int retval;
      int len;
@@ -338,14 +353,24 @@ drv_juju_fetch_next(drv_juju_data *d, int timeout,
      } else {
 	  int prev = (d->index + d->num_frame - 1) % d->num_frame;
 
-	  *frame = d->mmaped + d->buffer_size*d->index;
+	  d->num_queued--;
+	  if (requeue) {
+	       retval = queue_dma_desc(d, prev);
+	       if (retval < 0) {
+		    ERR("queue_dma_desc() failed.");
+		    return FS_FAILED;
+	       }
+	  }
 
-	  retval = queue_dma_desc(d, prev);
-	  if (retval < 0) {
-	       ERR("queue_dma_desc() failed.");
-	       return FS_FAILED;
+	  if (d->num_stale > 0) {
+	       // received before drv_juju_requeue() changed the layout
+	       d->num_stale--;
+	       d->index = (d->index + 1)%d->num_frame;
+	       return FS_STALE;
 	  }
 
+	  *frame = d->mmaped + d->slot_size*d->index;
+
 	  d->index = (d->index + 1)%d->num_frame;
 	  d->total_frame++;
 
@@ -372,10 +397,13 @@ drv_juju_updateFrameBuffer(libcam1394_driver *ctx,
      // Waits for a new frame
      if (C1394CameraNode::AS_FIFO == opt  ||
 	 C1394CameraNode::WAIT_NEW_FRAME == opt) {
-	  FETCH_STATUS fs = drv_juju_fetch_next(d, -1, 
-						info, &frame);
+	  FETCH_STATUS fs;
+	  do {
+	       fs = drv_juju_fetch_next(d, -1, info, &frame);
+	  } while (FS_STALE == fs);
 	  switch (fs) {
 	  case FS_SUCCESS:
+	  case FS_STALE:
 	       break;
 	  case FS_FAILED:
 	       LOG("drv_juju_fetch_next() failed");
@@ -392,10 +420,11 @@ drv_juju_updateFrameBuffer(libcam1394_driver *ctx,
 	  FETCH_STATUS fs;
 	  do {
 	       fs = drv_juju_fetch_next(d, 0, info, &frame);
-	  } while (FS_SUCCESS == fs);
+	  } while (FS_SUCCESS == fs || FS_STALE == fs);
 
 	  switch (fs) {
 	  case FS_SUCCESS:
+	  case FS_STALE:
 	       assert(0);
 	       break;
 	  case FS_FAILED:
@@ -412,6 +441,114 @@ err:
      return NULL;
 }
 
+static int
+drv_juju_waitFrame(libcam1394_driver *ctx, int timeout)
+{
+     CHECK_CTX(ctx);
+     drv_juju_data *d = GETDATA(ctx);
+
+     struct pollfd fds[1];
+     fds[0].fd = d->fd;
+     fds[0].events = POLLIN;
+
+     for (;;) {
+	  int retval = poll(fds, sizeof(fds)/sizeof(fds[0]), timeout);
+	  if (retval < 0) {
+	       ERR("poll() failed.");
+	       return -1;
+	  }
+	  if (0 == retval || 0 == d->num_stale)
+	       return (retval > 0) ? 1 : 0;
+
+	  // consumes a stale frame, then waits for the next one.
+	  void *frame = NULL;
+	  if (FS_STALE != drv_juju_fetch_next(d, 0, NULL, &frame))
+	       return (NULL != frame) ? 1 : 0;
+     }
+}
+
+/*
+ * Reuses the iso context and the mmaped buffer for a new packet
+ * layout. The iso context can't be recreated without reopening the
+ * device, so the channel must be the same, and the new frame must fit
+ * into a slot of the mmaped buffer.
+ *
+ * The descriptors already queued to the kernel can't be taken back,
+ * thus if the layout has changed, the frames received into them are
+ * dropped by drv_juju_fetch_next(). The completed frames are not
+ * queued again until the new layout is set, so only the frames still
+ * pending at FW_CDEV_IOC_STOP_ISO are dropped.
+ */
+static int
+drv_juju_requeue(libcam1394_driver *ctx,
+		 int channel,
+		 int sz_packet, int num_packet,
+		 int *header_size)
+{
+     CHECK_CTX(ctx);
+     drv_juju_data *d = GETDATA(ctx);
+     int retval;
+
+     if (d->fd < 0 || !d->mmaped)
+	  return -1;
+     if (channel != d->channel ||
+	 num_packet > d->max_packet ||
+	 sz_packet * num_packet > d->slot_size) {
+	  LOG("can't reuse the iso context.");
+	  return -1;
+     }
+
+     struct fw_cdev_stop_iso stop_iso;
+     memset(&stop_iso, 0, sizeof(stop_iso));
+     stop_iso.handle = d->isorxhandle;
+     retval = ioctl(d->fd, FW_CDEV_IOC_STOP_ISO, &stop_iso);
+     if (retval < 0) {
+	  ERR("FW_CDEV_IOC_STOP_ISO failed");
+	  return -1;
+     }
+
+     // drains the completed frames without queueing them again.
+     void *frame;
+     FETCH_STATUS fs;
+     do {
+	  fs = drv_juju_fetch_next(d, 0, NULL, &frame, false);
+     } while (FS_SUCCESS == fs || FS_STALE == fs);
+     if (FS_FAILED == fs)
+	  return -1;
+
+     if (sz_packet != d->sz_packet || num_packet != d->num_packet) {
+	  d->sz_packet = sz_packet;
+	  d->num_packet = num_packet;
+	  d->buffer_size = sz_packet * num_packet;
+	  setup_dma_desc(d, 0);
+	  // the pending frames have been queued with the old layout.
+	  d->num_stale = d->num_queued;
+     }
+
+     // queues the free slots behind the pending ones. The slot before
+     // d->index is held, and is queued by the next fetch.
+     int num_free = d->num_frame - 1 - d->num_queued;
+     int next = (d->index + d->num_queued) % d->num_frame;
+     for (int i=0; i<num_free; ++i) {
+	  retval = queue_dma_desc(d, (next + i) % d->num_frame);
+	  if (retval < 0) {
+	       ERR("queue_dma_desc() failed.");
+	       return -1;
+	  }
+     }
+     LOG("requeue: buffer size: " << d->buffer_size
+	 << ", stale frames: " << d->num_stale);
+
+     retval = start_dma_desc(d);
+     if (retval < 0) {
+	  ERR("start_dma() failed");
+	  return -1;
+     }
+
+     *header_size = 0;
+     return 0;
+}
+
 static int 
 drv_juju_getFrameCount(libcam1394_driver *ctx,
 		       int *counter)
@@ -455,6 +592,8 @@ drv_juju_new()
      drv->getFrameCount = drv_juju_getFrameCount;
      drv->setFrameCount = drv_juju_setFrameCount;
      drv->updateFrameBuffer = drv_juju_updateFrameBuffer;
+     drv->waitFrame = drv_juju_waitFrame;
+     drv->requeue = drv_juju_requeue;
 
      return drv;
 #else
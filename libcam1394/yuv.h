@@ -32,6 +32,92 @@ enum {
     FMT_YUV411       = 0x001,
     FMT_YUV422       = 0x002,
     FMT_YUV444       = 0x003,
+    FMT_RGB888       = 0x004,
+    FMT_Y8           = 0x005,
+    FMT_Y16          = 0x006,
+    FMT_MASK         = 0x0ff,
+    SCALE_BOX        = 0x200,  //!< average the pixels when downscaling.
+    BAYER_EDGE       = 0x400,  //!< edge-aware demosaicing.
+    BAYER_HALF       = 0x800,  //!< a pixel per 2x2 block, at half size.
+    Y16_DEPTH_MASK   = 0xf000, //!< \sa Y16_DEPTH()
+};
+
+/*
+ * The effective bit depth of Y16 pixels, e.g. Y16_DEPTH(12) for 12bit
+ * sensors which store the pixels in the lower bits. The upper 8 bits
+ * of the depth are taken when converting to 8bit. The default is 16.
+ */
+#define Y16_DEPTH(bits)  ((16 - (bits)) << 12)
+#define Y16_SHIFT(flag)  (8 - (((flag) & Y16_DEPTH_MASK) >> 12))
+
+//! Bayer patterns, named after the top left 2x2 pixels.
+enum {
+    BAYER_RGGB       = 0,      //!< R G / G B, CV_BayerBG in OpenCV.
+    BAYER_GRBG       = 1,      //!< G R / B G, CV_BayerGB in OpenCV.
+    BAYER_BGGR       = 2,      //!< B G / G R, CV_BayerRG in OpenCV.
+    BAYER_GBRG       = 3,      //!< G B / R G, CV_BayerGR in OpenCV.
+};
+
+//! destination layouts of the conversions. \sa get_conversion_table()
+enum {
+    CONV_RGBA        = 0,      //!< RGBA; the alpha components are kept.
+    CONV_BGR         = 1,      //!< b,g,r, as IplImage of 3 channels.
+    CONV_GRAY        = 2,      //!< Y of YUV, or the mean of r,g,b.
+    CONV_Y16         = 3,      //!< 16bit of the host byte order, Y16 only.
+    NUM_CONV         = 4,
+};
+
+/*
+ * converts the pixels which begin in num_packet packets from
+ * first_packet, to a contiguous buffer. dst and src point to the first
+ * pixel and packet of the frame; the payloads of the packets are one
+ * stream, so a pixel may span two packets. No pixel at or after
+ * num_pixel is read or written. The other parameters are the same as
+ * the copy_*() functions.
+ */
+typedef void (*CONVERSION)(void* dst, const void* src,
+			   int sz_packet, int first_packet, int num_packet,
+			   int num_pixel, int flag, const UCHAR* lut);
+
+//! the conversions of a source format. \sa get_conversion_table()
+struct ConversionTable {
+    CONVERSION to[NUM_CONV];   //!< by CONV_*, or NULL if not supported.
+};
+
+//! a destination image of any stride. \sa copy_toImage()
+struct ImageDesc {
+    UCHAR* data;    //!< the top left pixel.
+    int    step;    //!< the size of each row in bytes.
+    int    width;   //!< the width in pixels.
+    int    height;  //!< the height in pixels.
+};
+
+//! a rectangle of a frame. \sa copy_toImageROI()
+struct FrameRect {
+    int x;          //!< the left.
+    int y;          //!< the top.
+    int width;      //!< the width in pixels.
+    int height;     //!< the height in pixels.
+};
+
+//! the map from the pixels of a frame to its packets.
+struct PacketMap;
+
+//! layouts of planar YUV. \sa copy_toPlanarYUV()
+enum {
+    PLANAR_I420      = 0,      //!< Y, U and V; U,V at half width and height.
+    PLANAR_NV12      = 1,      //!< Y and interleaved UV at half height.
+    PLANAR_YV16      = 2,      //!< Y, V and U; V,U at half width.
+};
+
+//! the planes of planar YUV. \sa SetupPlanarYUV()
+struct PlanarYUV {
+    UCHAR* y;       //!< Y plane.
+    UCHAR* u;       //!< U plane, or the UV plane of PLANAR_NV12.
+    UCHAR* v;       //!< V plane, unused by PLANAR_NV12.
+    int    y_step;  //!< the size of each row of the Y plane in bytes.
+    int    u_step;  //!< the size of each row of the U (UV) plane.
+    int    v_step;  //!< the size of each row of the V plane.
 };
 
 bool copy_YUV411toRGBA(RGBA* lpRGBA, const void* lpYUV411,
@@ -45,10 +131,30 @@ bool copy_RGB888toRGBA(RGBA* lpRGBA, const void* lpRGB888,
 bool copy_Y8toRGBA(RGBA* lpRGBA, const void* lpYUV8,
 		   int sz_packet, int num_packet, int flag);
 bool copy_Y16toRGBA(RGBA* lpRGBA, const void* lpYUV16,
-		    int sz_packet, int num_packet, int flag);
+		    int sz_packet, int num_packet, int flag,
+		    const UCHAR* lut=0);
+bool copy_Y16toY16(unsigned short* dst, const void* lpY16,
+		   int sz_packet, int num_packet, int flag);
 
 int  SaveRGBAtoFile(char *pFile, const RGBA* img, int w, int h, int fmt=0);
 int  CreateYUVtoRGBAMap();
+int  CreateY16WindowMap(UCHAR* lut, int low, int high);
+const ConversionTable* get_conversion_table(int flag);
+int  conversion_bytes_per_pixel(int layout);
+int  conversion_pixels(int flag, int sz_packet, int num_packet);
+
+bool copy_toImage(const ImageDesc* dst, int layout, const void* frame,
+		  int width, int height, int sz_packet, int flag,
+		  const UCHAR* lut=0, int first_row=0, int num_rows=-1);
+int  SetupImageDesc(ImageDesc* dst, UCHAR* buf, int width, int height,
+		    int bytes_per_pixel, int align=32);
+bool GetIplImageDesc(ImageDesc* dst, const IplImage* img);
+
+PacketMap* CreatePacketMap(int width, int height, int sz_packet, int flag);
+void ReleasePacketMap(PacketMap* map);
+bool copy_toImageROI(const ImageDesc* dst, int layout, const void* frame,
+		     const PacketMap* map, const FrameRect* rect, int flag,
+		     const UCHAR* lut=0, int first_row=0, int num_rows=-1);
 
 
 bool copy_YUV411toIplImage(IplImage* dst, const void* lpYUV411,
@@ -62,7 +168,8 @@ bool copy_RGB888toIplImage(IplImage* dst, const void* lpRGB888,
 bool copy_Y8toIplImage(IplImage* dst, const void* lpY8,
 		       int sz_packet, int num_packet, int flag);
 bool copy_Y16toIplImage(IplImage* dst, const void* lpY16,
-		       int sz_packet, int num_packet, int flag);
+		       int sz_packet, int num_packet, int flag,
+		       const UCHAR* lut=0);
 
 bool copy_YUV411toIplImageGray(IplImage* dst, const void* lpYUV411,
 			       int sz_packet, int num_packet, int flag);
@@ -75,7 +182,34 @@ bool copy_RGB888toIplImageGray(IplImage* dst, const void* lpRGB888,
 bool copy_Y8toIplImageGray(IplImage* dst, const void* lpY8,
 			   int sz_packet, int num_packet, int flag);
 bool copy_Y16toIplImageGray(IplImage* dst, const void* lpY16,
-			    int sz_packet, int num_packet, int flag);
+			    int sz_packet, int num_packet, int flag,
+			    const UCHAR* lut=0);
+bool copy_Y16toIplImage16(IplImage* dst, const void* lpY16,
+			  int sz_packet, int num_packet, int flag);
+
+bool copy_toIplImageScaled(IplImage* dst, const void* frame,
+			   int width, int height, int sz_packet, int flag,
+			   int factor, const UCHAR* lut=0,
+			   int first_row=0, int num_rows=-1);
+bool copy_toIplImageGrayScaled(IplImage* dst, const void* frame,
+			       int width, int height, int sz_packet, int flag,
+			       int factor, const UCHAR* lut=0,
+			       int first_row=0, int num_rows=-1);
+
+bool copy_toPlanarYUV(const PlanarYUV* dst, int layout, const void* frame,
+		      int width, int height, int sz_packet, int flag,
+		      int first_row=0, int num_rows=-1);
+int  SetupPlanarYUV(PlanarYUV* dst, UCHAR* buf, int width, int height,
+		    int layout, int align=32);
+
+bool copy_BayertoBGR(UCHAR* dst, int step, const void* frame,
+		     int width, int height, int sz_packet, int flag,
+		     int pattern, const UCHAR* lut=0,
+		     int first_row=0, int num_rows=-1);
+bool copy_BayertoRGBA(RGBA* dst, const void* frame,
+		      int width, int height, int sz_packet, int flag,
+		      int pattern, const UCHAR* lut=0,
+		      int first_row=0, int num_rows=-1);
 
 
 
@@ -7,6 +7,11 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
 
 #if defined HAVE_CV_H || defined HAVE_OPENCV
 #include <cv.h>
@@ -19,6 +24,7 @@
 #endif
 
 #include "yuv.h"
+#include "yuv_simd.h"
 
 using namespace std;
 
@@ -42,13 +48,10 @@ static  FIX table_g0[256];  //!< LUT for  u component
 static  FIX table_g1[256];  //!< LUT for  v component
 static  FIX table_b [256];  //!< LUT for  v component
 
-/** 
- * Create look-up tabe for YUV to RGBA conversion.
- *
- * @return  Zero on success.
- */
-int
-CreateYUVtoRGBAMap()
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void
+create_table()
 {
     int i;
     for (i=0;i<256;i++){
@@ -60,7 +63,22 @@ CreateYUVtoRGBAMap()
 	table_g1[u]=FLOAT2FIX(-0.391f*(u-128));
 	table_b [u]=FLOAT2FIX( 2.018f*(u-128));
     }
-    return 0;
+    select_simd_kernel(SIMD_AVX2);
+}
+
+/** 
+ * Create look-up tabe for YUV to RGBA conversion.
+ *
+ * The tables are built only once, so this function may be called
+ * from several threads and several times. The SSE2/AVX2 kernels for
+ * YUV422 are also selected here, if the CPU supports them.
+ *
+ * @return  Zero on success.
+ */
+int
+CreateYUVtoRGBAMap()
+{
+    return pthread_once(&table_once, create_table);
 }
 
 /*
@@ -100,6 +118,368 @@ conv_YUVtoRGB(UCHAR* r, UCHAR* g, UCHAR* b,
     *b=b_;
 }
 
+/** 
+ * Create look-up table to reduce Y16 to 8bit by a window.
+ *
+ * The pixels from low to high are mapped linearly to 0..255, and
+ * the others are saturated. The table can be passed to the
+ * copy_Y16to*() functions.
+ *
+ * @param lut   pointer to 65536 entries.
+ * @param low   the pixel mapped to 0.
+ * @param high  the pixel mapped to 255.
+ *
+ * @return Zero on success, or -1 if low >= high.
+ */
+int
+CreateY16WindowMap(UCHAR* lut, int low, int high)
+{
+    if (low >= high)
+	return -1;
+    const int range = high - low;
+    for (int v=0; v<65536; v++){
+	if (v <= low)
+	    lut[v] = 0;
+	else if (high <= v)
+	    lut[v] = 255;
+	else
+	    lut[v] = ((v - low) * 255 + range/2) / range;
+    }
+    return 0;
+}
+
+/*
+ * reduce big endian Y16 to 8bit, by the LUT if any, or by the depth
+ * set by Y16_DEPTH() in flag.
+ */
+void
+conv_Y16to8(UCHAR* dst, const UCHAR* src, int num_pixel, int flag,
+	    const UCHAR* lut)
+{
+    int i = 0;
+    if (lut){
+	for (; i<num_pixel; i++, src+=2)
+	    dst[i] = lut[(src[0]<<8) | src[1]];
+	return;
+    }
+    const int shift = Y16_SHIFT(flag);
+    i = conv_Y16to8_simd(dst, src, num_pixel, shift);
+    for (src+=2*i; i<num_pixel; i++, src+=2){
+	int v = ((src[0]<<8) | src[1]) >> shift;
+	dst[i] = (255 < v) ? 255 : v;
+    }
+}
+
+/*
+ * The conversion engine.
+ *
+ * convert<FMT, D, HDR> converts the packets of a source format FMT to
+ * a destination layout D. Src<FMT> walks the pixels of a packet and
+ * hands each of them to D, which stores it in its own layout; both
+ * are inlined, so each instantiation is a loop of its own, as the
+ * hand-written functions were. HDR tells whether the packets have a
+ * header and a trailer, so nothing in the loop depends on flag except
+ * the depth of Y16.
+ *
+ * A new destination layout needs just another D, and a column of
+ * conv_table.
+ */
+
+// RGBA; the alpha components are left as they are.
+struct DstRGBA {
+    enum { BPP = 4 };
+    static inline void yuv(UCHAR* d, UCHAR Y, UCHAR u, UCHAR v) {
+	RGBA *q = (RGBA*)d;
+	conv_YUVtoRGB(&q->r, &q->g, &q->b, Y, u, v);
+    }
+    static inline void rgb(UCHAR* d, UCHAR r, UCHAR g, UCHAR b) {
+	RGBA *q = (RGBA*)d;
+	q->r = r;
+	q->g = g;
+	q->b = b;
+    }
+    static inline void gray_row(UCHAR* d, const UCHAR* s, int n) {
+	for (RGBA *q=(RGBA*)d; n>0; n--, q++, s++)
+	    q->r = q->g = q->b = *s;
+    }
+    static inline int yuv422_simd(UCHAR* d, const UCHAR* s, int n) {
+	return conv_YUV422toRGBA_simd((RGBA*)d, s, n);
+    }
+    static inline void y16_row(UCHAR* d, const UCHAR* s, int n, int flag,
+			       const UCHAR* lut, UCHAR* line) {
+	conv_Y16to8(line, s, n, flag, lut);
+	gray_row(d, line, n);
+    }
+};
+
+// b,g,r, as IplImage of 3 channels.
+struct DstBGR {
+    enum { BPP = 3 };
+    static inline void yuv(UCHAR* d, UCHAR Y, UCHAR u, UCHAR v) {
+	conv_YUVtoRGB(d+2, d+1, d, Y, u, v);
+    }
+    static inline void rgb(UCHAR* d, UCHAR r, UCHAR g, UCHAR b) {
+	d[0] = b;
+	d[1] = g;
+	d[2] = r;
+    }
+    static inline void gray_row(UCHAR* d, const UCHAR* s, int n) {
+	for (; n>0; n--, d+=3, s++)
+	    d[0] = d[1] = d[2] = *s;
+    }
+    static inline int yuv422_simd(UCHAR* d, const UCHAR* s, int n) {
+	return conv_YUV422toBGR_simd(d, s, n);
+    }
+    static inline void y16_row(UCHAR* d, const UCHAR* s, int n, int flag,
+			       const UCHAR* lut, UCHAR* line) {
+	conv_Y16to8(line, s, n, flag, lut);
+	gray_row(d, line, n);
+    }
+};
+
+// gray; Y of YUV, or the mean of r,g,b.
+struct DstGray {
+    enum { BPP = 1 };
+    static inline void yuv(UCHAR* d, UCHAR Y, UCHAR, UCHAR) {
+	*d = Y;
+    }
+    static inline void rgb(UCHAR* d, UCHAR r, UCHAR g, UCHAR b) {
+	*d = (r + g + b) / 3;
+    }
+    static inline void gray_row(UCHAR* d, const UCHAR* s, int n) {
+	memcpy(d, s, n);
+    }
+    static inline int yuv422_simd(UCHAR*, const UCHAR*, int) {
+	return 0;
+    }
+    static inline void y16_row(UCHAR* d, const UCHAR* s, int n, int flag,
+			       const UCHAR* lut, UCHAR*) {
+	conv_Y16to8(d, s, n, flag, lut);
+    }
+};
+
+// 16bit of the host byte order, from Y16 only.
+struct DstY16 {
+    enum { BPP = 2 };
+    static inline void y16_row(UCHAR* d, const UCHAR* s, int n, int,
+			       const UCHAR*, UCHAR*) {
+	unsigned short *q = (unsigned short*)d;
+	int i = conv_Y16swap_simd(q, s, n);
+	for (; i<n; i++)
+	    q[i] = (s[2*i]<<8) | s[2*i+1];
+    }
+};
+
+/*
+ * the pixels of a packet. pixels() is the number of pixels of a
+ * payload, and LINE is 1 if convert() needs a line buffer. convert()
+ * takes a multiple of GROUP pixels, which are BYTES bytes.
+ */
+template <int FMT> struct Src;
+
+template <> struct Src<FMT_YUV411> {
+    enum { LINE = 0, GROUP = 4, BYTES = 6 };
+    static int pixels(int payload) { return payload/6*4; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int, const UCHAR*, UCHAR*) {
+	// u Y Y v Y Y
+	for (int i=0; i<n; i+=4, p+=6, d+=4*D::BPP){
+	    D::yuv(d,          p[1], p[0], p[3]);
+	    D::yuv(d+D::BPP,   p[2], p[0], p[3]);
+	    D::yuv(d+2*D::BPP, p[4], p[0], p[3]);
+	    D::yuv(d+3*D::BPP, p[5], p[0], p[3]);
+	}
+    }
+};
+
+template <> struct Src<FMT_YUV422> {
+    enum { LINE = 0, GROUP = 2, BYTES = 4 };
+    static int pixels(int payload) { return payload/4*2; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int, const UCHAR*, UCHAR*) {
+	// u Y v Y
+	int i = D::yuv422_simd(d, p, n);
+	for (d+=i*D::BPP, p+=i*2; i<n; i+=2, p+=4, d+=2*D::BPP){
+	    D::yuv(d,        p[1], p[0], p[2]);
+	    D::yuv(d+D::BPP, p[3], p[0], p[2]);
+	}
+    }
+};
+
+template <> struct Src<FMT_YUV444> {
+    enum { LINE = 0, GROUP = 1, BYTES = 3 };
+    static int pixels(int payload) { return payload/3; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int, const UCHAR*, UCHAR*) {
+	// u Y v
+	for (int i=0; i<n; i++, p+=3, d+=D::BPP)
+	    D::yuv(d, p[1], p[0], p[2]);
+    }
+};
+
+template <> struct Src<FMT_RGB888> {
+    enum { LINE = 0, GROUP = 1, BYTES = 3 };
+    static int pixels(int payload) { return payload/3; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int, const UCHAR*, UCHAR*) {
+	for (int i=0; i<n; i++, p+=3, d+=D::BPP)
+	    D::rgb(d, p[0], p[1], p[2]);
+    }
+};
+
+template <> struct Src<FMT_Y8> {
+    enum { LINE = 0, GROUP = 1, BYTES = 1 };
+    static int pixels(int payload) { return payload; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int, const UCHAR*, UCHAR*) {
+	D::gray_row(d, p, n);
+    }
+};
+
+template <> struct Src<FMT_Y16> {
+    enum { LINE = 1, GROUP = 1, BYTES = 2 };
+    static int pixels(int payload) { return payload/2; }
+    template <class D> static inline void
+    convert(UCHAR* d, const UCHAR* p, int n, int flag, const UCHAR* lut,
+	    UCHAR* line) {
+	D::y16_row(d, p, n, flag, lut, line);
+    }
+};
+
+/*
+ * converts the groups of pixels which begin in the packets. The
+ * payloads are one stream, so the groups in a packet are converted in
+ * place, and a group spanning two packets is gathered first. The
+ * destination is contiguous.
+ */
+template <int FMT, class D, bool HDR>
+static void
+convert(void* dst, const void* src, int packet_sz, int first_packet,
+	int num_packet, int num_pixel, int flag, const UCHAR* lut)
+{
+    typedef Src<FMT> S;
+    UCHAR *d = (UCHAR*)dst;
+    const UCHAR *frame = (const UCHAR*)src;
+    const int payload = HDR ? packet_sz - 8 : packet_sz;
+    if (HDR)
+	frame += 4;
+    if (payload <= 0 || num_packet <= 0 || num_pixel <= 0)
+	return;
+
+    const size_t end = (size_t)(first_packet + num_packet) * payload;
+    size_t g = ((size_t)first_packet * payload + S::BYTES - 1) / S::BYTES;
+    size_t g_end = min((end + S::BYTES - 1) / S::BYTES,
+		       (size_t)num_pixel / S::GROUP);
+    vector<UCHAR> line(S::LINE ? S::pixels(payload) + S::GROUP : 0);
+    UCHAR *l = line.empty() ? NULL : &line[0];
+    UCHAR tmp[S::BYTES];
+    for (int k=first_packet; g<g_end; k++){
+	const UCHAR *p = frame + (size_t)k * packet_sz;
+	const size_t base = (size_t)k * payload;
+	size_t o = g * S::BYTES - base;
+	if (o >= (size_t)payload)
+	    continue;
+	size_t m = min((payload - o) / S::BYTES, g_end - g);
+	if (m > 0){
+	    S::template convert<D>(d + g * S::GROUP * D::BPP, p + o,
+				   m * S::GROUP, flag, lut, l);
+	    g += m;
+	    o += m * S::BYTES;
+	}
+	if (g == g_end || o >= (size_t)payload)
+	    continue;
+	// the group spans the packets
+	for (int n=0, q=k; n<S::BYTES; q++, o=0){
+	    int len = min((int)(payload - o), S::BYTES - n);
+	    memcpy(tmp + n, frame + (size_t)q * packet_sz + o, len);
+	    n += len;
+	}
+	S::template convert<D>(d + g * S::GROUP * D::BPP, tmp, S::GROUP,
+			       flag, lut, l);
+	g++;
+    }
+}
+
+
+#define CONV_ENTRY(FMT, HDR)						\
+    { { convert<FMT, DstRGBA, HDR>, convert<FMT, DstBGR, HDR>,		\
+	convert<FMT, DstGray, HDR>, NULL } }
+#define CONV_ENTRY_Y16(HDR)						\
+    { { convert<FMT_Y16, DstRGBA, HDR>, convert<FMT_Y16, DstBGR, HDR>,	\
+	convert<FMT_Y16, DstGray, HDR>, convert<FMT_Y16, DstY16, HDR> } }
+
+// [REMOVE_HEADER][FMT_YUV411 - 1 ... FMT_Y16 - 1]
+static const ConversionTable conv_table[2][FMT_Y16] = {
+    {
+	CONV_ENTRY(FMT_YUV411, false), CONV_ENTRY(FMT_YUV422, false),
+	CONV_ENTRY(FMT_YUV444, false), CONV_ENTRY(FMT_RGB888, false),
+	CONV_ENTRY(FMT_Y8, false),     CONV_ENTRY_Y16(false),
+    },
+    {
+	CONV_ENTRY(FMT_YUV411, true),  CONV_ENTRY(FMT_YUV422, true),
+	CONV_ENTRY(FMT_YUV444, true),  CONV_ENTRY(FMT_RGB888, true),
+	CONV_ENTRY(FMT_Y8, true),      CONV_ENTRY_Y16(true),
+    },
+};
+
+#undef CONV_ENTRY
+#undef CONV_ENTRY_Y16
+
+/** 
+ * Get the conversions of a packet layout.
+ *
+ * The functions of the table are specialized for the format and the
+ * header mode, so choose the table once when the layout is known, and
+ * call to[CONV_*] for each frame. They take the same parameters as
+ * the copy_*() functions, but the destination is a plain buffer of
+ * the layout, and REMOVE_HEADER in their flag is ignored.
+ *
+ * @param flag  FMT_* | REMOVE_HEADER
+ *
+ * @return the table, or NULL if the format is not supported.
+ */
+const ConversionTable*
+get_conversion_table(int flag)
+{
+    int fmt = flag & FMT_MASK;
+    if (fmt < FMT_YUV411 || FMT_Y16 < fmt)
+	return NULL;
+    return &conv_table[(flag & REMOVE_HEADER) ? 1 : 0][fmt - 1];
+}
+
+/** 
+ * Get the bytes per pixel of a destination layout.
+ *
+ * @param layout  CONV_*
+ *
+ * @return the bytes per pixel, or 0 if layout is invalid.
+ */
+int
+conversion_bytes_per_pixel(int layout)
+{
+    static const int bpp[NUM_CONV] = { 4, 3, 1, 2 };
+    return (0 <= layout && layout < NUM_CONV) ? bpp[layout] : 0;
+}
+
+/*
+ * converts a frame of a format to a layout, for the copy_*()
+ * functions. At most max_pixel pixels are stored, if not negative.
+ */
+static bool
+convert_frame(int fmt, int layout, void* dst, const void* src,
+	      int packet_sz, int num_packet, int flag, const UCHAR* lut=NULL,
+	      int max_pixel=-1)
+{
+    const ConversionTable *table =
+	get_conversion_table((flag & ~FMT_MASK) | fmt);
+    int pixels = conversion_pixels((flag & ~FMT_MASK) | fmt, packet_sz,
+				   num_packet);
+    if (0 <= max_pixel && max_pixel < pixels)
+	pixels = max_pixel;
+    table->to[layout](dst, src, packet_sz, 0, num_packet, pixels, flag, lut);
+    return true;
+}
+
 /* convert YUV444 to RGBA
  * 
  * @param lpRGBA      pointer to destnation image data.
@@ -112,24 +492,8 @@ bool
 copy_YUV444toRGBA(RGBA* lpRGBA,const void *lpYUV444,
 		  int packet_sz,int num_packet,int flag)
 {
-    UCHAR *p=(UCHAR*)lpYUV444;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/3;i++){      
-	    UCHAR Y,u,v; 
-	    u=*p++;
-	    Y=*p++;
-	    v=*p++; // read v(K+0)      
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b, Y, u, v);// Y(K+0)
-	    lpRGBA++;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_frame(FMT_YUV444, CONV_RGBA, lpRGBA, lpYUV444,
+			 packet_sz, num_packet, flag);
 }
 
 /*
@@ -145,32 +509,10 @@ bool
 copy_YUV422toRGBA(RGBA* lpRGBA, const void *lpYUV422, int packet_sz,
 		  int num_packet, int flag)
 {
-    UCHAR *p=(UCHAR*)lpYUV422;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/4;i++){
-	    UCHAR Y,u,v;
-	    u=*p++;
-	    Y=*p++;
-	    v=*p++;
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b, Y, u, v);
-	    lpRGBA++;
-	    Y=*p++;
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b, Y, u, v);
-	    lpRGBA++;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_frame(FMT_YUV422, CONV_RGBA, lpRGBA, lpYUV422,
+			 packet_sz, num_packet, flag);
 }
 
-
-
 /* convert YUV411 to RGBA 
  * 
  * @param lpRGBA      pointer to destnation image data.
@@ -183,39 +525,10 @@ bool
 copy_YUV411toRGBA(RGBA* lpRGBA,const void *lpYUV411,
 		  int packet_sz,int num_packet,int flag)
 {
-    UCHAR *p=(UCHAR*)lpYUV411;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/(2*3);i++){      
-	    UCHAR Y,u,v; 
-	    u=*p++;
-	    Y=*p++;
-	    v=p[1]; // read v(K+0)      
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b,
-			  Y, u, v);// Y(K+0)
-	    lpRGBA++;
-	    Y=*p++;
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b, 
-			  Y, u, v);// Y(K+1)
-	    lpRGBA++;
-	    p++;  // skip v(K+0)
-	    Y=*p++;
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b,
-			  Y, u, v);// Y(K+2)
-	    lpRGBA++;
-	    Y=*p++;
-	    conv_YUVtoRGB(&lpRGBA->r, &lpRGBA->g, &lpRGBA->b,
-			  Y, u, v);// Y(K+3)
-	    lpRGBA++;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_frame(FMT_YUV411, CONV_RGBA, lpRGBA, lpYUV411,
+			 packet_sz, num_packet, flag);
 }
+
 /* convert RGB888 to RGBA
  * 
  * @param lpRGBA      pointer to destnation image data.
@@ -228,25 +541,10 @@ bool
 copy_RGB888toRGBA(RGBA* lpRGBA,const void *lpRGB888,
 		  int packet_sz,int num_packet,int flag)
 {
-    UCHAR *p=(UCHAR*)lpRGB888;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/3;i++){      
-	    lpRGBA->r=*p++;
-	    lpRGBA->g=*p++;
-	    lpRGBA->b=*p++;
-	    lpRGBA++;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_frame(FMT_RGB888, CONV_RGBA, lpRGBA, lpRGB888,
+			 packet_sz, num_packet, flag);
 }
 
-
 /* convert Y8 to RGBA 
  * 
  * @param lpRGBA      pointer to destnation image data.
@@ -259,26 +557,10 @@ bool
 copy_Y8toRGBA(RGBA* lpRGBA,const void *lpY8,
 		  int packet_sz,int num_packet,int flag)
 {
-    UCHAR *p=(UCHAR*)lpY8;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz;i++){      
-	    lpRGBA->r = *p;
-	    lpRGBA->g = *p;
-	    lpRGBA->b = *p;
-	    lpRGBA++;
-	    p++;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_frame(FMT_Y8, CONV_RGBA, lpRGBA, lpY8,
+			 packet_sz, num_packet, flag);
 }
 
-
 /* convert Y16 to RGBA 
  * 
  * @param lpRGBA      pointer to destnation image data.
@@ -286,121 +568,481 @@ copy_Y8toRGBA(RGBA* lpRGBA,const void *lpY8,
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
+ *                    Y16_DEPTH() : the effective bit depth.
+ * @param lut         LUT made by CreateY16WindowMap(), or NULL.
  */
 bool
 copy_Y16toRGBA(RGBA* lpRGBA,const void *lpY16,
-		  int packet_sz,int num_packet,int flag)
+		  int packet_sz,int num_packet,int flag, const UCHAR* lut)
+{
+    return convert_frame(FMT_Y16, CONV_RGBA, lpRGBA, lpY16,
+			 packet_sz, num_packet, flag, lut);
+}
+
+/* convert Y16 to 16bit pixels of the host byte order.
+ * 
+ * @param dst         pointer to destnation image data.
+ * @param lpY16       pointer to source image data.
+ * @param packet_sz   the size of each packet.
+ * @param num_packet  the number of packets per one image.
+ * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
+ */
+bool
+copy_Y16toY16(unsigned short* dst, const void *lpY16,
+	      int packet_sz, int num_packet, int flag)
 {
-    UCHAR *p=(UCHAR*)lpY16;
+    return convert_frame(FMT_Y16, CONV_Y16, dst, lpY16,
+			 packet_sz, num_packet, flag);
+}
+
+/*
+ * returns a pointer to a row of the frame. If the row spans
+ * packets, it is gathered into tmp.
+ *
+ * @param frame      pointer to the frame.
+ * @param row        the row number.
+ * @param row_bytes  the size of a row.
+ * @param packet_sz  the size of each packet.
+ * @param flag       REMOVE_HEADER : remove packet's  header/trailer.
+ * @param tmp        buffer of row_bytes.
+ */
+const UCHAR*
+get_frame_row(const UCHAR* frame, int row, int row_bytes, int packet_sz,
+	      int flag, UCHAR* tmp)
+{
+    int payload = packet_sz;
     if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/2;i++){      
-	    /*
-	      int  Y = *p << 8;
-	      p++;
-	      Y |= *p ;
-	    */
-	    lpRGBA->r = *p;
-	    lpRGBA->g = *p;
-	    lpRGBA->b = *p;
-	    lpRGBA++;
-	    p++;
-	    // ignore lower 8 bit data.
-	    p++;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
+	payload -= 8;
+	frame += 4;
+    }
+    size_t offset = (size_t)row * row_bytes;
+    size_t k = offset / payload;
+    int o = offset % payload;
+    if (o + row_bytes <= payload)
+	return frame + k*packet_sz + o;
+
+    for (int n=0; n<row_bytes; k++, o=0){
+	int len = payload - o;
+	if (len > row_bytes - n)
+	    len = row_bytes - n;
+	memcpy(tmp + n, frame + k*packet_sz + o, len);
+	n += len;
+    }
+    return tmp;
+}
+
+/*
+ * converts a row of n pixels. A partial group at the end is converted
+ * into tmp, so nothing is written past the n pixels.
+ */
+template <int FMT, class D>
+static void
+convert_row(UCHAR* d, const UCHAR* row, int n, int flag, const UCHAR* lut,
+	    UCHAR* line)
+{
+    const int full = n / Src<FMT>::GROUP * Src<FMT>::GROUP;
+    Src<FMT>::template convert<D>(d, row, full, flag, lut, line);
+    if (full < n){
+	UCHAR tmp[Src<FMT>::GROUP * 4];
+	UCHAR *p = d + full * D::BPP;
+	memcpy(tmp, p, (n - full) * D::BPP);   // keeps the alpha of RGBA
+	Src<FMT>::template convert<D>(tmp, row + full / Src<FMT>::GROUP
+				      * Src<FMT>::BYTES, Src<FMT>::GROUP,
+				      flag, lut, line);
+	memcpy(p, tmp, (n - full) * D::BPP);
+    }
+}
+
+typedef void (*ROW_CONVERSION)(UCHAR* d, const UCHAR* row, int n, int flag,
+			       const UCHAR* lut, UCHAR* line);
+
+struct RowConversion {
+    int group;                 // Src<FMT>::GROUP
+    int bytes;                 // Src<FMT>::BYTES
+    ROW_CONVERSION to[NUM_CONV];
+};
+
+#define ROW_ENTRY(FMT)							\
+    { Src<FMT>::GROUP, Src<FMT>::BYTES,					\
+      { convert_row<FMT, DstRGBA>, convert_row<FMT, DstBGR>,		\
+	convert_row<FMT, DstGray>, NULL } }
+
+// [FMT_YUV411 - 1 ... FMT_Y16 - 1]
+static const RowConversion row_table[FMT_Y16] = {
+    ROW_ENTRY(FMT_YUV411), ROW_ENTRY(FMT_YUV422), ROW_ENTRY(FMT_YUV444),
+    ROW_ENTRY(FMT_RGB888), ROW_ENTRY(FMT_Y8),
+    { 1, 2, { convert_row<FMT_Y16, DstRGBA>, convert_row<FMT_Y16, DstBGR>,
+	      convert_row<FMT_Y16, DstGray>, convert_row<FMT_Y16, DstY16> } },
+};
+
+#undef ROW_ENTRY
+
+/** 
+ * Get the number of pixels carried by the packets of a frame.
+ *
+ * The payloads are taken as one stream, so a pixel may span two
+ * packets; a partial group of pixels at the end is not counted.
+ *
+ * @param flag        FMT_* | REMOVE_HEADER
+ * @param packet_sz   the size of each packet.
+ * @param num_packet  the number of packets.
+ *
+ * @return the number of pixels, or 0 if the format is not supported.
+ */
+int
+conversion_pixels(int flag, int packet_sz, int num_packet)
+{
+    int fmt = flag & FMT_MASK;
+    if (fmt < FMT_YUV411 || FMT_Y16 < fmt)
+	return 0;
+    const RowConversion *conv = &row_table[fmt - 1];
+    int payload = (flag & REMOVE_HEADER) ? packet_sz - 8 : packet_sz;
+    if (payload <= 0 || num_packet <= 0)
+	return 0;
+    return (int)((size_t)payload * num_packet / conv->bytes * conv->group);
+}
+
+/** 
+ * Convert a frame to an image of any stride.
+ *
+ * Each row is stored at dst->data + y * dst->step, so the image may be
+ * padded, or a part of a larger one. The frame is clipped to the size
+ * of the image. If the rows begin at aligned addresses, e.g. set up by
+ * SetupImageDesc(), so do the vector stores of each row.
+ *
+ * @param dst        the destination image.
+ * @param layout     CONV_RGBA, CONV_BGR, CONV_GRAY or CONV_Y16.
+ * @param frame      pointer to source image data.
+ * @param width      the width of the frame.
+ * @param height     the height of the frame.
+ * @param packet_sz  the size of each packet.
+ * @param flag       FMT_* | REMOVE_HEADER | Y16_DEPTH()
+ * @param lut        LUT made by CreateY16WindowMap(), or NULL.
+ * @param first_row  the first row to store.
+ * @param num_rows   the number of rows to store, or -1 for all.
+ *
+ * @return false if the parameters are not supported.
+ */
+bool
+copy_toImage(const ImageDesc* dst, int layout, const void* frame,
+	     int width, int height, int packet_sz, int flag,
+	     const UCHAR* lut, int first_row, int num_rows)
+{
+    int fmt = flag & FMT_MASK;
+    if (fmt < FMT_YUV411 || FMT_Y16 < fmt || layout < 0 || NUM_CONV <= layout)
+	return false;
+    const RowConversion *conv = &row_table[fmt - 1];
+    ROW_CONVERSION func = conv->to[layout];
+    if (!func || width <= 0 || 0 != width % conv->group)
+	return false;
+
+    int out_w = min(width, dst->width), out_h = min(height, dst->height);
+    if (out_w <= 0 || dst->step < out_w * conversion_bytes_per_pixel(layout))
+	return false;
+    if (first_row < 0 || out_h < first_row)
+	return false;
+    if (num_rows < 0 || first_row + num_rows > out_h)
+	num_rows = out_h - first_row;
+
+    const int row_bytes = width / conv->group * conv->bytes;
+    vector<UCHAR> tmp(row_bytes), line(width);
+    for (int y=first_row; y<first_row+num_rows; y++){
+	const UCHAR *row = get_frame_row((const UCHAR*)frame, y, row_bytes,
+					 packet_sz, flag, &tmp[0]);
+	func(dst->data + (size_t)y * dst->step, row, out_w, flag, lut,
+	     &line[0]);
     }
     return true;
 }
 
+/** 
+ * Set up an image in a buffer, with each row aligned.
+ *
+ * @param dst              the image to set up.
+ * @param buf              the buffer, aligned to 'align', or NULL to get
+ *                         the size.
+ * @param width            the width of the image.
+ * @param height           the height of the image.
+ * @param bytes_per_pixel  e.g. conversion_bytes_per_pixel(CONV_BGR).
+ * @param align            the alignment of the rows, a power of 2.
+ *
+ * @return the size of the buffer in bytes, or -1 on error.
+ */
+int
+SetupImageDesc(ImageDesc* dst, UCHAR* buf, int width, int height,
+	       int bytes_per_pixel, int align)
+{
+    if (width <= 0 || height <= 0 || bytes_per_pixel <= 0 ||
+	align <= 0 || (align & (align-1)))
+	return -1;
+    int step = (width * bytes_per_pixel + align - 1) & ~(align - 1);
+    if (dst){
+	dst->data = buf;
+	dst->step = step;
+	dst->width = width;
+	dst->height = height;
+    }
+    return step * height;
+}
+
+/*
+ * where each row of a frame begins. The rows are found without
+ * dividing, so converting a rectangle costs by its area only.
+ */
+struct PacketMap {
+    int width;
+    int height;
+    int fmt;                 // FMT_*
+    int packet_sz;
+    int payload;             // bytes of pixels in each packet
+    int head;                // bytes before the pixels of each packet
+    vector<int> packet;      // the packet of the first byte of each row
+    vector<int> offset;      // the offset of the byte in the payload
+};
+
+/** 
+ * Create the map from the pixels of a frame to its packets.
+ *
+ * @param width      the width of the frame.
+ * @param height     the height of the frame.
+ * @param packet_sz  the size of each packet.
+ * @param flag       FMT_* | REMOVE_HEADER
+ *
+ * @return the map, or NULL if the layout is not supported. Release it
+ *         by ReleasePacketMap().
+ *
+ * @sa copy_toImageROI()
+ */
+PacketMap*
+CreatePacketMap(int width, int height, int packet_sz, int flag)
+{
+    int fmt = flag & FMT_MASK;
+    if (fmt < FMT_YUV411 || FMT_Y16 < fmt || width <= 0 || height <= 0)
+	return NULL;
+    const RowConversion *conv = &row_table[fmt - 1];
+    int head = (flag & REMOVE_HEADER) ? 4 : 0;
+    if (0 != width % conv->group || packet_sz - 2*head <= 0)
+	return NULL;
+
+    PacketMap *map = new PacketMap;
+    map->width = width;
+    map->height = height;
+    map->fmt = fmt;
+    map->packet_sz = packet_sz;
+    map->payload = packet_sz - 2*head;
+    map->head = head;
+    map->packet.resize(height);
+    map->offset.resize(height);
+    const size_t row_bytes = width / conv->group * conv->bytes;
+    for (int y=0; y<height; y++){
+	size_t o = (size_t)y * row_bytes;
+	map->packet[y] = o / map->payload;
+	map->offset[y] = o % map->payload;
+    }
+    return map;
+}
+
+/** 
+ * Release the map made by CreatePacketMap().
+ *
+ * @param map  the map, or NULL.
+ */
+void
+ReleasePacketMap(PacketMap* map)
+{
+    delete map;
+}
+
+/*
+ * returns len bytes from the byte b of the row y. If they span
+ * packets, they are gathered into tmp.
+ */
+static const UCHAR*
+map_segment(const UCHAR* frame, const PacketMap* map, int y, int b, int len,
+	    UCHAR* tmp)
+{
+    int k = map->packet[y], o = map->offset[y] + b;
+    if (o >= map->payload){
+	k += o / map->payload;
+	o %= map->payload;
+    }
+    const UCHAR *p = frame + (size_t)k * map->packet_sz + map->head;
+    if (o + len <= map->payload)
+	return p + o;
+
+    for (int n=0; n<len; o=0, p+=map->packet_sz){
+	int l = min(map->payload - o, len - n);
+	memcpy(tmp + n, p + o, l);
+	n += l;
+    }
+    return tmp;
+}
+
+/** 
+ * Convert a rectangle of a frame to an image.
+ *
+ * Only the packets under the rectangle are read. The top left pixel
+ * of dst is the top left of the rectangle; the pixels out of the
+ * frame or out of dst are not stored.
+ *
+ * @param dst        the destination image.
+ * @param layout     CONV_RGBA, CONV_BGR, CONV_GRAY or CONV_Y16.
+ * @param frame      pointer to source image data.
+ * @param map        the map of the frame, by CreatePacketMap().
+ * @param rect       the rectangle of the frame.
+ * @param flag       Y16_DEPTH(); the others are taken from map.
+ * @param lut        LUT made by CreateY16WindowMap(), or NULL.
+ * @param first_row  the first row of the rectangle to store.
+ * @param num_rows   the number of rows to store, or -1 for all.
+ *
+ * @return false if the parameters are not supported.
+ */
+bool
+copy_toImageROI(const ImageDesc* dst, int layout, const void* frame,
+		const PacketMap* map, const FrameRect* rect, int flag,
+		const UCHAR* lut, int first_row, int num_rows)
+{
+    if (!map || layout < 0 || NUM_CONV <= layout)
+	return false;
+    const RowConversion *conv = &row_table[map->fmt - 1];
+    ROW_CONVERSION func = conv->to[layout];
+    if (!func)
+	return false;
+    const int bpp = conversion_bytes_per_pixel(layout);
+    flag = (flag & ~FMT_MASK) | map->fmt;
+
+    // the rectangle clipped by the frame and by dst.
+    int x0 = max(rect->x, 0);
+    int x1 = min(rect->x + min(rect->width, dst->width), map->width);
+    int y0 = max(rect->y, 0);
+    int y1 = min(rect->y + min(rect->height, dst->height), map->height);
+    if (first_row > 0)
+	y0 = max(y0, rect->y + first_row);
+    if (num_rows >= 0)
+	y1 = min(y1, rect->y + first_row + num_rows);
+    const int w = x1 - x0;
+    if (w <= 0 || y1 <= y0)
+	return true;
+    if (dst->step < (x1 - rect->x) * bpp)
+	return false;
+
+    // the rectangle begins at a group of pixels.
+    const int gx = x0 / conv->group * conv->group;
+    const int skip = x0 - gx;
+    const int n = skip + w;
+    const int b = gx / conv->group * conv->bytes;
+    const int len = (n + conv->group - 1) / conv->group * conv->bytes;
+    vector<UCHAR> tmp(len), line(n), out(skip ? n * bpp : 0);
+    for (int y=y0; y<y1; y++){
+	const UCHAR *src = map_segment((const UCHAR*)frame, map, y, b, len,
+				       &tmp[0]);
+	UCHAR *d = dst->data + (size_t)(y - rect->y) * dst->step
+	    + (x0 - rect->x) * bpp;
+	if (0 == skip){
+	    func(d, src, w, flag, lut, &line[0]);
+	    continue;
+	}
+	memcpy(&out[skip*bpp], d, w*bpp);   // keeps the alpha of RGBA
+	func(&out[0], src, n, flag, lut, &line[0]);
+	memcpy(d, &out[skip*bpp], w*bpp);
+    }
+    return true;
+}
 
 #ifdef IPL_IMG_SUPPORTED
 
+/** 
+ * Get the image of an IplImage, which is its ROI if set.
+ *
+ * @param dst  the image.
+ * @param img  IplImage of IPL_DEPTH_8U or IPL_DEPTH_16U.
+ *
+ * @return false if the depth is not supported.
+ */
+bool
+GetIplImageDesc(ImageDesc* dst, const IplImage* img)
+{
+    int bytes;
+    if (IPL_DEPTH_8U == img->depth)
+	bytes = img->nChannels;
+    else if (IPL_DEPTH_16U == img->depth)
+	bytes = img->nChannels * 2;
+    else
+	return false;
+    dst->data = (UCHAR*)img->imageData;
+    dst->step = img->widthStep;
+    dst->width = img->width;
+    dst->height = img->height;
+    if (img->roi){
+	dst->data += (size_t)img->roi->yOffset * img->widthStep
+	    + img->roi->xOffset * bytes;
+	dst->width = img->roi->width;
+	dst->height = img->roi->height;
+    }
+    return true;
+}
+
+/*
+ * converts packets to IplImage. The image (or its ROI) is filled
+ * densely as before, if its rows are not padded; otherwise the frame
+ * is taken as rows of the width of the image.
+ */
+static bool
+convert_IplImage(int fmt, int layout, IplImage* img, const void* src,
+		 int packet_sz, int num_packet, int flag,
+		 const UCHAR* lut=NULL)
+{
+    ImageDesc desc;
+    if (!GetIplImageDesc(&desc, img) || desc.width <= 0)
+	return false;
+    if (desc.step == desc.width * conversion_bytes_per_pixel(layout))
+	return convert_frame(fmt, layout, desc.data, src, packet_sz,
+			     num_packet, flag, lut, desc.width * desc.height);
+
+    int pixels = conversion_pixels((flag & ~FMT_MASK) | fmt, packet_sz,
+				   num_packet);
+    return copy_toImage(&desc, layout, src, desc.width, pixels / desc.width,
+			packet_sz, (flag & ~FMT_MASK) | fmt, lut);
+}
+
 /*
  * convert YUV444 to IplImage
- * (This function will work, only when there is IPL.) 
+ * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
  * @param lpYUV444    pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
- *
- * @return
  */
 bool
-copy_YUV444toIplImage(IplImage* img, const void *lpYUV444, 
-		      int packet_sz,
-		      int num_packet, int flag)
+copy_YUV444toIplImage(IplImage* img, const void *lpYUV444,
+		      int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)img->imageData;
-    UCHAR *p=(UCHAR*)lpYUV444;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/3;i++){      
-	    UCHAR r,g,b;
-	    UCHAR Y,u,v; 
-	    u=*p++;
-	    Y=*p++;
-	    v=*p++; // read v(K+0)      
-	    conv_YUVtoRGB(&r, &g, &b, Y, u, v); // Y(K+3)
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_IplImage(FMT_YUV444, CONV_BGR, img, lpYUV444,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert YUV444 to IplImage
- * (This function will work, only when there is IPL.) 
+ * convert YUV444 to IplImage(Gray)
+ * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
  * @param lpYUV444    pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
- *
- * @return
  */
 bool
-copy_YUV444toIplImageGray(IplImage* img, const void *lpYUV444, 
-			  int packet_sz,
-			  int num_packet, int flag)
+copy_YUV444toIplImageGray(IplImage* img, const void *lpYUV444,
+			  int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)img->imageData;
-    UCHAR *p=(UCHAR*)lpYUV444;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/3;i++){      
-	    UCHAR Y;
-	    p++;
-	    Y=*p++;
-	    p++; // read v(K+0)      
-	    //conv_YUVtoRGB(&r, &g, &b, Y, u, v); // Y(K+3)
-	    *dst++=Y;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    }
-    return true;
+    return convert_IplImage(FMT_YUV444, CONV_GRAY, img, lpYUV444,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert YUV422 to IplImage. 
+ * convert YUV422 to IplImage.
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
@@ -410,43 +1052,15 @@ copy_YUV444toIplImageGray(IplImage* img, const void *lpYUV444,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_YUV422toIplImage(IplImage* img, const void *lpYUV422, 
-		      int packet_sz,
-		      int num_packet, int flag)
+copy_YUV422toIplImage(IplImage* img, const void *lpYUV422,
+		      int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpYUV422;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/4;i++){
-	    UCHAR r,g,b;
-	    UCHAR Y,u,v;
-	    u=*p++;
-	    Y=*p++;
-	    v=*p++;
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v);
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	    Y=*p++;
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v);
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_YUV422, CONV_BGR, img, lpYUV422,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert YUV422 to IplImage(gray). 
+ * convert YUV422 to IplImage(gray).
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
@@ -456,38 +1070,17 @@ copy_YUV422toIplImage(IplImage* img, const void *lpYUV422,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_YUV422toIplImageGray(IplImage* img, const void *lpYUV422, 
-			  int packet_sz,
-			  int num_packet, int flag)
+copy_YUV422toIplImageGray(IplImage* img, const void *lpYUV422,
+			  int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpYUV422;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/4;i++){
-	    UCHAR Y;
-	    p++;
-	    Y=*p++;
-	    p++;
-	    *dst++=Y;
-	    Y=*p++;
-	    *dst++=Y;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_YUV422, CONV_GRAY, img, lpYUV422,
+			    packet_sz, num_packet, flag);
 }
 
 /*
  * convert YUV411 to IplImage
- * (This function will work, only when there is IPL.) 
- * 
+ * (This function will work, only when there is IPL.)
+ *
  * @param img         pointer to IplImage object.
  * @param lpYUV411    pointer to source image data.
  * @param packet_sz   the size of each packet.
@@ -495,54 +1088,17 @@ copy_YUV422toIplImageGray(IplImage* img, const void *lpYUV422,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_YUV411toIplImage(IplImage* img, const void *lpYUV411, 
-		      int packet_sz,
-		      int num_packet, int flag)
+copy_YUV411toIplImage(IplImage* img, const void *lpYUV411,
+		      int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)img->imageData;
-    UCHAR *p=(UCHAR*)lpYUV411;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/(2*3);i++){      
-	    UCHAR r,g,b;
-	    UCHAR Y,u,v; 
-	    u=*p++;
-	    Y=*p++;
-	    v=p[1]; // read v(K+0)      
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+0)
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	    Y=*p++;
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+1)
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	    p++;  // skip v(K+0)
-	    Y=*p++;
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+2)
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	    Y=*p++;
-	    conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+3)
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } 
-    return true;
+    return convert_IplImage(FMT_YUV411, CONV_BGR, img, lpYUV411,
+			    packet_sz, num_packet, flag);
 }
 
 /*
  * convert YUV411 to IplImage(Gray)
- * (This function will work, only when there is IPL.) 
- * 
+ * (This function will work, only when there is IPL.)
+ *
  * @param img         pointer to IplImage object.
  * @param lpYUV411    pointer to source image data.
  * @param packet_sz   the size of each packet.
@@ -550,43 +1106,15 @@ copy_YUV411toIplImage(IplImage* img, const void *lpYUV411,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_YUV411toIplImageGray(IplImage* img, const void *lpYUV411, 
-			  int packet_sz,
-			  int num_packet, int flag)
+copy_YUV411toIplImageGray(IplImage* img, const void *lpYUV411,
+			  int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)img->imageData;
-    UCHAR *p=(UCHAR*)lpYUV411;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (int i=0;i<packet_sz/(2*3);i++){      
-	    UCHAR Y; 
-	    p++;
-	    Y=*p++;
-	    //v=p[1]; // read v(K+0)      
-	    //conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+0)
-	    *dst++=Y;
-	    Y=*p++;
-	    //conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+1)
-	    *dst++=Y;
-	    p++;  // skip v(K+0)
-	    Y=*p++;
-	    //conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+2)
-	    *dst++=Y;
-	    Y=*p++;
-	    //conv_YUVtoRGB(&r,&g,&b,Y,u,v); // Y(K+3)
-	    *dst++=Y;
-	}
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } 
-    return true;
+    return convert_IplImage(FMT_YUV411, CONV_GRAY, img, lpYUV411,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert RGB888 to IplImage. 
+ * convert RGB888 to IplImage.
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
@@ -596,35 +1124,15 @@ copy_YUV411toIplImageGray(IplImage* img, const void *lpYUV411,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_RGB888toIplImage(IplImage* img, const void *lpRGB888, 
-		      int packet_sz,
-		      int num_packet, int flag)
+copy_RGB888toIplImage(IplImage* img, const void *lpRGB888,
+		      int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpRGB888;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/3;i++){
-	    unsigned char r=*p++;
-	    unsigned char g=*p++;
-	    unsigned char b=*p++;
-	    *dst++=b;
-	    *dst++=g;
-	    *dst++=r;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_RGB888, CONV_BGR, img, lpRGB888,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert RGB888 to IplImage. 
+ * convert RGB888 to IplImage(Gray).
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
@@ -634,68 +1142,29 @@ copy_RGB888toIplImage(IplImage* img, const void *lpRGB888,
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_RGB888toIplImageGray(IplImage* img, const void *lpRGB888, 
-			  int packet_sz,
-			  int num_packet, int flag)
+copy_RGB888toIplImageGray(IplImage* img, const void *lpRGB888,
+			  int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpRGB888;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/3;i++){
-	    unsigned char r=*p++;
-	    unsigned char g=*p++;
-	    unsigned char b=*p++;
-	    int gray = (r+g+b)/3;
-	    *dst++ = gray;
-	    *dst++ = gray;
-	    *dst++ = gray;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_RGB888, CONV_GRAY, img, lpRGB888,
+			    packet_sz, num_packet, flag);
 }
 
 /*
- * convert Y8 to IplImage. 
+ * convert Y8 to IplImage.
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
- * @param lpY8    pointer to source image data.
+ * @param lpY8        pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_Y8toIplImage(IplImage* img, const void *lpY8, 
-		      int packet_sz,
-		      int num_packet, int flag)
+copy_Y8toIplImage(IplImage* img, const void *lpY8,
+		  int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpY8;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz;i++){	    
-	    *dst++=*p;
-	    *dst++=*p;
-	    *dst++=*p;
-	    p++;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_Y8, CONV_BGR, img, lpY8,
+			    packet_sz, num_packet, flag);
 }
 
 /*
@@ -703,71 +1172,38 @@ copy_Y8toIplImage(IplImage* img, const void *lpY8,
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
- * @param lpY8   pointer to source image data.
+ * @param lpY8        pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
  */
 bool
-copy_Y8toIplImageGray(IplImage* img, const void *lpY8, 
-			  int packet_sz,
-			  int num_packet, int flag)
+copy_Y8toIplImageGray(IplImage* img, const void *lpY8,
+		      int packet_sz, int num_packet, int flag)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpY8;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz;i++){
-	    *dst++ = *p++;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_Y8, CONV_GRAY, img, lpY8,
+			    packet_sz, num_packet, flag);
 }
 
-
 /*
- * convert Y16 to IplImage. 
+ * convert Y16 to IplImage.
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
- * @param lpY16    pointer to source image data.
+ * @param lpY16       pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
+ *                    Y16_DEPTH() : the effective bit depth.
+ * @param lut         LUT made by CreateY16WindowMap(), or NULL.
  */
 bool
-copy_Y16toIplImage(IplImage* img, const void *lpY16, 
-		   int packet_sz,
-		   int num_packet, int flag)
+copy_Y16toIplImage(IplImage* img, const void *lpY16,
+		   int packet_sz, int num_packet, int flag,
+		   const UCHAR* lut)
 {
-    uchar *dst = (uchar*)(img->imageData);
-
-    UCHAR *p=(UCHAR*)lpY16;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/2;i++){
-	    *dst++ = *p;
-	    *dst++ = *p;
-	    *dst++ = *p;
-	    p++;
-	    // ignore lower byte:
-	    p++;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p+=4*2;
-    } //   while (num_packet-->0) {
-    return true;
+    return convert_IplImage(FMT_Y16, CONV_BGR, img, lpY16,
+			    packet_sz, num_packet, flag, lut);
 }
 
 /*
@@ -775,35 +1211,344 @@ copy_Y16toIplImage(IplImage* img, const void *lpY16,
  * (This function will work, only when there is IPL.)
  *
  * @param img         pointer to IplImage object.
- * @param lpY16   pointer to source image data.
+ * @param lpY16       pointer to source image data.
  * @param packet_sz   the size of each packet.
  * @param num_packet  the number of packets per one image.
  * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
+ *                    Y16_DEPTH() : the effective bit depth.
+ * @param lut         LUT made by CreateY16WindowMap(), or NULL.
  */
 bool
-copy_Y16toIplImageGray(IplImage* img, const void *lpY16, 
-		       int packet_sz,
-		       int num_packet, int flag)
+copy_Y16toIplImageGray(IplImage* img, const void *lpY16,
+		       int packet_sz, int num_packet, int flag,
+		       const UCHAR* lut)
 {
-    uchar *dst = (uchar*)(img->imageData);
-    
-    UCHAR *p=(UCHAR*)lpY16;
-    int i;
-    if (flag&REMOVE_HEADER){
-	packet_sz-=8;
-	p+=4;
-    }
-    while (num_packet-->0){
-	for (i=0;i<packet_sz/2;i++){
-	    *dst++ = *p++;
-	    p++;
-	} //     for (i=0;i<packet_sz/4;i++){
-	if (flag&REMOVE_HEADER)
-	    p += 4*2;
-    } //   while (num_packet-->0) {
+    return convert_IplImage(FMT_Y16, CONV_GRAY, img, lpY16,
+			    packet_sz, num_packet, flag, lut);
+}
+
+/*
+ * convert Y16 to IplImage of IPL_DEPTH_16U (Gray).
+ * (This function will work, only when there is IPL.)
+ *
+ * The pixels are just swapped to the host byte order.
+ *
+ * @param img         pointer to IplImage object.
+ * @param lpY16       pointer to source image data.
+ * @param packet_sz   the size of each packet.
+ * @param num_packet  the number of packets per one image.
+ * @param flag        REMOVE_HEADER : remove packet's  header/trailer.
+ */
+bool
+copy_Y16toIplImage16(IplImage* img, const void *lpY16,
+		     int packet_sz, int num_packet, int flag)
+{
+    if (IPL_DEPTH_16U != img->depth || 1 != img->nChannels)
+	return false;
+    return convert_IplImage(FMT_Y16, CONV_Y16, img, lpY16,
+			    packet_sz, num_packet, flag);
+}
+
+/*
+ * the layout of each format: Y,u,v for YUV, r,g,b for RGB888 and Y
+ * for Y8/Y16. The rows may be bytes or the sums of bytes.
+ */
+template <int FMT> struct Pixel;
+
+template <> struct Pixel<FMT_YUV411> {
+    enum { BYTES_PER_2PIXELS = 3, CHROMA_STEP = 4, YUV = 1 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	const T *p = row + (x>>2)*6;   // u Y Y v Y Y
+	*a = p[(x&3) + ((x&2)>>1) + 1];
+	*b = p[0];
+	*c = p[3];
+    }
+};
+
+template <> struct Pixel<FMT_YUV422> {
+    enum { BYTES_PER_2PIXELS = 4, CHROMA_STEP = 2, YUV = 1 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	const T *p = row + (x>>1)*4;   // u Y v Y
+	*a = p[1 + 2*(x&1)];
+	*b = p[0];
+	*c = p[2];
+    }
+};
+
+template <> struct Pixel<FMT_YUV444> {
+    enum { BYTES_PER_2PIXELS = 6, CHROMA_STEP = 1, YUV = 1 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	const T *p = row + x*3;        // u Y v
+	*a = p[1];
+	*b = p[0];
+	*c = p[2];
+    }
+};
+
+template <> struct Pixel<FMT_RGB888> {
+    enum { BYTES_PER_2PIXELS = 6, CHROMA_STEP = 1, YUV = 0 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	const T *p = row + x*3;
+	*a = p[0];
+	*b = p[1];
+	*c = p[2];
+    }
+};
+
+template <> struct Pixel<FMT_Y8> {
+    enum { BYTES_PER_2PIXELS = 2, CHROMA_STEP = 1, YUV = 0 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	*a = *b = *c = row[x];
+    }
+};
+
+// the rows are reduced to 8bit by source_row() first.
+template <> struct Pixel<FMT_Y16> {
+    enum { BYTES_PER_2PIXELS = 2, CHROMA_STEP = 1, YUV = 0 };
+    template <class T> static inline void
+    get(const T* row, int x, int* a, int* b, int* c) {
+	*a = *b = *c = row[x];
+    }
+};
+
+/*
+ * returns the row y to be scaled. Y16 is reduced to 8bit into y8, by
+ * the LUT if any, or by the depth in flag.
+ */
+template <int FMT> static inline const UCHAR*
+source_row(const UCHAR* frame, int y, int width, int row_bytes,
+	   int packet_sz, int flag, const UCHAR* lut, UCHAR* tmp, UCHAR* y8)
+{
+    if (FMT_Y16 != FMT)
+	return get_frame_row(frame, y, row_bytes, packet_sz, flag, tmp);
+    const UCHAR *p = get_frame_row(frame, y, width*2, packet_sz, flag, tmp);
+    conv_Y16to8(y8, p, width, flag, lut);
+    return y8;
+}
+
+/*
+ * the rounded mean of a sum of 'area' pixels, by the reciprocal of
+ * 40bit fraction, which is exact for the sums of 8bit pixels up to
+ * 256x256 of them.
+ */
+static inline int
+box_mean(int sum, int area, uint64_t recip)
+{
+    return (int)(((uint64_t)(sum + area/2) * recip) >> 40);
+}
+
+/*
+ * converts the rows [first, first+count) of the downscaled image.
+ *
+ * Each output row is made from one source row (nearest) or from the
+ * sum of 'factor' source rows (box). For YUV to BGR, the output row
+ * is packed as YUV422 and converted by the YUV422 kernel.
+ */
+template <int FMT> static void
+scale_rows(const ImageDesc* img, const UCHAR* frame, int width, int packet_sz,
+	   int flag, int factor, bool gray, const UCHAR* lut,
+	   int first, int count)
+{
+    typedef Pixel<FMT> P;
+    const int row_bytes = width * P::BYTES_PER_2PIXELS / 2;
+    const int out_w = width / factor;
+    const bool box = (flag&SCALE_BOX) && factor > 1;
+    const bool yuv = P::YUV && !gray;
+    const int cs = P::CHROMA_STEP;
+    const int area = factor * factor;
+    const uint64_t recip = (((uint64_t)1<<40) + area - 1) / area;
+
+    std::vector<UCHAR> tmp((FMT_Y16 == FMT) ? width * 2 : row_bytes);
+    std::vector<UCHAR> y8((FMT_Y16 == FMT) ? width : 0);
+    UCHAR *p8 = y8.empty() ? NULL : &y8[0];
+    std::vector<UCHAR> line(yuv ? (out_w + 1) * 2 : 0);
+    std::vector<unsigned short> sum(box ? row_bytes : 0);
+
+    for (int oy=first; oy<first+count; oy++){
+	UCHAR *dst = img->data + (size_t)oy * img->step;
+	const UCHAR *row = NULL;
+	if (box){
+	    std::fill(sum.begin(), sum.end(), 0);
+	    for (int sy=oy*factor; sy<(oy+1)*factor; sy++){
+		add_row_simd(&sum[0],
+			     source_row<FMT>(frame, sy, width, row_bytes,
+					     packet_sz, flag, lut, &tmp[0], p8),
+			     row_bytes);
+	    }
+	} else {
+	    row = source_row<FMT>(frame, oy*factor, width, row_bytes,
+				  packet_sz, flag, lut, &tmp[0], p8);
+	}
+
+	if (yuv){
+	    // u Y v Y; a pair of output pixels shares u,v.
+	    for (int ox=0; ox<out_w; ox+=2){
+		UCHAR *p = &line[ox*2];
+		int a, b, c;
+		int x0 = ox*factor;
+		if (!box){
+		    P::get(row, x0, &a, &b, &c);
+		    p[0] = b;
+		    p[1] = a;
+		    p[2] = c;
+		    if (ox+1 < out_w)
+			P::get(row, x0 + factor, &a, &b, &c);
+		    p[3] = a;
+		    continue;
+		}
+		for (int k=0; k<2; k++){
+		    int sa = 0;
+		    for (int i=0; i<factor; i++){
+			P::get(&sum[0], x0 + k*factor + i, &a, &b, &c);
+			sa += a;
+		    }
+		    p[1 + 2*k] = box_mean(sa, area, recip);
+		    if (ox+1 >= out_w){
+			p[3] = p[1];
+			break;
+		    }
+		}
+		// u,v are read once per group of pixels sharing them.
+		int sb = 0, sc = 0, n = 0;
+		int x1 = x0 + ((ox+1 < out_w) ? 2 : 1)*factor;
+		for (int x=x0 - x0%cs; x<x1; x+=cs){
+		    P::get(&sum[0], x, &a, &b, &c);
+		    sb += b;
+		    sc += c;
+		    n++;
+		}
+		n *= factor;
+		p[0] = (sb + n/2) / n;
+		p[2] = (sc + n/2) / n;
+	    }
+
+	    const UCHAR *p = &line[0];
+	    int n = conv_YUV422toBGR_simd(dst, p, out_w);
+	    for (dst+=n*3; n<out_w; n++){
+		const UCHAR *q = p + (n>>1)*4;
+		conv_YUVtoRGB(&dst[2], &dst[1], &dst[0], q[1 + 2*(n&1)], q[0], q[2]);
+		dst += 3;
+	    }
+	    continue;
+	}
+
+	for (int ox=0; ox<out_w; ox++){
+	    int a, b, c;
+	    int x0 = ox*factor;
+	    if (!box){
+		P::get(row, x0, &a, &b, &c);
+	    } else {
+		int sa = 0, sb = 0, sc = 0;
+		for (int i=0; i<factor; i++){
+		    P::get(&sum[0], x0 + i, &a, &b, &c);
+		    sa += a;
+		    sb += b;
+		    sc += c;
+		}
+		a = box_mean(sa, area, recip);
+		b = box_mean(sb, area, recip);
+		c = box_mean(sc, area, recip);
+	    }
+	    if (gray){
+		*dst++ = (FMT == FMT_RGB888) ? (a+b+c)/3 : a;
+	    } else if (FMT == FMT_RGB888){
+		*dst++ = c;
+		*dst++ = b;
+		*dst++ = a;
+	    } else {
+		*dst++ = a;
+		*dst++ = a;
+		*dst++ = a;
+	    }
+	}
+    }
+}
+
+static bool
+scale_frame(IplImage* img, const void* frame, int width, int height,
+	    int packet_sz, int flag, int factor, bool gray, const UCHAR* lut,
+	    int first_row, int num_rows)
+{
+    if (factor < 1 || 256 < factor)   // the box filter sums in 16bit
+	return false;
+    const int out_h = height / factor;
+    ImageDesc desc;
+    if (img->nChannels != (gray ? 1 : 3) || img->depth != IPL_DEPTH_8U ||
+	!GetIplImageDesc(&desc, img) ||
+	desc.width < width / factor || desc.height < out_h)
+	return false;
+    if (num_rows < 0 || first_row + num_rows > out_h)
+	num_rows = out_h - first_row;
+
+    const UCHAR *p = (const UCHAR*)frame;
+    switch (flag & FMT_MASK){
+#define CASE(fmt)							\
+    case fmt:								\
+	scale_rows<fmt>(&desc, p, width, packet_sz, flag, factor, gray,	\
+			lut, first_row, num_rows);			\
+	break
+	CASE(FMT_YUV411);
+	CASE(FMT_YUV422);
+	CASE(FMT_YUV444);
+	CASE(FMT_RGB888);
+	CASE(FMT_Y8);
+	CASE(FMT_Y16);
+#undef CASE
+    default:
+	return false;
+    }
     return true;
 }
 
+/*
+ * convert a frame to a downscaled IplImage (BGR).
+ * (This function will work, only when there is IPL.)
+ *
+ * Only the pixels needed are read and converted. With SCALE_BOX, the
+ * average of factor x factor pixels is converted; otherwise the top
+ * left pixel of them is.
+ *
+ * @param img         pointer to IplImage object of width/factor x height/factor.
+ * @param frame       pointer to source image data.
+ * @param width       the width of the frame.
+ * @param height      the height of the frame.
+ * @param packet_sz   the size of each packet.
+ * @param flag        FMT_* | REMOVE_HEADER | SCALE_BOX | Y16_DEPTH()
+ * @param factor      decimation factor, e.g. 2, 4 or 8.
+ * @param lut         LUT of Y16 made by CreateY16WindowMap(), or NULL.
+ * @param first_row   the first row of img to store.
+ * @param num_rows    the number of rows to store, or -1 for all.
+ */
+bool
+copy_toIplImageScaled(IplImage* img, const void* frame, int width, int height,
+		      int packet_sz, int flag, int factor, const UCHAR* lut,
+		      int first_row, int num_rows)
+{
+    return scale_frame(img, frame, width, height, packet_sz, flag,
+		       factor, false, lut, first_row, num_rows);
+}
+
+/*
+ * convert a frame to a downscaled IplImage (Gray).
+ * (This function will work, only when there is IPL.)
+ *
+ * @sa copy_toIplImageScaled()
+ */
+bool
+copy_toIplImageGrayScaled(IplImage* img, const void* frame,
+			  int width, int height,
+			  int packet_sz, int flag, int factor,
+			  const UCHAR* lut, int first_row, int num_rows)
+{
+    return scale_frame(img, frame, width, height, packet_sz, flag,
+		       factor, true, lut, first_row, num_rows);
+}
+
 #endif // #ifdef IPL_IMG_SUPPORTED
 
 
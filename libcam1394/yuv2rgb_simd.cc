@@ -0,0 +1,916 @@
+/*!
+  @file  yuv2rgb_simd.cc
+  @brief convert YUV422 to RGBA/BGR and demosaic with SSE2 or AVX2
+  @author  YOSHIMOTO,Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+
+#if defined HAVE_SIMD && defined HAVE_IMMINTRIN_H && defined __GNUC__ \
+    && (defined __i386__ || defined __x86_64__)
+#define X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "yuv_simd.h"
+
+/*
+ * The kernels use the same fixed point coefficients as the scalar
+ * tables in yuv2rgb.cc (FLOAT2FIX() of each factor, FIX_BASE=10), but
+ * multiply instead of looking up. Since the tables round each term
+ * separately, the results may differ by one.
+ *
+ * UYVY is loaded as 16bit words: the upper bytes are Y and the lower
+ * bytes are u,v,u,v,... Each term is computed in 32bit with madd, and
+ * packed back to 16bit words of R, G and B.
+ */
+enum {
+    COEF_Y  = 1191,	// 1.164
+    COEF_RV = 1634,	// 1.596
+    COEF_GV = -832,	// -0.813
+    COEF_GU = -400,	// -0.391
+    COEF_BU = 2066,	// 2.018
+    SHIFT   = 10,
+};
+
+static int
+rgba_none(RGBA*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+bgr_none(UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static void
+add_row_none(unsigned short* sum, const UCHAR* row, int n)
+{
+    for (int i=0; i<n; i++)
+	sum[i] += row[i];
+}
+
+static int
+y16to8_none(UCHAR*, const UCHAR*, int, int)
+{
+    return 0;
+}
+
+static int
+y16swap_none(unsigned short*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+uyvy_split_none(UCHAR*, UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+uv_split_none(UCHAR*, UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+avg_row_none(UCHAR*, const UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+bilinear_none(UCHAR*, UCHAR*, UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*,
+	      int, int)
+{
+    return 0;
+}
+
+static int
+green_none(UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*,
+	   const UCHAR*, int, int)
+{
+    return 0;
+}
+
+static int
+chroma_none(UCHAR*, UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*,
+	    const UCHAR*, const UCHAR*, const UCHAR*, int, int)
+{
+    return 0;
+}
+
+static int
+half_none(UCHAR*, UCHAR*, UCHAR*, const UCHAR*, const UCHAR*, int, int)
+{
+    return 0;
+}
+
+static int
+planar_bgr_none(UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+static int
+planar_rgba_none(RGBA*, const UCHAR*, const UCHAR*, const UCHAR*, int)
+{
+    return 0;
+}
+
+#ifdef X86_SIMD
+
+#define PAIR16(a,b)  _mm_setr_epi16(a,b,a,b,a,b,a,b)
+#define PAIR16_256(a,b)  _mm256_setr_epi16(a,b,a,b,a,b,a,b,a,b,a,b,a,b,a,b)
+
+/*
+ * converts 8 pixels (16 bytes) of UYVY to 16bit R, G and B.
+ */
+static inline TARGET_SSE2 void
+sse2_block(__m128i x, __m128i* r, __m128i* g, __m128i* b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i y  = _mm_subs_epu16(_mm_srli_epi16(x, 8), _mm_set1_epi16(16));
+    __m128i uv = _mm_sub_epi16(_mm_and_si128(x, _mm_set1_epi16(0xff)),
+			       _mm_set1_epi16(128));
+
+    __m128i yl = _mm_madd_epi16(_mm_unpacklo_epi16(y, zero), PAIR16(COEF_Y,0));
+    __m128i yh = _mm_madd_epi16(_mm_unpackhi_epi16(y, zero), PAIR16(COEF_Y,0));
+
+    // the chroma terms of each pair of pixels.
+    __m128i rc = _mm_madd_epi16(uv, PAIR16(0, COEF_RV));
+    __m128i gc = _mm_madd_epi16(uv, PAIR16(COEF_GU, COEF_GV));
+    __m128i bc = _mm_madd_epi16(uv, PAIR16(COEF_BU, 0));
+
+#define CHANNEL(c)							\
+    _mm_packs_epi32(							\
+	_mm_srai_epi32(_mm_add_epi32(yl, _mm_unpacklo_epi32(c, c)), SHIFT), \
+	_mm_srai_epi32(_mm_add_epi32(yh, _mm_unpackhi_epi32(c, c)), SHIFT))
+
+    const __m128i max = _mm_set1_epi16(255);
+    *r = _mm_min_epi16(_mm_max_epi16(CHANNEL(rc), zero), max);
+    *g = _mm_min_epi16(_mm_max_epi16(CHANNEL(gc), zero), max);
+    *b = _mm_min_epi16(_mm_max_epi16(CHANNEL(bc), zero), max);
+#undef CHANNEL
+}
+
+/*
+ * stores 4 pixels of 0x00RRGGBB as 12 bytes of BGR.
+ * 2 bytes after them are overwritten.
+ */
+static inline TARGET_SSE2 void
+sse2_store_bgr(UCHAR* dst, __m128i q)
+{
+    __m128i lo = _mm_and_si128(q, _mm_setr_epi32(-1, 0, -1, 0));
+    __m128i hi = _mm_and_si128(q, _mm_setr_epi32(0, -1, 0, -1));
+    q = _mm_or_si128(lo, _mm_srli_epi64(hi, 8));
+    _mm_storel_epi64((__m128i*)dst, q);
+    _mm_storel_epi64((__m128i*)(dst + 6), _mm_srli_si128(q, 8));
+}
+
+static TARGET_SSE2 int
+rgba_sse2(RGBA* dst, const UCHAR* src, int n)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	for (int k=0; k<2; k++){
+	    __m128i r, g, b;
+	    sse2_block(_mm_loadu_si128((const __m128i*)(src + 16*k)), &r, &g, &b);
+	    __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+	    __m128i *d = (__m128i*)(dst + 8*k);
+	    // the alpha components are left as they are.
+	    __m128i p0 = _mm_or_si128(_mm_unpacklo_epi16(rg, b),
+				      _mm_and_si128(_mm_loadu_si128(d), alpha));
+	    __m128i p1 = _mm_or_si128(_mm_unpackhi_epi16(rg, b),
+				      _mm_and_si128(_mm_loadu_si128(d + 1), alpha));
+	    _mm_storeu_si128(d, p0);
+	    _mm_storeu_si128(d + 1, p1);
+	}
+	src += 32;
+	dst += 16;
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+bgr_sse2(UCHAR* dst, const UCHAR* src, int n)
+{
+    int i;
+    // the last pixels are left to the caller, since the stores overrun.
+    for (i=0; i+16<n; i+=16){
+	for (int k=0; k<2; k++){
+	    __m128i r, g, b;
+	    sse2_block(_mm_loadu_si128((const __m128i*)(src + 16*k)), &r, &g, &b);
+	    __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	    sse2_store_bgr(dst + 24*k,      _mm_unpacklo_epi16(bg, r));
+	    sse2_store_bgr(dst + 24*k + 12, _mm_unpackhi_epi16(bg, r));
+	}
+	src += 32;
+	dst += 48;
+    }
+    return i;
+}
+
+static TARGET_SSE2 void
+add_row_sse2(unsigned short* sum, const UCHAR* row, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+	__m128i *s = (__m128i*)(sum + i);
+	_mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s),
+					  _mm_unpacklo_epi8(x, zero)));
+	_mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1),
+					      _mm_unpackhi_epi8(x, zero)));
+    }
+    add_row_none(sum + i, row + i, n - i);
+}
+
+/*
+ * Y16 is big endian; the bytes of each word are swapped first.
+ * min(x, 255) is x - subs(x, 255), since SSE2 has no unsigned min of
+ * 16bit words.
+ */
+static TARGET_SSE2 int
+y16to8_sse2(UCHAR* dst, const UCHAR* src, int n, int shift)
+{
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i x[2];
+	for (int k=0; k<2; k++){
+	    __m128i v = _mm_loadu_si128((const __m128i*)(src + 2*i + 16*k));
+	    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	    v = _mm_srl_epi16(v, count);
+	    x[k] = _mm_sub_epi16(v, _mm_subs_epu16(v, max));
+	}
+	_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(x[0], x[1]));
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+y16swap_sse2(unsigned short* dst, const UCHAR* src, int n)
+{
+    int i;
+    for (i=0; i+8<=n; i+=8){
+	__m128i v = _mm_loadu_si128((const __m128i*)(src + 2*i));
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	_mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+    return i;
+}
+
+static TARGET_AVX2 int
+y16to8_avx2(UCHAR* dst, const UCHAR* src, int n, int shift)
+{
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int i;
+    for (i=0; i+32<=n; i+=32){
+	__m256i x[2];
+	for (int k=0; k<2; k++){
+	    __m256i v = _mm256_loadu_si256((const __m256i*)(src + 2*i + 32*k));
+	    v = _mm256_or_si256(_mm256_slli_epi16(v, 8),
+				_mm256_srli_epi16(v, 8));
+	    v = _mm256_srl_epi16(v, count);
+	    x[k] = _mm256_min_epu16(v, max);
+	}
+	// packus works in each lane; put the quadwords back in order.
+	__m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(x[0], x[1]),
+					     0xd8);
+	_mm256_storeu_si256((__m256i*)(dst + i), p);
+    }
+    return i;
+}
+
+static TARGET_AVX2 int
+y16swap_avx2(unsigned short* dst, const UCHAR* src, int n)
+{
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m256i v = _mm256_loadu_si256((const __m256i*)(src + 2*i));
+	v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+	_mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+    return i;
+}
+
+/*
+ * converts 16 pixels (32 bytes) of UYVY to 16bit R, G and B.
+ * Same as sse2_block(); all operations stay in each 128bit lane.
+ */
+static inline TARGET_AVX2 void
+avx2_block(__m256i x, __m256i* r, __m256i* g, __m256i* b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i y  = _mm256_subs_epu16(_mm256_srli_epi16(x, 8),
+				   _mm256_set1_epi16(16));
+    __m256i uv = _mm256_sub_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0xff)),
+				  _mm256_set1_epi16(128));
+
+    __m256i yl = _mm256_madd_epi16(_mm256_unpacklo_epi16(y, zero),
+				   PAIR16_256(COEF_Y,0));
+    __m256i yh = _mm256_madd_epi16(_mm256_unpackhi_epi16(y, zero),
+				   PAIR16_256(COEF_Y,0));
+
+    __m256i rc = _mm256_madd_epi16(uv, PAIR16_256(0, COEF_RV));
+    __m256i gc = _mm256_madd_epi16(uv, PAIR16_256(COEF_GU, COEF_GV));
+    __m256i bc = _mm256_madd_epi16(uv, PAIR16_256(COEF_BU, 0));
+
+#define CHANNEL(c)							\
+    _mm256_packs_epi32(							\
+	_mm256_srai_epi32(_mm256_add_epi32(yl, _mm256_unpacklo_epi32(c, c)), \
+			  SHIFT),					\
+	_mm256_srai_epi32(_mm256_add_epi32(yh, _mm256_unpackhi_epi32(c, c)), \
+			  SHIFT))
+
+    const __m256i max = _mm256_set1_epi16(255);
+    *r = _mm256_min_epi16(_mm256_max_epi16(CHANNEL(rc), zero), max);
+    *g = _mm256_min_epi16(_mm256_max_epi16(CHANNEL(gc), zero), max);
+    *b = _mm256_min_epi16(_mm256_max_epi16(CHANNEL(bc), zero), max);
+#undef CHANNEL
+}
+
+static TARGET_AVX2 int
+rgba_avx2(RGBA* dst, const UCHAR* src, int n)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    int i;
+    for (i=0; i+32<=n; i+=32){
+	for (int k=0; k<2; k++){
+	    __m256i r, g, b;
+	    avx2_block(_mm256_loadu_si256((const __m256i*)(src + 32*k)),
+		       &r, &g, &b);
+	    __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+	    __m256i lo = _mm256_unpacklo_epi16(rg, b); // 0-3, 8-11
+	    __m256i hi = _mm256_unpackhi_epi16(rg, b); // 4-7, 12-15
+	    __m256i *d = (__m256i*)(dst + 16*k);
+	    __m256i p0 = _mm256_or_si256(_mm256_permute2x128_si256(lo, hi, 0x20),
+					 _mm256_and_si256(_mm256_loadu_si256(d),
+							  alpha));
+	    __m256i p1 = _mm256_or_si256(_mm256_permute2x128_si256(lo, hi, 0x31),
+					 _mm256_and_si256(_mm256_loadu_si256(d + 1),
+							  alpha));
+	    _mm256_storeu_si256(d, p0);
+	    _mm256_storeu_si256(d + 1, p1);
+	}
+	src += 64;
+	dst += 32;
+    }
+    return i;
+}
+
+static TARGET_AVX2 int
+bgr_avx2(UCHAR* dst, const UCHAR* src, int n)
+{
+    const __m256i pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,
+					  -1,-1,-1,-1,
+					  0,1,2,4,5,6,8,9,10,12,13,14,
+					  -1,-1,-1,-1);
+    int i;
+    // the last pixels are left to the caller, since the stores overrun.
+    for (i=0; i+32<n; i+=32){
+	for (int k=0; k<2; k++){
+	    __m256i r, g, b;
+	    avx2_block(_mm256_loadu_si256((const __m256i*)(src + 32*k)),
+		       &r, &g, &b);
+	    __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	    __m256i lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(bg, r), pack);
+	    __m256i hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(bg, r), pack);
+	    UCHAR *d = dst + 48*k;
+	    _mm_storeu_si128((__m128i*)(d),      _mm256_castsi256_si128(lo));
+	    _mm_storeu_si128((__m128i*)(d + 12), _mm256_castsi256_si128(hi));
+	    _mm_storeu_si128((__m128i*)(d + 24), _mm256_extracti128_si256(lo, 1));
+	    _mm_storeu_si128((__m128i*)(d + 36), _mm256_extracti128_si256(hi, 1));
+	}
+	src += 64;
+	dst += 96;
+    }
+    return i;
+}
+
+/*
+ * The planar kernels only move bytes: the even and the odd bytes are
+ * split by masking/shifting the words and packing them.
+ */
+static TARGET_SSE2 int
+uyvy_split_sse2(UCHAR* y, UCHAR* uv, const UCHAR* src, int n)
+{
+    const __m128i lo = _mm_set1_epi16(0xff);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i a = _mm_loadu_si128((const __m128i*)(src + 2*i));
+	__m128i b = _mm_loadu_si128((const __m128i*)(src + 2*i + 16));
+	_mm_storeu_si128((__m128i*)(y + i),
+			 _mm_packus_epi16(_mm_srli_epi16(a, 8),
+					  _mm_srli_epi16(b, 8)));
+	_mm_storeu_si128((__m128i*)(uv + i),
+			 _mm_packus_epi16(_mm_and_si128(a, lo),
+					  _mm_and_si128(b, lo)));
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+uv_split_sse2(UCHAR* u, UCHAR* v, const UCHAR* uv, int n)
+{
+    const __m128i lo = _mm_set1_epi16(0xff);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i a = _mm_loadu_si128((const __m128i*)(uv + 2*i));
+	__m128i b = _mm_loadu_si128((const __m128i*)(uv + 2*i + 16));
+	_mm_storeu_si128((__m128i*)(u + i),
+			 _mm_packus_epi16(_mm_and_si128(a, lo),
+					  _mm_and_si128(b, lo)));
+	_mm_storeu_si128((__m128i*)(v + i),
+			 _mm_packus_epi16(_mm_srli_epi16(a, 8),
+					  _mm_srli_epi16(b, 8)));
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+avg_row_sse2(UCHAR* dst, const UCHAR* a, const UCHAR* b, int n)
+{
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i x = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + i)),
+				 _mm_loadu_si128((const __m128i*)(b + i)));
+	_mm_storeu_si128((__m128i*)(dst + i), x);
+    }
+    return i;
+}
+
+/*
+ * The Bayer kernels use SSE2 only; they are bound by the memory
+ * rather than by the arithmetic.
+ *
+ * A mask selects the pixels of the row's own color: the even bytes
+ * if the row starts with it, the odd bytes otherwise.
+ */
+#define LOADU(p)  _mm_loadu_si128((const __m128i*)(p))
+
+static inline TARGET_SSE2 __m128i
+sse2_blend(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// loads 8 bytes as 16bit words.
+static inline TARGET_SSE2 __m128i
+sse2_load8(const UCHAR* p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p),
+			     _mm_setzero_si128());
+}
+
+static inline TARGET_SSE2 __m128i
+sse2_abs16(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static TARGET_SSE2 int
+bilinear_sse2(UCHAR* own, UCHAR* g, UCHAR* other,
+	      const UCHAR* u, const UCHAR* c, const UCHAR* d, int n, int gf)
+{
+    const __m128i mask = _mm_set1_epi16(gf ? (short)0xff00 : 0x00ff);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i cc = LOADU(c + i);
+	__m128i h = _mm_avg_epu8(LOADU(c + i - 1), LOADU(c + i + 1));
+	__m128i v = _mm_avg_epu8(LOADU(u + i), LOADU(d + i));
+	__m128i x = _mm_avg_epu8(_mm_avg_epu8(LOADU(u + i - 1), LOADU(u + i + 1)),
+				 _mm_avg_epu8(LOADU(d + i - 1), LOADU(d + i + 1)));
+	__m128i p = _mm_avg_epu8(h, v);
+	_mm_storeu_si128((__m128i*)(own + i),   sse2_blend(mask, cc, h));
+	_mm_storeu_si128((__m128i*)(g + i),     sse2_blend(mask, p, cc));
+	_mm_storeu_si128((__m128i*)(other + i), sse2_blend(mask, x, v));
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+green_sse2(UCHAR* g, const UCHAR* uu, const UCHAR* u, const UCHAR* c,
+	   const UCHAR* d, const UCHAR* dd, int n, int gf)
+{
+    const __m128i mask = gf ? _mm_setr_epi16(0,-1,0,-1,0,-1,0,-1)
+	: _mm_setr_epi16(-1,0,-1,0,-1,0,-1,0);
+    int i;
+    for (i=0; i+8<=n; i+=8){
+	__m128i cc = sse2_load8(c + i);
+	__m128i cl = sse2_load8(c + i - 1);
+	__m128i cr = sse2_load8(c + i + 1);
+	__m128i uc = sse2_load8(u + i);
+	__m128i dc = sse2_load8(d + i);
+	__m128i c2 = _mm_add_epi16(cc, cc);
+	__m128i lh = _mm_sub_epi16(c2, _mm_add_epi16(sse2_load8(c + i - 2),
+						     sse2_load8(c + i + 2)));
+	__m128i lv = _mm_sub_epi16(c2, _mm_add_epi16(sse2_load8(uu + i),
+						     sse2_load8(dd + i)));
+	__m128i gh = _mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(cl, cr), 1), lh);
+	__m128i gv = _mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(uc, dc), 1), lv);
+	__m128i dh = _mm_add_epi16(sse2_abs16(_mm_sub_epi16(cl, cr)),
+				   sse2_abs16(lh));
+	__m128i dv = _mm_add_epi16(sse2_abs16(_mm_sub_epi16(uc, dc)),
+				   sse2_abs16(lv));
+	__m128i s = _mm_add_epi16(gh, gv);
+	s = sse2_blend(_mm_cmplt_epi16(dh, dv), _mm_add_epi16(gh, gh), s);
+	s = sse2_blend(_mm_cmpgt_epi16(dh, dv), _mm_add_epi16(gv, gv), s);
+	s = _mm_srai_epi16(_mm_add_epi16(s, _mm_set1_epi16(4)), 3);
+	s = sse2_blend(mask, s, cc);
+	_mm_storel_epi64((__m128i*)(g + i), _mm_packus_epi16(s, s));
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+chroma_sse2(UCHAR* own, UCHAR* other,
+	    const UCHAR* gu, const UCHAR* gc, const UCHAR* gd,
+	    const UCHAR* u, const UCHAR* c, const UCHAR* d, int n, int gf)
+{
+    const __m128i mask = gf ? _mm_setr_epi16(0,-1,0,-1,0,-1,0,-1)
+	: _mm_setr_epi16(-1,0,-1,0,-1,0,-1,0);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+    int i;
+#define DIFF(p, q, k)  _mm_sub_epi16(sse2_load8((p) + i + (k)),	\
+				     sse2_load8((q) + i + (k)))
+    for (i=0; i+8<=n; i+=8){
+	__m128i gg = sse2_load8(gc + i);
+	__m128i h = _mm_add_epi16(DIFF(c, gc, -1), DIFF(c, gc, 1));
+	__m128i v = _mm_add_epi16(DIFF(u, gu, 0), DIFF(d, gd, 0));
+	__m128i x = _mm_add_epi16(_mm_add_epi16(DIFF(u, gu, -1), DIFF(u, gu, 1)),
+				  _mm_add_epi16(DIFF(d, gd, -1), DIFF(d, gd, 1)));
+	h = _mm_add_epi16(gg, _mm_srai_epi16(_mm_add_epi16(h, one), 1));
+	v = _mm_add_epi16(gg, _mm_srai_epi16(_mm_add_epi16(v, one), 1));
+	x = _mm_add_epi16(gg, _mm_srai_epi16(_mm_add_epi16(x, two), 2));
+	__m128i o = sse2_blend(mask, sse2_load8(c + i), h);
+	__m128i t = sse2_blend(mask, x, v);
+	_mm_storel_epi64((__m128i*)(own + i),   _mm_packus_epi16(o, o));
+	_mm_storel_epi64((__m128i*)(other + i), _mm_packus_epi16(t, t));
+    }
+#undef DIFF
+    return i;
+}
+
+static TARGET_SSE2 int
+half_sse2(UCHAR* own, UCHAR* g, UCHAR* other,
+	  const UCHAR* t, const UCHAR* b, int n, int gf)
+{
+    const __m128i lo = _mm_set1_epi16(0xff);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i t0 = LOADU(t + 2*i), t1 = LOADU(t + 2*i + 16);
+	__m128i b0 = LOADU(b + 2*i), b1 = LOADU(b + 2*i + 16);
+	// the even and the odd pixels of the rows.
+	__m128i te = _mm_packus_epi16(_mm_and_si128(t0, lo),
+				      _mm_and_si128(t1, lo));
+	__m128i to = _mm_packus_epi16(_mm_srli_epi16(t0, 8),
+				      _mm_srli_epi16(t1, 8));
+	__m128i be = _mm_packus_epi16(_mm_and_si128(b0, lo),
+				      _mm_and_si128(b1, lo));
+	__m128i bo = _mm_packus_epi16(_mm_srli_epi16(b0, 8),
+				      _mm_srli_epi16(b1, 8));
+	if (gf){
+	    __m128i x = te;
+	    te = to;
+	    to = x;
+	    x = be;
+	    be = bo;
+	    bo = x;
+	}
+	_mm_storeu_si128((__m128i*)(own + i),   te);
+	_mm_storeu_si128((__m128i*)(g + i),     _mm_avg_epu8(to, be));
+	_mm_storeu_si128((__m128i*)(other + i), bo);
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+planar_bgr_sse2(UCHAR* dst, const UCHAR* r, const UCHAR* g, const UCHAR* b,
+		int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+    // the last pixels are left to the caller, since the stores overrun.
+    for (i=0; i+16<n; i+=16){
+	__m128i rr = LOADU(r + i);
+	__m128i bg = _mm_unpacklo_epi8(LOADU(b + i), LOADU(g + i));
+	__m128i r0 = _mm_unpacklo_epi8(rr, zero);
+	sse2_store_bgr(dst,      _mm_unpacklo_epi16(bg, r0));
+	sse2_store_bgr(dst + 12, _mm_unpackhi_epi16(bg, r0));
+	bg = _mm_unpackhi_epi8(LOADU(b + i), LOADU(g + i));
+	r0 = _mm_unpackhi_epi8(rr, zero);
+	sse2_store_bgr(dst + 24, _mm_unpacklo_epi16(bg, r0));
+	sse2_store_bgr(dst + 36, _mm_unpackhi_epi16(bg, r0));
+	dst += 48;
+    }
+    return i;
+}
+
+static TARGET_SSE2 int
+planar_rgba_sse2(RGBA* dst, const UCHAR* r, const UCHAR* g, const UCHAR* b,
+		 int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i;
+    for (i=0; i+16<=n; i+=16){
+	__m128i rr = LOADU(r + i);
+	__m128i gg = LOADU(g + i);
+	__m128i bb = LOADU(b + i);
+	__m128i rg[2] = { _mm_unpacklo_epi8(rr, gg), _mm_unpackhi_epi8(rr, gg) };
+	__m128i b0[2] = { _mm_unpacklo_epi8(bb, zero),
+			  _mm_unpackhi_epi8(bb, zero) };
+	__m128i *d = (__m128i*)(dst + i);
+	// the alpha components are left as they are.
+	for (int k=0; k<2; k++){
+	    __m128i p0 = _mm_or_si128(_mm_unpacklo_epi16(rg[k], b0[k]),
+				      _mm_and_si128(LOADU(d), alpha));
+	    __m128i p1 = _mm_or_si128(_mm_unpackhi_epi16(rg[k], b0[k]),
+				      _mm_and_si128(LOADU(d + 1), alpha));
+	    _mm_storeu_si128(d, p0);
+	    _mm_storeu_si128(d + 1, p1);
+	    d += 2;
+	}
+    }
+    return i;
+}
+#undef LOADU
+
+#endif // #ifdef X86_SIMD
+
+static int (*rgba_kernel)(RGBA*, const UCHAR*, int) = rgba_none;
+static int (*bgr_kernel)(UCHAR*, const UCHAR*, int) = bgr_none;
+static void (*add_row_kernel)(unsigned short*, const UCHAR*, int) = add_row_none;
+static int (*y16to8_kernel)(UCHAR*, const UCHAR*, int, int) = y16to8_none;
+static int (*y16swap_kernel)(unsigned short*, const UCHAR*, int)
+    = y16swap_none;
+static int (*uyvy_split_kernel)(UCHAR*, UCHAR*, const UCHAR*, int)
+    = uyvy_split_none;
+static int (*uv_split_kernel)(UCHAR*, UCHAR*, const UCHAR*, int)
+    = uv_split_none;
+static int (*avg_row_kernel)(UCHAR*, const UCHAR*, const UCHAR*, int)
+    = avg_row_none;
+static int (*bilinear_kernel)(UCHAR*, UCHAR*, UCHAR*, const UCHAR*,
+			      const UCHAR*, const UCHAR*, int, int)
+    = bilinear_none;
+static int (*green_kernel)(UCHAR*, const UCHAR*, const UCHAR*, const UCHAR*,
+			   const UCHAR*, const UCHAR*, int, int) = green_none;
+static int (*chroma_kernel)(UCHAR*, UCHAR*, const UCHAR*, const UCHAR*,
+			    const UCHAR*, const UCHAR*, const UCHAR*,
+			    const UCHAR*, int, int) = chroma_none;
+static int (*half_kernel)(UCHAR*, UCHAR*, UCHAR*, const UCHAR*, const UCHAR*,
+			  int, int) = half_none;
+static int (*planar_bgr_kernel)(UCHAR*, const UCHAR*, const UCHAR*,
+				const UCHAR*, int) = planar_bgr_none;
+static int (*planar_rgba_kernel)(RGBA*, const UCHAR*, const UCHAR*,
+				 const UCHAR*, int) = planar_rgba_none;
+
+/*
+ * Selects the kernels for this CPU.
+ *
+ * @param max_level  the most advanced instruction set to use.
+ *
+ * @return the instruction set selected.
+ */
+int
+select_simd_kernel(int max_level)
+{
+    int level = SIMD_NONE;
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    if (max_level >= SIMD_AVX2 && __builtin_cpu_supports("avx2"))
+	level = SIMD_AVX2;
+    else if (max_level >= SIMD_SSE2 && __builtin_cpu_supports("sse2"))
+	level = SIMD_SSE2;
+#endif
+
+    switch (level){
+#ifdef X86_SIMD
+    case SIMD_AVX2:
+    case SIMD_SSE2:
+	rgba_kernel = (level == SIMD_AVX2) ? rgba_avx2 : rgba_sse2;
+	bgr_kernel  = (level == SIMD_AVX2) ? bgr_avx2 : bgr_sse2;
+	add_row_kernel = add_row_sse2;
+	y16to8_kernel = (level == SIMD_AVX2) ? y16to8_avx2 : y16to8_sse2;
+	y16swap_kernel = (level == SIMD_AVX2) ? y16swap_avx2 : y16swap_sse2;
+	uyvy_split_kernel = uyvy_split_sse2;
+	uv_split_kernel = uv_split_sse2;
+	avg_row_kernel = avg_row_sse2;
+	bilinear_kernel = bilinear_sse2;
+	green_kernel = green_sse2;
+	chroma_kernel = chroma_sse2;
+	half_kernel = half_sse2;
+	planar_bgr_kernel = planar_bgr_sse2;
+	planar_rgba_kernel = planar_rgba_sse2;
+	break;
+#endif
+    default:
+	rgba_kernel = rgba_none;
+	bgr_kernel  = bgr_none;
+	add_row_kernel = add_row_none;
+	y16to8_kernel = y16to8_none;
+	y16swap_kernel = y16swap_none;
+	uyvy_split_kernel = uyvy_split_none;
+	uv_split_kernel = uv_split_none;
+	avg_row_kernel = avg_row_none;
+	bilinear_kernel = bilinear_none;
+	green_kernel = green_none;
+	chroma_kernel = chroma_none;
+	half_kernel = half_none;
+	planar_bgr_kernel = planar_bgr_none;
+	planar_rgba_kernel = planar_rgba_none;
+	break;
+    }
+    return level;
+}
+
+/*
+ * convert the leading pixels of a YUV422 packet to RGBA.
+ *
+ * @param dst        pointer to destination.
+ * @param src        pointer to UYVY data.
+ * @param num_pixel  the number of pixels in the packet.
+ *
+ * @return the number of pixels converted.
+ */
+int
+conv_YUV422toRGBA_simd(RGBA* dst, const UCHAR* src, int num_pixel)
+{
+    return rgba_kernel(dst, src, num_pixel);
+}
+
+/*
+ * convert the leading pixels of a YUV422 packet to BGR.
+ *
+ * @param dst        pointer to destination.
+ * @param src        pointer to UYVY data.
+ * @param num_pixel  the number of pixels in the packet.
+ *
+ * @return the number of pixels converted.
+ */
+int
+conv_YUV422toBGR_simd(UCHAR* dst, const UCHAR* src, int num_pixel)
+{
+    return bgr_kernel(dst, src, num_pixel);
+}
+
+/*
+ * adds a row of bytes to 16bit sums.
+ *
+ * @param sum  pointer to n sums.
+ * @param row  pointer to n bytes.
+ * @param n
+ */
+void
+add_row_simd(unsigned short* sum, const UCHAR* row, int n)
+{
+    add_row_kernel(sum, row, n);
+}
+
+/*
+ * convert the leading pixels of Y16 to 8bit.
+ *
+ * @param dst        pointer to destination.
+ * @param src        pointer to big endian Y16 data.
+ * @param num_pixel  the number of pixels.
+ * @param shift      each pixel is shifted right by this, and saturated.
+ *
+ * @return the number of pixels converted.
+ */
+int
+conv_Y16to8_simd(UCHAR* dst, const UCHAR* src, int num_pixel, int shift)
+{
+    return y16to8_kernel(dst, src, num_pixel, shift);
+}
+
+/*
+ * convert the leading pixels of Y16 to the host byte order.
+ */
+int
+conv_Y16swap_simd(unsigned short* dst, const UCHAR* src, int num_pixel)
+{
+    return y16swap_kernel(dst, src, num_pixel);
+}
+
+/*
+ * split the leading pixels of YUV422 to Y and interleaved u,v.
+ *
+ * @param y          pointer to num_pixel bytes of Y.
+ * @param uv         pointer to num_pixel bytes of u,v,u,v,...
+ * @param src        pointer to UYVY data.
+ * @param num_pixel  the number of pixels.
+ *
+ * @return the number of pixels done.
+ */
+int
+conv_UYVY_split_simd(UCHAR* y, UCHAR* uv, const UCHAR* src, int num_pixel)
+{
+    return uyvy_split_kernel(y, uv, src, num_pixel);
+}
+
+/*
+ * split the leading pairs of interleaved u,v.
+ *
+ * @return the number of pairs done.
+ */
+int
+conv_UV_split_simd(UCHAR* u, UCHAR* v, const UCHAR* uv, int num_pair)
+{
+    return uv_split_kernel(u, v, uv, num_pair);
+}
+
+/*
+ * average the leading bytes of two rows, rounding up.
+ *
+ * @return the number of bytes done.
+ */
+int
+avg_row_simd(UCHAR* dst, const UCHAR* a, const UCHAR* b, int n)
+{
+    return avg_row_kernel(dst, a, b, n);
+}
+
+/*
+ * demosaic the leading pixels of a row bilinearly.
+ */
+int
+bayer_bilinear_simd(UCHAR* own, UCHAR* g, UCHAR* other,
+		    const UCHAR* u, const UCHAR* c, const UCHAR* d,
+		    int num_pixel, int gf)
+{
+    return bilinear_kernel(own, g, other, u, c, d, num_pixel, gf);
+}
+
+/*
+ * interpolate G of the leading pixels of a row along the edges.
+ */
+int
+bayer_green_simd(UCHAR* g, const UCHAR* uu, const UCHAR* u,
+		 const UCHAR* c, const UCHAR* d, const UCHAR* dd,
+		 int num_pixel, int gf)
+{
+    return green_kernel(g, uu, u, c, d, dd, num_pixel, gf);
+}
+
+/*
+ * interpolate R and B of the leading pixels of a row from the color
+ * differences to G.
+ */
+int
+bayer_chroma_simd(UCHAR* own, UCHAR* other,
+		  const UCHAR* gu, const UCHAR* gc, const UCHAR* gd,
+		  const UCHAR* u, const UCHAR* c, const UCHAR* d,
+		  int num_pixel, int gf)
+{
+    return chroma_kernel(own, other, gu, gc, gd, u, c, d, num_pixel, gf);
+}
+
+/*
+ * make the leading 2x2 blocks of a pair of rows into pixels.
+ */
+int
+bayer_half_simd(UCHAR* own, UCHAR* g, UCHAR* other,
+		const UCHAR* t, const UCHAR* b, int num_pixel, int gf)
+{
+    return half_kernel(own, g, other, t, b, num_pixel, gf);
+}
+
+/*
+ * interleave the leading pixels of planes of R, G and B to BGR.
+ */
+int
+conv_planar_toBGR_simd(UCHAR* dst, const UCHAR* r, const UCHAR* g,
+		       const UCHAR* b, int num_pixel)
+{
+    return planar_bgr_kernel(dst, r, g, b, num_pixel);
+}
+
+/*
+ * interleave the leading pixels of planes of R, G and B to RGBA.
+ */
+int
+conv_planar_toRGBA_simd(RGBA* dst, const UCHAR* r, const UCHAR* g,
+			const UCHAR* b, int num_pixel)
+{
+    return planar_rgba_kernel(dst, r, g, b, num_pixel);
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,237 @@
+/*!
+  @file  yuv_planar.cc
+  @brief repack YUV411/YUV422/YUV444 frames into planar YUV
+  @author  YOSHIMOTO,Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "yuv.h"
+#include "yuv_simd.h"
+
+using namespace std;
+
+/*
+ * Each row of the frame is split into its Y and a row of interleaved
+ * u,v at half the width (u0 v0 u1 v1 ...), which is already a row of
+ * the UV plane of NV12. YUV411 doubles its u,v and YUV444 averages
+ * each pair of them. For 4:2:0, the u,v of two rows are averaged.
+ * Finally the u,v are split into the planes, unless NV12.
+ *
+ * Nothing is converted between the color spaces; the bytes are only
+ * moved and averaged.
+ */
+
+static inline int
+avg(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+/*
+ * splits a row to Y and interleaved u,v of width/2 pairs.
+ */
+static void
+split_row(UCHAR* y, UCHAR* uv, const UCHAR* src, int width, int fmt)
+{
+    int x = 0;
+    switch (fmt){
+    case FMT_YUV422:
+	// u Y v Y
+	x = conv_UYVY_split_simd(y, uv, src, width);
+	for (src+=x*2; x<width; x+=2, src+=4){
+	    uv[x+0] = src[0];
+	    y [x+0] = src[1];
+	    uv[x+1] = src[2];
+	    y [x+1] = src[3];
+	}
+	break;
+    case FMT_YUV411:
+	// u Y Y v Y Y
+	for (; x+4<=width; x+=4, src+=6){
+	    y [x+0] = src[1];
+	    y [x+1] = src[2];
+	    y [x+2] = src[4];
+	    y [x+3] = src[5];
+	    uv[x+0] = uv[x+2] = src[0];
+	    uv[x+1] = uv[x+3] = src[3];
+	}
+	break;
+    case FMT_YUV444:
+	// u Y v
+	for (; x<width; x+=2, src+=6){
+	    y [x+0] = src[1];
+	    y [x+1] = src[4];
+	    uv[x+0] = avg(src[0], src[3]);
+	    uv[x+1] = avg(src[2], src[5]);
+	}
+	break;
+    }
+}
+
+/*
+ * stores a row of interleaved u,v to the chroma planes.
+ */
+static void
+store_uv(const PlanarYUV* dst, int layout, int row, const UCHAR* uv,
+	 int num_pair)
+{
+    if (PLANAR_NV12 == layout){
+	memcpy(dst->u + (size_t)row * dst->u_step, uv, num_pair*2);
+	return;
+    }
+    UCHAR *u = dst->u + (size_t)row * dst->u_step;
+    UCHAR *v = dst->v + (size_t)row * dst->v_step;
+    int x = conv_UV_split_simd(u, v, uv, num_pair);
+    for (; x<num_pair; x++){
+	u[x] = uv[2*x+0];
+	v[x] = uv[2*x+1];
+    }
+}
+
+/*
+ * repack YUV411/YUV422/YUV444 to planar YUV.
+ *
+ * For PLANAR_I420 and PLANAR_NV12, the u,v of each pair of rows are
+ * averaged, so first_row must be even; the last row of an odd height
+ * has its own u,v.
+ *
+ * @param dst        the planes. \sa SetupPlanarYUV()
+ * @param layout     PLANAR_I420, PLANAR_NV12 or PLANAR_YV16.
+ * @param frame      pointer to source image data.
+ * @param width      the width of the frame, which must be even.
+ * @param height     the height of the frame.
+ * @param packet_sz  the size of each packet.
+ * @param flag       FMT_YUV411, FMT_YUV422 or FMT_YUV444 | REMOVE_HEADER
+ * @param first_row  the first row of the frame to store.
+ * @param num_rows   the number of rows to store, or -1 for all.
+ *
+ * @return false if the parameters are not supported.
+ */
+bool
+copy_toPlanarYUV(const PlanarYUV* dst, int layout, const void* frame,
+		 int width, int height, int packet_sz, int flag,
+		 int first_row, int num_rows)
+{
+    int fmt = flag & FMT_MASK;
+    int row_bytes;
+    switch (fmt){
+    case FMT_YUV411:
+	row_bytes = width * 3 / 2;
+	break;
+    case FMT_YUV422:
+	row_bytes = width * 2;
+	break;
+    case FMT_YUV444:
+	row_bytes = width * 3;
+	break;
+    default:
+	return false;
+    }
+    bool sub = (PLANAR_I420 == layout || PLANAR_NV12 == layout);
+    if (!sub && PLANAR_YV16 != layout)
+	return false;
+    if (width <= 0 || (width & 1) || (FMT_YUV411 == fmt && (width & 3)))
+	return false;
+    if (first_row < 0 || height < first_row || (sub && (first_row & 1)))
+	return false;
+    if (num_rows < 0 || first_row + num_rows > height)
+	num_rows = height - first_row;
+
+    const UCHAR *src = (const UCHAR*)frame;
+    vector<UCHAR> tmp(row_bytes);
+    vector<UCHAR> work(width * 2);
+    UCHAR *uv = &work[0], *prev = uv + width;
+    for (int y=first_row; y<first_row+num_rows; y++){
+	const UCHAR *row = get_frame_row(src, y, row_bytes, packet_sz, flag,
+					 &tmp[0]);
+	UCHAR *py = dst->y + (size_t)y * dst->y_step;
+	if (!sub){
+	    split_row(py, uv, row, width, fmt);
+	    store_uv(dst, layout, y, uv, width/2);
+	    continue;
+	}
+	if (0 == (y & 1)){
+	    split_row(py, prev, row, width, fmt);
+	    if (y+1 == height)
+		store_uv(dst, layout, y/2, prev, width/2);
+	    continue;
+	}
+	split_row(py, uv, row, width, fmt);
+	int x = avg_row_simd(uv, uv, prev, width);
+	for (; x<width; x++)
+	    uv[x] = avg(uv[x], prev[x]);
+	store_uv(dst, layout, y/2, uv, width/2);
+    }
+    return true;
+}
+
+/*
+ * sets up the planes of planar YUV in a buffer.
+ *
+ * The planes are stored one after another, in the order of Y, U, V
+ * for PLANAR_I420, Y, UV for PLANAR_NV12, and Y, V, U for
+ * PLANAR_YV16. Each row of the planes begins at a multiple of align.
+ *
+ * @param dst     the planes to set up.
+ * @param buf     the buffer, aligned to 'align', or NULL to get the size.
+ * @param width   the width of the frame.
+ * @param height  the height of the frame.
+ * @param layout  PLANAR_I420, PLANAR_NV12 or PLANAR_YV16.
+ * @param align   the alignment of the rows, a power of 2.
+ *
+ * @return the size of the buffer in bytes, or -1 on error.
+ */
+int
+SetupPlanarYUV(PlanarYUV* dst, UCHAR* buf, int width, int height,
+	       int layout, int align)
+{
+    if (width <= 0 || height <= 0 || align <= 0 || (align & (align-1)))
+	return -1;
+
+    int c_w = (width + 1) / 2, c_h = (height + 1) / 2;
+    switch (layout){
+    case PLANAR_I420:
+	break;
+    case PLANAR_NV12:
+	c_w *= 2;
+	break;
+    case PLANAR_YV16:
+	c_h = height;
+	break;
+    default:
+	return -1;
+    }
+    int y_step = (width + align - 1) & ~(align - 1);
+    int c_step = (c_w + align - 1) & ~(align - 1);
+    size_t y_size = (size_t)y_step * height;
+    size_t c_size = (size_t)c_step * c_h;
+    int num_c = (PLANAR_NV12 == layout) ? 1 : 2;
+
+    if (dst){
+	dst->y = buf;
+	dst->y_step = y_step;
+	dst->u_step = dst->v_step = c_step;
+	if (!buf){
+	    dst->u = dst->v = NULL;
+	} else if (PLANAR_YV16 == layout){
+	    dst->v = buf + y_size;
+	    dst->u = dst->v + c_size;
+	} else {
+	    dst->u = buf + y_size;
+	    dst->v = (PLANAR_NV12 == layout) ? NULL : dst->u + c_size;
+	}
+    }
+    return y_size + num_c * c_size;
+}
+
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,83 @@
+/*!
+  @file    yuv_simd.h
+  @brief   vectorized kernels for the color conversion
+  @author  YOSHIMOTO,Hiromasa <yosimoto@limu.is.kyushu-u.ac.jp>
+ */
+
+#if !defined(_YUV_SIMD_H_INCLUDED_)
+#define _YUV_SIMD_H_INCLUDED_
+
+#include "yuv.h"
+
+// instruction sets of the kernels.
+enum {
+    SIMD_NONE = 0,
+    SIMD_SSE2 = 1,
+    SIMD_AVX2 = 2,
+};
+
+int  select_simd_kernel(int max_level);
+
+/*
+ * The kernels convert the leading pixels of a packet, and return the
+ * number of the converted pixels. The caller converts the rest with
+ * the scalar code. The results are within +/-1 of the scalar code.
+ */
+int  conv_YUV422toRGBA_simd(RGBA* dst, const UCHAR* src, int num_pixel);
+int  conv_YUV422toBGR_simd(UCHAR* dst, const UCHAR* src, int num_pixel);
+
+// Y16 (big endian) to 8bit (shifted right and saturated), and to
+// the host byte order.
+int  conv_Y16to8_simd(UCHAR* dst, const UCHAR* src, int num_pixel, int shift);
+int  conv_Y16swap_simd(unsigned short* dst, const UCHAR* src, int num_pixel);
+
+// YUV422 to Y and interleaved u,v; u,v to planes; (a+b+1)/2 of rows.
+int  conv_UYVY_split_simd(UCHAR* y, UCHAR* uv, const UCHAR* src,
+			  int num_pixel);
+int  conv_UV_split_simd(UCHAR* u, UCHAR* v, const UCHAR* uv, int num_pair);
+int  avg_row_simd(UCHAR* dst, const UCHAR* a, const UCHAR* b, int n);
+
+// adds n bytes of a row to 16bit sums, for the box filter.
+void add_row_simd(unsigned short* sum, const UCHAR* row, int n);
+
+/*
+ * The Bayer kernels take rows padded by 2 pixels on each side: u, c
+ * and d are the rows above, at and below the output row, and uu, dd
+ * are two rows away. 'gf' is 1 if the first pixel of the row is
+ * green. 'own' is the color of the row (R on a row of R and G) and
+ * 'other' is the other one. They return the number of pixels done,
+ * like the YUV kernels.
+ */
+int  bayer_bilinear_simd(UCHAR* own, UCHAR* g, UCHAR* other,
+			 const UCHAR* u, const UCHAR* c, const UCHAR* d,
+			 int num_pixel, int gf);
+int  bayer_green_simd(UCHAR* g, const UCHAR* uu, const UCHAR* u,
+		      const UCHAR* c, const UCHAR* d, const UCHAR* dd,
+		      int num_pixel, int gf);
+int  bayer_chroma_simd(UCHAR* own, UCHAR* other,
+		       const UCHAR* gu, const UCHAR* gc, const UCHAR* gd,
+		       const UCHAR* u, const UCHAR* c, const UCHAR* d,
+		       int num_pixel, int gf);
+// makes each 2x2 block of rows t and b into a pixel; no padding needed.
+int  bayer_half_simd(UCHAR* own, UCHAR* g, UCHAR* other,
+		     const UCHAR* t, const UCHAR* b, int num_pixel, int gf);
+
+// interleaves planes of R, G and B.
+int  conv_planar_toBGR_simd(UCHAR* dst, const UCHAR* r, const UCHAR* g,
+			    const UCHAR* b, int num_pixel);
+int  conv_planar_toRGBA_simd(RGBA* dst, const UCHAR* r, const UCHAR* g,
+			     const UCHAR* b, int num_pixel);
+
+// defined in yuv2rgb.cc
+const UCHAR* get_frame_row(const UCHAR* frame, int row, int row_bytes,
+			   int packet_sz, int flag, UCHAR* tmp);
+void conv_Y16to8(UCHAR* dst, const UCHAR* src, int num_pixel, int flag,
+		 const UCHAR* lut);
+
+#endif //#if !defined(_YUV_SIMD_H_INCLUDED_)
+/*
+ * Local Variables:
+ * mode:c++
+ * c-basic-offset: 4
+ * End:
+ */
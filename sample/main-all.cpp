@@ -79,9 +79,8 @@ int main(int argc, char **argv)
      ::CreateYUVtoRGBAMap();
   
 
-     // kick cameras to start sending images.
-     for (cam=CameraList.begin(); cam!=CameraList.end(); cam++)
-	  cam->StartIsoTx();
+     // kick cameras to start sending images at once.
+     StartIsoTxAll(CameraList);
      
      /* show live images  */
      int n=0;